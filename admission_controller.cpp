@@ -0,0 +1,81 @@
+#include "admission_controller.hpp"
+
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+
+#include "clock.hpp"
+#include "globals.hpp"
+
+// Time for a frame duration change to reach the sensor and show up in the backlog
+static const uint64_t ADJUSTMENT_INTERVAL_USEC = 1000000;
+static const int64_t MIN_FRAME_DURATION_USEC = 1000000 / FPS;
+static const int64_t MAX_FRAME_DURATION_USEC = 1000000 / ADMISSION_MIN_FPS;
+
+AdmissionController::AdmissionController(const std::string &labels)
+    : m_frame_duration_usec(MIN_FRAME_DURATION_USEC),
+      m_shed_decimated("libcam_frames_shed_total", "Captured frames shed by admission control",
+                       labels + ",reason=\"decimate\""),
+      m_shed_stale("libcam_frames_shed_total", "Captured frames shed by admission control",
+                   labels + ",reason=\"stale\"")
+{
+}
+
+bool AdmissionController::admit(size_t backlog)
+{
+    // Overloaded from the high watermark until downstream drains completely
+    if (!m_overloaded && backlog >= ADMISSION_BACKLOG_HIGH)
+    {
+        spdlog::debug("Pipeline is overloaded with {} frames queued", backlog);
+        m_overloaded = true;
+    }
+    else if (m_overloaded && backlog == 0)
+    {
+        spdlog::debug("Pipeline caught up");
+        m_overloaded = false;
+    }
+
+    m_frames++;
+
+    switch (ADMISSION_POLICY)
+    {
+    case AdmissionPolicy::Decimate:
+        if (m_overloaded && m_frames % ADMISSION_DECIMATION == 0)
+        {
+            m_shed_decimated.add();
+            return false;
+        }
+        return true;
+    case AdmissionPolicy::FrameRate:
+        adjust_frame_duration();
+        return true;
+    default:
+        return true;
+    }
+}
+
+bool AdmissionController::sheds_queued() const
+{
+    return ADMISSION_POLICY == AdmissionPolicy::LatestOnly;
+}
+
+void AdmissionController::adjust_frame_duration()
+{
+    auto now = monotonic_usec();
+    if (now < m_next_adjustment_usec)
+    {
+        return;
+    }
+
+    auto duration = m_frame_duration_usec.load(std::memory_order_relaxed);
+    auto new_duration = m_overloaded ? std::min(MAX_FRAME_DURATION_USEC, duration * 5 / 4)
+                                     : std::max(MIN_FRAME_DURATION_USEC, duration * 4 / 5);
+
+    if (new_duration != duration)
+    {
+        spdlog::info("Adjusting camera frame rate to {:.1f} fps", 1e6 / new_duration);
+        m_frame_duration_usec.store(new_duration, std::memory_order_relaxed);
+    }
+
+    m_next_adjustment_usec = now + ADJUSTMENT_INTERVAL_USEC;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "metrics.hpp"
+
+// Decides which captured frames enter the pipeline according to ADMISSION_POLICY. Load is measured
+// by the frames queued downstream of the camera. Shed frames never reach the sink, so the frames
+// that do keep their sensor timestamps in capture order
+class AdmissionController
+{
+public:
+    // Labels identify the camera in the shed frame counters
+    AdmissionController(const std::string &labels);
+
+    // Called on the capture thread for every frame. False sheds the frame
+    bool admit(size_t backlog);
+    // Whether frames still queued are shed once a newer frame is admitted behind them
+    bool sheds_queued() const;
+    // Counts a queued frame shed for a newer one
+    void count_shed_queued() { m_shed_stale.add(); }
+
+    // Frame duration the sensor should run at. Changes only under the FrameRate policy
+    int64_t frame_duration_usec() const { return m_frame_duration_usec.load(std::memory_order_relaxed); }
+
+private:
+    void adjust_frame_duration();
+
+    bool m_overloaded = false;
+    uint64_t m_frames = 0;
+    uint64_t m_next_adjustment_usec = 0;
+    std::atomic<int64_t> m_frame_duration_usec;
+
+    Counter m_shed_decimated;
+    Counter m_shed_stale;
+};
@@ -0,0 +1,170 @@
+// Drives the decode, encode and streaming pipeline from a virtual camera as fast as it goes and
+// reports throughput, stage latencies and resource usage per configuration.
+//
+// Usage: libcam-bench [-n frames] [-r replay file -f MJPEG|YUV420|NV12 -s WIDTHxHEIGHT]
+// Without a replay file, every format runs at every resolution of the matrix on a test pattern
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "metrics.hpp"
+#include "virtual_camera.hpp"
+
+static const uint64_t DEFAULT_FRAMES = 500;
+
+struct Resolution
+{
+    size_t width;
+    size_t height;
+};
+
+static const Resolution RESOLUTIONS[] = {{640, 480}, {1280, 720}, {1920, 1080}};
+static const char *FORMATS[] = {"MJPEG", "YUV420", "NV12"};
+
+static std::string stage_latency(const char *name)
+{
+    auto histogram = dynamic_cast<const Histogram *>(MetricsRegistry::instance().find(name));
+    if (!histogram || histogram->count() == 0)
+    {
+        return "-";
+    }
+
+    return fmt::format("{:.1f}/{:.1f}", histogram->percentile_usec(50) / 1000.0, histogram->percentile_usec(99) / 1000.0);
+}
+
+static void print_header()
+{
+    fmt::print("{:<8} {:>10} {:>7} {:>8} {:>8} {:>11} {:>11} {:>11} {:>11} {:>8} {:>9}\n",
+               "format", "size", "frames", "fps", "dropped", "parse ms", "decode ms", "scale ms", "encode ms",
+               "cpu s", "rss MiB");
+    fmt::print("{:>59} {:>11} {:>11} {:>11}\n", "p50/p99", "p50/p99", "p50/p99", "p50/p99");
+}
+
+// Runs in a child process, so metrics, CPU time and peak RSS only cover this configuration
+static void run(const VirtualCameraConfig &config, std::string format)
+{
+    auto start = std::chrono::steady_clock::now();
+    {
+        VirtualCamera camera(config);
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    auto encode_time = dynamic_cast<const Histogram *>(MetricsRegistry::instance().find("libcam_encode_seconds"));
+    auto encoded = encode_time ? encode_time->count() : 0;
+
+    // Every stage and admission control, whatever the labels of the camera
+    uint64_t dropped = 0;
+    for (auto name : {"libcam_frames_dropped_total", "libcam_frames_shed_total"})
+    {
+        for (auto metric : MetricsRegistry::instance().find_all(name))
+        {
+            if (auto counter = dynamic_cast<const Counter *>(metric))
+            {
+                dropped += counter->value();
+            }
+        }
+    }
+
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    auto cpu_time = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+
+    fmt::print("{:<8} {:>10} {:>7} {:>8.1f} {:>8} {:>11} {:>11} {:>11} {:>11} {:>8.2f} {:>9.1f}\n",
+               format, fmt::format("{}x{}", config.metadata.width, config.metadata.height), encoded,
+               encoded / elapsed, dropped, stage_latency("libcam_jpeg_parse_seconds"),
+               stage_latency("libcam_jpeg_decode_seconds"), stage_latency("libcam_scale_seconds"),
+               stage_latency("libcam_encode_seconds"), cpu_time, usage.ru_maxrss / 1024.0);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    spdlog::set_level(spdlog::level::warn);
+
+    uint64_t frames = DEFAULT_FRAMES;
+    std::string replay_path;
+    std::string replay_format = "MJPEG";
+    Resolution replay_size = RESOLUTIONS[1];
+
+    int option;
+    while ((option = getopt(argc, argv, "n:r:f:s:")) != -1)
+    {
+        switch (option)
+        {
+        case 'n':
+            frames = strtoull(optarg, nullptr, 10);
+            break;
+        case 'r':
+            replay_path = optarg;
+            break;
+        case 'f':
+            replay_format = optarg;
+            break;
+        case 's':
+            if (sscanf(optarg, "%zux%zu", &replay_size.width, &replay_size.height) != 2)
+            {
+                fmt::print(stderr, "Invalid frame size: {}\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fmt::print(stderr, "Usage: {} [-n frames] [-r replay file -f MJPEG|YUV420|NV12 -s WIDTHxHEIGHT]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<std::pair<std::string, Resolution>> configurations;
+    if (replay_path.empty())
+    {
+        for (auto format : FORMATS)
+        {
+            for (auto resolution : RESOLUTIONS)
+            {
+                configurations.emplace_back(format, resolution);
+            }
+        }
+    }
+    else
+    {
+        configurations.emplace_back(replay_format, replay_size);
+    }
+
+    print_header();
+
+    int failures = 0;
+    for (auto &[format, resolution] : configurations)
+    {
+        VirtualCameraConfig config{.metadata = {.format = Metadata::formatFromString(format),
+                                                .width = resolution.width,
+                                                .height = resolution.height,
+                                                .stride = resolution.width},
+                                   .replay_path = replay_path,
+                                   .fps = 0,
+                                   .max_frames = frames};
+
+        auto pid = fork();
+        if (pid == 0)
+        {
+            run(config, format);
+            // Process-wide servers are left to the OS
+            _exit(0);
+        }
+
+        int status = 0;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            fmt::print(stderr, "{} {}x{} failed\n", format, resolution.width, resolution.height);
+            failures++;
+        }
+    }
+
+    return failures ? 1 : 0;
+}
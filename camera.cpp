@@ -1,5 +1,6 @@
 #include "camera.hpp"
 
+#include <algorithm>
 #include <thread>
 #include <chrono>
 #include <functional>
@@ -7,13 +8,22 @@
 #include <csignal>
 
 #include <spdlog/spdlog.h>
+#include <libcamera/control_ids.h>
+#include <libcamera/formats.h>
 
+#include "clock.hpp"
+#include "encoder.hpp"
 #include "globals.hpp"
 #include "metadata.hpp"
-#include "encoder.hpp"
-#include "decoder.hpp"
+#include "metrics.hpp"
 
 static const auto INTERVAL = std::chrono::milliseconds(1000 / FPS);
+static const auto STATS_INTERVAL = std::chrono::seconds(5);
+
+static std::string camera_label(const libcamera::Camera &camera)
+{
+    return fmt::format("camera=\"{}\"", camera.id());
+}
 
 std::atomic_bool s_run = true;
 void signal_handler(int signal)
@@ -21,44 +31,49 @@ void signal_handler(int signal)
     s_run = false;
 }
 
-Camera::Camera()
+Camera::Camera(std::shared_ptr<libcamera::Camera> camera, const std::string &stream_path)
+    : m_camera(std::move(camera)),
+      m_frames_captured("libcam_frames_captured_total", "Frames completed by the camera", camera_label(*m_camera)),
+      m_frames_out_of_order("libcam_frames_out_of_order_total", "Frames dropped for a non-increasing sequence number",
+                            camera_label(*m_camera)),
+      m_frames_lost("libcam_frames_lost_total", "Frames missing from the camera sequence", camera_label(*m_camera)),
+      m_frames_sink_dropped("libcam_frames_dropped_total", "Frames dropped before decoding or encoding",
+                            camera_label(*m_camera) + ",stage=\"capture-sink\""),
+      m_admission(camera_label(*m_camera))
 {
-    m_manager->start();
+    spdlog::info("Opening camera {} for {}", m_camera->id(), stream_path);
 
-    auto cameras = m_manager->cameras();
-    if (cameras.empty())
-    {
-        spdlog::critical("Failed to find the camera");
-        throw;
-    }
-
-    m_camera = cameras[0];
-    spdlog::info("Found camera: {}", m_camera->id());
-
-    auto config = m_camera->generateConfiguration({libcamera::StreamRole::VideoRecording});
+    auto config = generate_configuration();
 
-    if (!config)
+    for (size_t n = 0; n < config->size(); n++)
     {
-        spdlog::critical("Failed to get raw config");
-        throw;
+        auto &stream_config = config->at(n);
+        spdlog::info("Config {}", stream_config.toString());
+
+        auto pixel_format = stream_config.toString();
+        auto metadata = Metadata{
+            .format = Metadata::formatFromString(pixel_format),
+            .width = stream_config.size.width,
+            .height = stream_config.size.height,
+            .stride = stream_config.stride};
+
+        // The viewfinder stream always gets a plain encoder, the main one may be simulcast
+        auto sink = n == 0 ? create_frame_sink(metadata, stream_path)
+                           : std::make_unique<Encoder>(metadata, stream_path + VIEWFINDER_PATH_SUFFIX,
+                                                       VIEWFINDER_BIT_RATE, false);
+
+        m_streams.push_back(CameraStream{.stream = nullptr,
+                                         .metadata = metadata,
+                                         .sink = std::move(sink),
+                                         .frame_releases = {},
+                                         .sink_stage = nullptr});
     }
 
-    auto stream_config = config->at(0);
-    spdlog::info("Config {}", stream_config.toString());
-
-    auto pixel_format = stream_config.toString();
-    Metadata metadata{
-        .format = Metadata::formatFromString(pixel_format),
-        .width = stream_config.size.width,
-        .height = stream_config.size.height};
-
-    if (metadata.format == Format::MJPEG)
+    for (size_t n = 0; n < m_streams.size(); n++)
     {
-        m_sink.reset(static_cast<IFrameSink *>(new Decoder(metadata)));
-    }
-    else
-    {
-        m_sink.reset(static_cast<IFrameSink *>(new Encoder(metadata)));
+        m_streams[n].sink_stage = std::make_unique<PipelineStage<CapturedFrame>>(
+            n == 0 ? "capture-sink" : "capture-vf", FRAME_QUEUE_DEPTH, [this, n](CapturedFrame &frame)
+            { deliver_frame(m_streams[n], frame); });
     }
 
     if (m_camera->acquire() != 0)
@@ -73,22 +88,46 @@ Camera::Camera()
         throw;
     }
 
-    auto streams = m_camera->streams();
-    if (streams.empty())
+    // Streams are assigned by configure
+    for (size_t n = 0; n < m_streams.size(); n++)
     {
-        spdlog::critical("Failed to find camera streams");
-        throw;
-    }
+        m_streams[n].stream = config->at(n).stream();
+        if (!m_streams[n].stream)
+        {
+            spdlog::critical("Failed to find camera streams");
+            throw;
+        }
 
-    spdlog::info("Found {} streams", streams.size());
-    auto stream = *streams.begin();
+        spdlog::info("Stream {} size: {}", n, m_streams[n].stream->configuration().size.toString());
+    }
 
-    spdlog::info("Stream size: {}", stream->configuration().size.toString());
+    allocate_buffers();
 
-    allocate_buffers(stream);
+    // Let the sensor pace frames instead of throttling requests
+    libcamera::ControlList controls;
+    if (m_camera->controls().count(&libcamera::controls::FrameDurationLimits))
+    {
+        const int64_t frame_duration_usec = 1000000 / FPS;
+        const int64_t frame_duration_limits[] = {frame_duration_usec, frame_duration_usec};
+        controls.set(libcamera::controls::FrameDurationLimits,
+                     libcamera::Span<const int64_t, 2>(frame_duration_limits));
+    }
+    else
+    {
+        spdlog::warn("Camera doesn't support frame duration limits");
+    }
 
-    m_camera->start();
     m_camera->requestCompleted.connect(this, &Camera::on_frame_received);
+    m_camera->start(&controls);
+
+    if (REQUEUE_MODE == RequeueMode::OnCompletion)
+    {
+        m_requeue = true;
+        while (auto request = next_buffer())
+        {
+            queue_request(request);
+        }
+    }
 
     m_worker = std::thread(std::bind(&Camera::worker_thread, this));
     std::signal(SIGINT, signal_handler);
@@ -98,32 +137,106 @@ Camera::Camera()
 Camera::~Camera()
 {
     m_worker.join();
+    m_requeue = false;
     m_camera->stop();
+
+    for (auto &stream : m_streams)
+    {
+        stream.sink_stage->stop();
+    }
+
+    // Zero-copy frames still held by the encoders reference requests and their buffers
+    for (auto &stream : m_streams)
+    {
+        stream.sink->push_frame(nullptr, 0, 0);
+        stream.sink.reset();
+    }
+
     m_requests_container.clear();
+    m_dma_mapper.clear();
     m_buffer_allocator.reset();
 
     m_camera->release();
     m_camera.reset();
+}
+
+std::unique_ptr<libcamera::CameraConfiguration> Camera::generate_configuration()
+{
+    // Each request carries a buffer of both streams, so the ISP scales the viewfinder frame for free
+    if (VIEWFINDER_STREAM)
+    {
+        auto config = m_camera->generateConfiguration({libcamera::StreamRole::VideoRecording,
+                                                       libcamera::StreamRole::Viewfinder});
+        if (config && config->size() == 2)
+        {
+            auto &viewfinder = config->at(1);
+            viewfinder.size = libcamera::Size(VIEWFINDER_WIDTH, VIEWFINDER_HEIGHT);
+            viewfinder.pixelFormat = libcamera::formats::YUV420;
+
+            // Validation may move the viewfinder to a format only the GPU understands
+            if (config->validate() != libcamera::CameraConfiguration::Invalid &&
+                (viewfinder.pixelFormat == libcamera::formats::YUV420 || viewfinder.pixelFormat == libcamera::formats::NV12))
+            {
+                return config;
+            }
+        }
+
+        spdlog::warn("Camera can't produce a viewfinder stream. Streaming the main stream only");
+    }
+
+    auto config = m_camera->generateConfiguration({libcamera::StreamRole::VideoRecording});
+
+    if (!config)
+    {
+        spdlog::critical("Failed to get raw config");
+        throw;
+    }
 
-    m_sink->push_frame(nullptr, 0, 0);
+    // Validation fills in the buffer layout, which the zero-copy path depends on
+    if (config->validate() == libcamera::CameraConfiguration::Invalid)
+    {
+        spdlog::critical("Failed to validate camera config");
+        throw;
+    }
+
+    return config;
 }
 
-void Camera::allocate_buffers(libcamera::Stream *stream)
+void Camera::allocate_buffers()
 {
     m_buffer_allocator = std::make_unique<libcamera::FrameBufferAllocator>(m_camera);
-    if (int res = m_buffer_allocator->allocate(stream); res <= 0)
+
+    // Every request takes one buffer of each stream
+    size_t num_requests = SIZE_MAX;
+    for (auto &stream : m_streams)
     {
-        spdlog::critical("Failed to allocate frame: {}", res);
-        m_camera->release();
-        throw;
+        if (int res = m_buffer_allocator->allocate(stream.stream); res <= 0)
+        {
+            spdlog::critical("Failed to allocate frame: {}", res);
+            m_camera->release();
+            throw;
+        }
+
+        num_requests = std::min(num_requests, m_buffer_allocator->buffers(stream.stream).size());
     }
-    spdlog::info("Allocated {} buffers", m_buffer_allocator->buffers(stream).size());
+    spdlog::info("Allocated {} buffers per stream", num_requests);
 
-    for (auto &buffer : m_buffer_allocator->buffers(stream))
+    m_queued_at_nsec = std::vector<std::atomic<uint64_t>>(num_requests);
+    m_pending_buffers = std::vector<std::atomic<uint32_t>>(num_requests);
+    m_deliveries = std::vector<std::atomic<Delivery>>(num_requests);
+
+    for (size_t n = 0; n < num_requests; n++)
     {
-        auto request = m_camera->createRequest();
+        auto request = m_camera->createRequest(n);
+
+        for (auto &stream : m_streams)
+        {
+            auto &buffer = m_buffer_allocator->buffers(stream.stream)[n];
+            request->addBuffer(stream.stream, buffer.get());
+            m_dma_mapper.map(*buffer);
+            stream.frame_releases.push_back(FrameRelease{.camera = this, .request = request.get(), .buffer = {}});
+        }
 
-        request->addBuffer(stream, buffer.get());
         m_available_requests.push_back(request.get());
         m_requests_container.emplace_back(std::move(request));
     }
@@ -131,6 +244,8 @@ void Camera::allocate_buffers(libcamera::Stream *stream)
 
 libcamera::Request *Camera::next_buffer()
 {
+    std::lock_guard lock(m_available_requests_lock);
+
     if (m_available_requests.empty())
     {
         return nullptr;
@@ -143,57 +258,284 @@ libcamera::Request *Camera::next_buffer()
 
 void Camera::on_frame_received(libcamera::Request *request)
 {
-    auto buffer = request->buffers().begin()->second;
-    auto frame_timestamp_nsec = buffer->metadata().timestamp;
-    auto sequence = buffer->metadata().sequence;
+    auto completion_time_nsec = monotonic_nsec() - m_queued_at_nsec[request->cookie()];
+    m_requests_in_flight--;
+    m_completed_requests++;
+    m_completion_time_sum_nsec += completion_time_nsec;
+    if (completion_time_nsec > m_completion_time_max_nsec)
+    {
+        m_completion_time_max_nsec = completion_time_nsec;
+    }
+
+    if (request->status() == libcamera::Request::RequestCancelled)
+    {
+        release_request(request);
+        return;
+    }
+
+    // Buffers of a request are captured together, the main one has the reference timing
+    auto main_buffer = request->findBuffer(m_streams[0].stream);
+    auto frame_timestamp_nsec = main_buffer->metadata().timestamp;
+    auto sequence = main_buffer->metadata().sequence;
+    m_frames_captured.add();
 
     // Fixe problem with non-monotonical pts
     if (sequence <= m_seq)
     {
+        m_frames_out_of_order.add();
+        release_request(request);
         return;
     }
 
+    if (m_seq != 0 && sequence > m_seq + 1)
+    {
+        m_frames_lost.add(sequence - m_seq - 1);
+    }
+
     m_seq = sequence;
 
-    auto buffer_data = m_dma_mapper.readBuffer(*buffer);
+    // Frames keep the sensor timestamp, so the capture time is known until the frame leaves the pipeline
+    uint64_t pts_usec = frame_timestamp_nsec / 1000;
 
-    auto bytes_used = buffer->metadata().planes().begin()->bytesused;
+    // The slowest stream sets the load, so the streams of a request are shed together
+    size_t backlog = 0;
+    for (auto &stream : m_streams)
+    {
+        backlog = std::max(backlog, stream.sink_stage->size() + stream.sink->backlog());
+    }
 
-    if (m_presentation_start_time == 0)
+    if (!m_admission.admit(backlog))
     {
-        spdlog::debug("Frame start timestamp: {}", frame_timestamp_nsec);
-        m_presentation_start_time = frame_timestamp_nsec;
+        release_request(request);
+        return;
     }
 
-    uint64_t pts_usec = (frame_timestamp_nsec - m_presentation_start_time) / 1000000;
+    shed_queued_request();
+    m_deliveries[request->cookie()] = Delivery::Queued;
+    m_last_admitted_cookie = request->cookie();
+    m_pending_buffers[request->cookie()] = m_streams.size();
 
-    spdlog::trace("Frame metadata bytes used: {}. Timestamp: {}, Seq: {}", bytes_used, pts_usec, sequence);
+    for (auto &stream : m_streams)
+    {
+        auto buffer = request->findBuffer(stream.stream);
+        auto buffer_data = m_dma_mapper.readBuffer(*buffer);
+        auto bytes_used = buffer->metadata().planes().begin()->bytesused;
 
-    m_sink->push_frame(buffer_data.data, bytes_used, pts_usec);
+        spdlog::trace("Frame metadata bytes used: {}. Timestamp: {}, Seq: {}", bytes_used, pts_usec, sequence);
+
+        if (!stream.sink_stage->push({.request = request, .buffer = buffer_data, .bytes_used = bytes_used, .pts_usec = pts_usec}))
+        {
+            spdlog::warn("Sink is saturated. Dropping frame {}", sequence);
+            m_frames_sink_dropped.add();
+            release_buffer(request);
+        }
+    }
+}
+
+void Camera::shed_queued_request()
+{
+    if (!m_admission.sheds_queued() || !m_last_admitted_cookie)
+    {
+        return;
+    }
+
+    // Fails once a stream has claimed the request, and for requests that are already released,
+    // so requests are shed and counted once, on every stream at the same time
+    auto expected = Delivery::Queued;
+    if (m_deliveries[*m_last_admitted_cookie].compare_exchange_strong(expected, Delivery::Shed))
+    {
+        m_admission.count_shed_queued();
+    }
+}
+
+bool Camera::claim_delivery(libcamera::Request *request)
+{
+    auto state = Delivery::Queued;
+    m_deliveries[request->cookie()].compare_exchange_strong(state, Delivery::Delivering);
+    return state != Delivery::Shed;
+}
+
+void Camera::deliver_frame(CameraStream &stream, const CapturedFrame &frame)
+{
+    if (!claim_delivery(frame.request))
+    {
+        release_buffer(frame.request);
+        return;
+    }
+
+    MmapedDmaBuf::begin_cpu_access(frame.buffer);
+
+    if (stream.metadata.format == Format::MJPEG)
+    {
+        stream.sink->push_frame(frame.buffer.planes[0].data, frame.bytes_used, frame.pts_usec);
+
+        MmapedDmaBuf::end_cpu_access(frame.buffer);
+        release_buffer(frame.request);
+        return;
+    }
+
+    // Raw frames are passed by reference to the dmabuf. The buffer is released when the last
+    // reference to the frame is dropped
+    auto av_frame = wrap_raw_frame(stream, frame);
+    if (!av_frame)
+    {
+        spdlog::error("Failed to wrap raw frame");
+        MmapedDmaBuf::end_cpu_access(frame.buffer);
+        release_buffer(frame.request);
+        return;
+    }
+
+    stream.sink->push_frame(av_frame);
+    av_frame_free(&av_frame);
+}
+
+AVFrame *Camera::wrap_raw_frame(CameraStream &stream, const CapturedFrame &frame)
+{
+    auto &buffer = frame.buffer;
+    auto &metadata = stream.metadata;
+    auto format = metadata.raw_pixel_format();
+    auto chroma_planes = format == AV_PIX_FMT_NV12 ? 1 : 2;
+    auto chroma_stride = format == AV_PIX_FMT_NV12 ? metadata.stride : metadata.stride / 2;
+    auto luma_size = metadata.stride * metadata.height;
+    auto chroma_size = chroma_stride * metadata.height / 2;
+
+    auto av_frame = av_frame_alloc();
+    if (!av_frame)
+    {
+        return nullptr;
+    }
+
+    av_frame->format = format;
+    av_frame->width = metadata.width;
+    av_frame->height = metadata.height;
+    av_frame->pts = frame.pts_usec;
+    av_frame->pkt_dts = frame.pts_usec;
+
+    av_frame->data[0] = buffer.planes[0].data;
+    av_frame->linesize[0] = metadata.stride;
+
+    for (int n = 1; n <= chroma_planes; n++)
+    {
+        // Single-plane buffers carry all color planes back to back
+        av_frame->data[n] = buffer.num_planes > 1
+                                ? buffer.planes[n].data
+                                : buffer.planes[0].data + luma_size + (n - 1) * chroma_size;
+        av_frame->linesize[n] = chroma_stride;
+    }
+
+    auto &release = stream.frame_releases[frame.request->cookie()];
+    release.buffer = buffer;
+
+    av_frame->buf[0] = av_buffer_create(buffer.planes[0].data, luma_size + chroma_planes * chroma_size,
+                                        &Camera::release_frame_buffer, &release, AV_BUFFER_FLAG_READONLY);
+    if (!av_frame->buf[0])
+    {
+        av_frame_free(&av_frame);
+        return nullptr;
+    }
+
+    return av_frame;
+}
+
+void Camera::release_frame_buffer(void *opaque, uint8_t *data)
+{
+    auto release = static_cast<FrameRelease *>(opaque);
+
+    MmapedDmaBuf::end_cpu_access(release->buffer);
+    release->camera->release_buffer(release->request);
+}
+
+void Camera::release_buffer(libcamera::Request *request)
+{
+    // Streams release their buffers from different threads. The last one returns the request
+    if (m_pending_buffers[request->cookie()].fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        release_request(request);
+    }
+}
+
+void Camera::release_request(libcamera::Request *request)
+{
+    // Camera::queueRequest is thread-safe, so whichever stage releases the request requeues it
+    if (m_requeue)
+    {
+        queue_request(request);
+        return;
+    }
+
+    std::lock_guard lock(m_available_requests_lock);
     m_available_requests.push_back(request);
 }
 
+void Camera::queue_request(libcamera::Request *request)
+{
+    request->reuse(libcamera::Request::ReuseBuffers);
+
+    // Requests that change the frame duration carry the new limits. Reused requests have no controls
+    if (ADMISSION_POLICY == AdmissionPolicy::FrameRate && m_camera->controls().count(&libcamera::controls::FrameDurationLimits))
+    {
+        auto duration_usec = m_admission.frame_duration_usec();
+        if (m_applied_frame_duration_usec.exchange(duration_usec) != duration_usec)
+        {
+            const int64_t frame_duration_limits[] = {duration_usec, duration_usec};
+            request->controls().set(libcamera::controls::FrameDurationLimits,
+                                    libcamera::Span<const int64_t, 2>(frame_duration_limits));
+        }
+    }
+
+    m_queued_at_nsec[request->cookie()] = monotonic_nsec();
+    m_requests_in_flight++;
+
+    if (m_camera->queueRequest(request) != 0)
+    {
+        spdlog::warn("Failed to queue request");
+        m_requests_in_flight--;
+
+        std::lock_guard lock(m_available_requests_lock);
+        m_available_requests.push_back(request);
+    }
+}
+
+void Camera::report_request_stats()
+{
+    auto completed = m_completed_requests.exchange(0);
+    auto time_sum_nsec = m_completion_time_sum_nsec.exchange(0);
+    auto time_max_nsec = m_completion_time_max_nsec.exchange(0);
+
+    spdlog::debug("Requests in flight: {}/{}. Completed: {}. Requeue to completion avg: {:.2f} ms, max: {:.2f} ms",
+                  m_requests_in_flight.load(), m_requests_container.size(), completed,
+                  completed ? time_sum_nsec / completed / 1e6 : 0.0, time_max_nsec / 1e6);
+    spdlog::debug("DMA mapping hits: {}, misses: {}", m_dma_mapper.hits(), m_dma_mapper.misses());
+}
+
 void Camera::worker_thread()
 {
+    auto next_stats_report = std::chrono::steady_clock::now() + STATS_INTERVAL;
+
     while (s_run)
     {
-        auto request = next_buffer();
-
-        if (request)
+        if (REQUEUE_MODE == RequeueMode::Paced)
         {
-            request->reuse(libcamera::Request::ReuseBuffers);
+            auto request = next_buffer();
 
-            if (m_camera->queueRequest(request) != 0)
+            if (request)
             {
-                spdlog::warn("Failed to queue request");
+                queue_request(request);
+            }
+            else
+            {
+                spdlog::trace("Requesting is pending");
             }
         }
-        else
+
+        auto now = std::chrono::steady_clock::now();
+        if (now >= next_stats_report)
         {
-            spdlog::trace("Requesting is pending");
+            report_request_stats();
+            next_stats_report = now + STATS_INTERVAL;
         }
 
-        auto x = std::chrono::steady_clock::now() + INTERVAL;
+        auto x = now + INTERVAL;
         std::this_thread::sleep_until(x);
     }
 
@@ -3,6 +3,9 @@
 #include <thread>
 #include <memory>
 #include <atomic>
+#include <mutex>
+#include <optional>
+#include <string>
 #include <vector>
 
 #include <libcamera/camera_manager.h>
@@ -11,33 +14,111 @@
 #include <libcamera/base/signal.h>
 #include <libcamera/base/span.h>
 
+#include "admission_controller.hpp"
 #include "mmaped_dmabuf.hpp"
 #include "iframe_sink.hpp"
+#include "pipeline_stage.hpp"
+#include "metadata.hpp"
+#include "metrics.hpp"
 
+class Camera;
+
+// A completed buffer of a request travelling from the libcamera thread to a sink stage
+struct CapturedFrame
+{
+    libcamera::Request *request;
+    BufferData buffer;
+    size_t bytes_used;
+    uint64_t pts_usec;
+};
+
+// Opaque of zero-copy frame buffers. Releases the buffer of the request once the frame is freed
+struct FrameRelease
+{
+    Camera *camera;
+    libcamera::Request *request;
+    BufferData buffer;
+};
+
+// A configured stream of the camera and the sink it feeds. Decode/convert runs off the libcamera
+// completion thread on the sink stage
+struct CameraStream
+{
+    libcamera::Stream *stream;
+    Metadata metadata;
+    std::unique_ptr<IFrameSink> sink;
+    // Indexed by request cookie
+    std::vector<FrameRelease> frame_releases;
+    std::unique_ptr<PipelineStage<CapturedFrame>> sink_stage;
+};
+
+// Capture side of one camera pipeline. The camera manager is shared by all cameras and has to
+// outlive them
 class Camera final
 {
 public:
-    Camera();
+    Camera(std::shared_ptr<libcamera::Camera> camera, const std::string &stream_path);
     Camera(const Camera &other) = delete;
     Camera &operator==(const Camera &other) = delete;
     ~Camera();
 
 private:
-    void allocate_buffers(libcamera::Stream *stream);
+    // Whether the frames of a request are delivered. Decided once for all streams of the request
+    enum class Delivery : uint8_t
+    {
+        Queued,
+        Delivering,
+        Shed,
+    };
+
+    std::unique_ptr<libcamera::CameraConfiguration> generate_configuration();
+    void allocate_buffers();
     libcamera::Request *next_buffer();
     void on_frame_received(libcamera::Request *request);
+    void deliver_frame(CameraStream &stream, const CapturedFrame &frame);
+    // Sheds the last admitted request if no stream has started delivering it
+    void shed_queued_request();
+    bool claim_delivery(libcamera::Request *request);
+    AVFrame *wrap_raw_frame(CameraStream &stream, const CapturedFrame &frame);
+    static void release_frame_buffer(void *opaque, uint8_t *data);
+    void release_buffer(libcamera::Request *request);
+    void release_request(libcamera::Request *request);
+    void queue_request(libcamera::Request *request);
+    void report_request_stats();
     void worker_thread();
 
     MmapedDmaBuf m_dma_mapper = {};
-    std::unique_ptr<IFrameSink> m_sink = nullptr;
-    std::unique_ptr<libcamera::CameraManager>
-        m_manager = std::make_unique<libcamera::CameraManager>();
-    std::shared_ptr<libcamera::Camera> m_camera = nullptr;
+    std::shared_ptr<libcamera::Camera> m_camera;
     std::unique_ptr<libcamera::FrameBufferAllocator> m_buffer_allocator = nullptr;
     std::thread m_worker = {};
     std::vector<std::unique_ptr<libcamera::Request>> m_requests_container = {};
+    std::mutex m_available_requests_lock = {};
     std::vector<libcamera::Request *> m_available_requests = {};
 
-    uint64_t m_presentation_start_time = 0;
+    // The main stream, followed by the viewfinder stream if it's enabled and supported
+    std::vector<CameraStream> m_streams = {};
+    // Buffers of each request still held by sinks. The request is requeued once all are released
+    std::vector<std::atomic<uint32_t>> m_pending_buffers = {};
+    // Indexed by request cookie
+    std::vector<std::atomic<Delivery>> m_deliveries = {};
+    std::optional<uint64_t> m_last_admitted_cookie = std::nullopt;
+
+    // Request stats. Queue timestamps are indexed by request cookie
+    std::atomic_bool m_requeue = false;
+    std::vector<std::atomic<uint64_t>> m_queued_at_nsec = {};
+    std::atomic<uint32_t> m_requests_in_flight = 0;
+    std::atomic<uint64_t> m_completed_requests = 0;
+    std::atomic<uint64_t> m_completion_time_sum_nsec = 0;
+    std::atomic<uint64_t> m_completion_time_max_nsec = 0;
+
     uint64_t m_seq = 0;
+
+    Counter m_frames_captured;
+    Counter m_frames_out_of_order;
+    Counter m_frames_lost;
+    Counter m_frames_sink_dropped;
+
+    AdmissionController m_admission;
+    // Frame duration last sent to the sensor
+    std::atomic<int64_t> m_applied_frame_duration_usec = 0;
 };
\ No newline at end of file
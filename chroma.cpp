@@ -0,0 +1,48 @@
+#include "chroma.hpp"
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Rounding average of two rows, the same as pavgb and vrhadd
+static void average_rows(const uint8_t *top, const uint8_t *bottom, uint8_t *dst, size_t width)
+{
+    size_t x = 0;
+
+#if defined(__SSE2__)
+    for (; x + 16 <= width; x += 16)
+    {
+        auto a = _mm_loadu_si128((const __m128i *)(top + x));
+        auto b = _mm_loadu_si128((const __m128i *)(bottom + x));
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_avg_epu8(a, b));
+    }
+#elif defined(__ARM_NEON)
+    for (; x + 16 <= width; x += 16)
+    {
+        vst1q_u8(dst + x, vrhaddq_u8(vld1q_u8(top + x), vld1q_u8(bottom + x)));
+    }
+#endif
+
+    for (; x < width; x++)
+    {
+        dst[x] = (top[x] + bottom[x] + 1) >> 1;
+    }
+}
+
+void decimate_chroma_rows(const uint8_t *src, size_t src_stride, uint8_t *dst, size_t dst_stride,
+                          size_t width, size_t src_height)
+{
+    for (size_t y = 0; y + 1 < src_height; y += 2)
+    {
+        average_rows(src + y * src_stride, src + (y + 1) * src_stride, dst + y / 2 * dst_stride, width);
+    }
+
+    if (src_height % 2)
+    {
+        memcpy(dst + src_height / 2 * dst_stride, src + (src_height - 1) * src_stride, width);
+    }
+}
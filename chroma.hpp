@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Halves the vertical resolution of a chroma plane by averaging row pairs, e.g. to turn 4:2:2
+// into 4:2:0. Writes (src_height + 1) / 2 rows. A trailing odd row is copied as is
+void decimate_chroma_rows(const uint8_t *src, size_t src_stride, uint8_t *dst, size_t dst_stride,
+                          size_t width, size_t src_height);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// libcamera stamps frames with CLOCK_MONOTONIC, which is what steady_clock uses on Linux.
+// Frame timestamps are taken from this clock, so latencies can be measured anywhere in the pipeline
+inline uint64_t monotonic_nsec()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+inline uint64_t monotonic_usec()
+{
+    return monotonic_nsec() / 1000;
+}
@@ -0,0 +1,39 @@
+#include "cpu_affinity.hpp"
+
+#include <pthread.h>
+
+#include <spdlog/spdlog.h>
+#include <spdlog/fmt/ranges.h>
+
+ScopedCpuAffinity::ScopedCpuAffinity(const std::vector<int> &cores)
+{
+    if (cores.empty())
+    {
+        return;
+    }
+
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (auto core : cores)
+    {
+        CPU_SET(core, &cpu_set);
+    }
+
+    if (pthread_getaffinity_np(pthread_self(), sizeof(m_previous), &m_previous) != 0 ||
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0)
+    {
+        spdlog::warn("Failed to pin threads to cores {}. Running unpinned", cores);
+        return;
+    }
+
+    m_pinned = true;
+    spdlog::debug("Pinned threads to cores {}", cores);
+}
+
+ScopedCpuAffinity::~ScopedCpuAffinity()
+{
+    if (m_pinned)
+    {
+        pthread_setaffinity_np(pthread_self(), sizeof(m_previous), &m_previous);
+    }
+}
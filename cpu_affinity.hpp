@@ -0,0 +1,21 @@
+#pragma once
+
+#include <vector>
+
+#include <sched.h>
+
+// Pins the calling thread to a set of CPU cores while in scope. Threads started in the meantime
+// inherit the set, so constructing a pipeline in scope pins all of its stages and codec threads.
+// An empty set leaves the thread alone
+class ScopedCpuAffinity
+{
+public:
+    ScopedCpuAffinity(const std::vector<int> &cores);
+    ScopedCpuAffinity(const ScopedCpuAffinity &other) = delete;
+    ScopedCpuAffinity &operator=(const ScopedCpuAffinity &other) = delete;
+    ~ScopedCpuAffinity();
+
+private:
+    bool m_pinned = false;
+    cpu_set_t m_previous = {};
+};
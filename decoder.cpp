@@ -1,101 +1,61 @@
-
 #include "decoder.hpp"
 
-extern "C"
-{
-#include <libavformat/avformat.h>
-#include <libavutil/pixdesc.h>
-}
+#include <cstring>
 
+#include <spdlog/spdlog.h>
+
+#include "clock.hpp"
 #include "globals.hpp"
+#include "jpeg.hpp"
 
-Decoder::Decoder(Metadata metadata)
-    : m_metadata(metadata), m_encoder(std::make_unique<Encoder>(metadata))
-{
-    init();
-}
+static const uint64_t UTILIZATION_REPORT_INTERVAL_USEC = 5000000;
 
-Decoder::~Decoder()
+static Counter s_frames_dropped("libcam_frames_dropped_total", "Frames dropped before decoding or encoding", "stage=\"decode\"");
+static Counter s_frames_skipped("libcam_frames_dropped_total", "Frames dropped before decoding or encoding", "stage=\"decode-congestion\"");
+static Counter s_frames_rejected("libcam_jpeg_rejected_total", "Truncated or corrupt JPEG frames", "stage=\"decode\"");
+
+Decoder::Worker::Worker(size_t index, const std::string &stream_path, Metadata metadata, Decoder &owner)
+    : decoder(metadata),
+      busy_usec("libcam_decode_busy_microseconds_total", "Time decode workers spent decoding",
+                fmt::format("stream=\"{}\",worker=\"{}\"", stream_path.substr(stream_path.find_first_not_of('/')), index)),
+      stage(fmt::format("decode-{}", index), FRAME_QUEUE_DEPTH, [this, &owner](JpegFrame &frame)
+            { owner.decode_frame(*this, frame); })
 {
-    av_parser_close(m_codec_parser);
-    avcodec_free_context(&m_codec_context);
-    av_frame_free(&m_jpeg_frame);
-    av_packet_free(&m_packet);
 }
 
-void Decoder::init()
+Decoder::Decoder(Metadata metadata, const std::string &stream_path)
+    : m_metadata(metadata), m_encoder(create_encoder_sink(metadata, stream_path))
 {
-    if (m_metadata.format != Format::MJPEG)
+    if (MJPEG_DECODE_THREADS <= 1)
     {
+        m_inline_decoder = std::make_unique<JpegDecoder>(metadata);
         return;
     }
 
-    m_codec = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
-    if (!m_codec)
-    {
-        spdlog::critical("Decoder '{}' not found", "JPEG");
-        throw;
-    }
-    spdlog::info("Decoder was found succesfully: {}", m_codec->long_name);
-
-    m_codec_parser = av_parser_init(m_codec->id);
-    if (!m_codec_parser)
-    {
-        spdlog::critical("Failed to allocate decode parser");
-        throw;
-    }
-    m_codec_parser->flags |= PARSER_FLAG_COMPLETE_FRAMES;
-    m_codec_context = avcodec_alloc_context3(m_codec);
+    // Every worker holds at most its queue and the frame it decodes, so a window of that many frames
+    // is enough to reorder them. Frames beyond it are dropped
+    m_reorder.resize(MJPEG_DECODE_THREADS * (FRAME_QUEUE_DEPTH + 1), ReorderSlot{.ready = false, .frame = nullptr});
 
-    auto ret = avcodec_open2(m_codec_context, m_codec, nullptr);
-    if (ret < 0)
+    for (size_t n = 0; n < MJPEG_DECODE_THREADS; n++)
     {
-        spdlog::critical("Failed to open decoder: {}", "err2str");
-        throw;
+        m_workers.push_back(std::make_unique<Worker>(n, stream_path, metadata, *this));
     }
 
-    spdlog::info("Decoder opened succesfully");
+    spdlog::info("Decoding MJPEG on {} threads", m_workers.size());
 }
 
-void Decoder::init_scaler()
+Decoder::~Decoder()
 {
-    if (m_codec_context->pix_fmt < 0)
-    {
-        spdlog::critical("JPEG parser didn't return pix format");
-        exit(1);
-    }
-
-    spdlog::debug("Decoder pix fmt: {}", m_codec_context->pix_fmt);
-
-    m_scale_context = sws_getContext(m_metadata.width,
-                                     m_metadata.height,
-                                     m_codec_context->pix_fmt,
-                                     m_metadata.width,
-                                     m_metadata.height,
-                                     ENCODER_SRC_FORMAT,
-                                     SWS_BICUBIC,
-                                     nullptr,
-                                     nullptr,
-                                     nullptr);
-
-    if (!m_scale_context)
+    for (auto &worker : m_workers)
     {
-        spdlog::critical("Failed to initialize pix format rescaler");
-        throw;
+        worker->stage.stop();
     }
 
-    m_yuv_frame->format = ENCODER_SRC_FORMAT;
-    m_yuv_frame->width = m_metadata.width;
-    m_yuv_frame->height = m_metadata.height;
-
-    /* allocate the buffers for the frame data */
-    if (av_frame_get_buffer(m_yuv_frame, 32) < 0)
+    // Frames stuck behind a frame that never completed
+    for (auto &slot : m_reorder)
     {
-        spdlog::critical("Failed to allocate YUV frame buffers");
-        throw;
+        av_frame_free(&slot.frame);
     }
-
-    spdlog::info("Rescaler initialized succesfully");
 }
 
 void Decoder::push_frame(uint8_t const *data, size_t size, uint64_t pts_usec)
@@ -103,27 +63,51 @@ void Decoder::push_frame(uint8_t const *data, size_t size, uint64_t pts_usec)
     if (data == nullptr)
     {
         spdlog::info("Stream EOF");
+
+        // Workers finish their queues first, so every frame reaches the encoder before EOF
+        for (auto &worker : m_workers)
+        {
+            worker->stage.stop();
+        }
+
         m_encoder->push_frame(nullptr);
         return;
     }
 
-    if (fill_frame_from_jpeg(data, size))
+    // The encoder would shed the frame anyway, so it isn't worth decoding
+    if (skips_frame(pts_usec))
     {
-        if (covert_frame_format())
-        {
-            m_yuv_frame->pts = pts_usec;
-            m_yuv_frame->pkt_dts = pts_usec;
-            m_encoder->push_frame(m_yuv_frame);
-        }
-        else
-        {
-            spdlog::error("Failed to convert JPEG frame");
-        }
+        s_frames_skipped.add();
+        return;
     }
-    else
+
+    // The frame end is found once here. Truncated and corrupt frames never reach the decoders
+    auto jpeg_frame_size = find_jpeg_end(data, size);
+    if (jpeg_frame_size == 0 || !validate_jpeg_frame(data, jpeg_frame_size, m_metadata.width, m_metadata.height))
     {
-        spdlog::error("Failed to decode JPEG frame");
+        spdlog::warn("Rejected invalid JPEG frame");
+        s_frames_rejected.add();
+        return;
     }
+
+    if (m_inline_decoder)
+    {
+        auto yuv_frame = m_inline_decoder->decode(data, jpeg_frame_size);
+        if (!yuv_frame)
+        {
+            return;
+        }
+
+        yuv_frame->pts = pts_usec;
+        yuv_frame->pkt_dts = pts_usec;
+        m_encoder->push_frame(yuv_frame);
+
+        av_frame_free(&yuv_frame);
+        return;
+    }
+
+    dispatch(data, jpeg_frame_size, pts_usec);
+    report_utilization();
 }
 
 void Decoder::push_frame(const AVFrame *frame)
@@ -132,93 +116,119 @@ void Decoder::push_frame(const AVFrame *frame)
     exit(1);
 }
 
-bool Decoder::fill_frame_from_jpeg(const uint8_t *data, size_t size)
+size_t Decoder::backlog() const
 {
-    auto jpeg_frame_size = find_jpeg_end(data, size);
-    if (jpeg_frame_size < 0)
+    auto result = m_encoder->backlog();
+    for (auto &worker : m_workers)
     {
-        spdlog::error("Failed to fix frame sequence");
-        return false;
+        result += worker->stage.size();
     }
 
-    auto ret = av_parser_parse2(m_codec_parser, m_codec_context, &m_packet->data, &m_packet->size,
-                                data, jpeg_frame_size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
-    if (ret < 0)
+    return result;
+}
+
+void Decoder::dispatch(const uint8_t *data, size_t jpeg_frame_size, uint64_t pts_usec)
+{
+    if (m_next_sequence - m_next_release.load(std::memory_order_acquire) >= m_reorder.size())
     {
-        spdlog::error("Error while parsing JPEG frame");
-        return false;
+        spdlog::warn("Decoders are saturated. Dropping frame {}", pts_usec);
+        s_frames_dropped.add();
+        return;
     }
 
-    spdlog::trace("Packet size: {}. Source size: {}. Read size: {}", m_packet->size, size, ret);
-
-    if (m_packet->size)
+    // The camera buffer is returned as soon as this call is done, so workers get a copy.
+    // Decoders read past the end of the data, which has to be zeroed
+    auto buffer = av_buffer_alloc(jpeg_frame_size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!buffer)
     {
-        ret = avcodec_send_packet(m_codec_context, m_packet);
-        if (ret < 0)
-        {
-            spdlog::error("Failed to send packet");
-            return false;
-        }
+        spdlog::error("Failed to allocate JPEG frame");
+        return;
+    }
+    memcpy(buffer->data, data, jpeg_frame_size);
+    memset(buffer->data + jpeg_frame_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
 
-        if (!m_scale_context)
-        {
-            init_scaler();
-        }
+    auto sequence = m_next_sequence++;
+    auto &worker = *m_workers[sequence % m_workers.size()];
 
-        ret = avcodec_receive_frame(m_codec_context, m_jpeg_frame);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-        {
-            return false;
-        }
-        else if (ret < 0)
-        {
-            spdlog::error("Failed to decode packet");
-            return false;
-        }
-    }
-    else
+    if (!worker.stage.push({.sequence = sequence, .data = buffer, .size = jpeg_frame_size, .pts_usec = pts_usec}))
     {
-        spdlog::error("Empty JPEG packet");
-        return false;
+        spdlog::warn("Decoder {} is saturated. Dropping frame {}", sequence % m_workers.size(), pts_usec);
+        s_frames_dropped.add();
+        av_buffer_unref(&buffer);
+        complete(sequence, nullptr);
     }
-
-    return true;
 }
 
-bool Decoder::covert_frame_format()
+void Decoder::decode_frame(Worker &worker, JpegFrame &frame)
 {
-    auto res_lines = sws_scale(m_scale_context,
-                               m_jpeg_frame->data, m_jpeg_frame->linesize,
-                               0, m_metadata.height, m_yuv_frame->data, m_yuv_frame->linesize);
+    auto start_usec = monotonic_usec();
 
-    if (res_lines <= 0)
+    auto yuv_frame = worker.decoder.decode(frame.data->data, frame.size);
+    av_buffer_unref(&frame.data);
+
+    if (yuv_frame)
     {
-        spdlog::error("Failed to change frame pixel format");
-        return false;
+        yuv_frame->pts = frame.pts_usec;
+        yuv_frame->pkt_dts = frame.pts_usec;
     }
 
-    return true;
+    worker.busy_usec.add(monotonic_usec() - start_usec);
+    complete(frame.sequence, yuv_frame);
 }
 
-// FFMPEG decoder finds frame end looking for the next frame start sequence (0xffd8),
-// not current frame end (0xffd9). It obviously expects a bunch of well-formated frames going sequentially
-// as an input. But, we have a buffer, which is padded and may even contain zeroes at the end of the data.
-// This breaks the parser. So, we find frame end ourselves and set parser flag that we send complete frames.
-size_t Decoder::find_jpeg_end(uint8_t const *data, size_t size)
+void Decoder::complete(uint64_t sequence, AVFrame *frame)
 {
-    for (size_t n = size; n >= 3; n--)
+    std::lock_guard lock(m_reorder_lock);
+
+    m_reorder[sequence % m_reorder.size()] = ReorderSlot{.ready = true, .frame = frame};
+
+    auto release = m_next_release.load(std::memory_order_relaxed);
+    while (true)
     {
-        if (n == 3)
+        auto &slot = m_reorder[release % m_reorder.size()];
+        if (!slot.ready)
         {
-            return -1;
+            break;
         }
 
-        if (data[n - 1] == 0xd9 && data[n - 2] == 0xff)
+        if (slot.frame)
         {
-            spdlog::trace("JPEG frame true size: {}", n);
-            return n;
+            m_encoder->push_frame(slot.frame);
+            av_frame_free(&slot.frame);
         }
+
+        slot.ready = false;
+        release++;
     }
 
-    return -1;
+    m_next_release.store(release, std::memory_order_release);
+}
+
+void Decoder::report_utilization()
+{
+    auto now = monotonic_usec();
+    if (m_next_report_usec == 0)
+    {
+        m_reported_at_usec = now;
+        m_next_report_usec = now + UTILIZATION_REPORT_INTERVAL_USEC;
+        return;
+    }
+
+    if (now < m_next_report_usec)
+    {
+        return;
+    }
+
+    std::string utilization;
+    for (auto &worker : m_workers)
+    {
+        auto busy_usec = worker->busy_usec.value();
+        utilization += fmt::format(" {:.0f}%", 100.0 * (busy_usec - worker->reported_busy_usec) / (now - m_reported_at_usec));
+        worker->reported_busy_usec = busy_usec;
+    }
+
+    spdlog::debug("Decode worker utilization:{}", utilization);
+
+    m_reported_at_usec = now;
+    m_next_report_usec = now + UTILIZATION_REPORT_INTERVAL_USEC;
 }
@@ -1,49 +1,85 @@
 #pragma once
 
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 extern "C"
 {
-#include <libavutil/pixfmt.h>
-#include <libavcodec/avcodec.h>
-#include <libswscale/swscale.h>
+#include <libavutil/buffer.h>
 }
 
 #include "metadata.hpp"
 #include "iframe_sink.hpp"
-#include "encoder.hpp"
+#include "jpeg_decoder.hpp"
+#include "metrics.hpp"
+#include "pipeline_stage.hpp"
 
+// A camera JPEG frame copied for a decode worker
+struct JpegFrame
+{
+    uint64_t sequence;
+    AVBufferRef *data;
+    size_t size;
+    uint64_t pts_usec;
+};
+
+// Decodes MJPEG camera frames and feeds them to the encoder. With MJPEG_DECODE_THREADS > 1,
+// consecutive frames are decoded in parallel and put back in order before encoding
 class Decoder final : public IFrameSink
 {
 public:
-    Decoder(Metadata metadata);
+    Decoder(Metadata metadata, const std::string &stream_path);
     ~Decoder();
 
     void push_frame(const uint8_t *data, size_t size, uint64_t pts_usec) override;
     void push_frame(const AVFrame *frame) override;
+    size_t backlog() const override;
+    bool skips_frame(uint64_t pts_usec) const override { return m_encoder->skips_frame(pts_usec); }
 
 private:
-    void init();
-    void init_scaler();
+    struct Worker
+    {
+        Worker(size_t index, const std::string &stream_path, Metadata metadata, Decoder &owner);
+
+        JpegDecoder decoder;
+        Counter busy_usec;
+        uint64_t reported_busy_usec = 0;
+
+        PipelineStage<JpegFrame> stage;
+    };
+
+    // A decoded frame waiting for the frames before it. Failed and dropped frames have no frame
+    struct ReorderSlot
+    {
+        bool ready;
+        AVFrame *frame;
+    };
 
-    bool fill_frame_from_jpeg(uint8_t const *data, size_t size);
-    bool covert_frame_format();
-    static size_t find_jpeg_end(uint8_t const *data, size_t size);
+    void dispatch(const uint8_t *data, size_t jpeg_frame_size, uint64_t pts_usec);
+    void decode_frame(Worker &worker, JpegFrame &frame);
+    void complete(uint64_t sequence, AVFrame *frame);
+    void report_utilization();
 
     Metadata m_metadata;
 
-    std::unique_ptr<Encoder> m_encoder;
+    // Encoder or simulcast ladder
+    std::unique_ptr<IFrameSink> m_encoder;
 
-    // Codec
-    const AVCodec *m_codec = nullptr;
-    AVCodecParserContext *m_codec_parser = nullptr;
-    AVCodecContext *m_codec_context = nullptr;
+    // Decodes on the calling thread if there are no workers
+    std::unique_ptr<JpegDecoder> m_inline_decoder = nullptr;
+    std::vector<std::unique_ptr<Worker>> m_workers = {};
 
-    // Format converter
-    SwsContext *m_scale_context = nullptr;
+    // Producer side
+    uint64_t m_next_sequence = 0;
+    uint64_t m_next_report_usec = 0;
+    uint64_t m_reported_at_usec = 0;
 
-    // Data
-    AVPacket *m_packet = av_packet_alloc();
-    AVFrame *m_jpeg_frame = av_frame_alloc();
-    AVFrame *m_yuv_frame = av_frame_alloc();
-};
\ No newline at end of file
+    // Frames are released to the encoder in sequence order by whichever thread completes the next
+    // one. The lock also serializes pushes into the single-producer encoder stage
+    std::mutex m_reorder_lock = {};
+    std::vector<ReorderSlot> m_reorder = {};
+    std::atomic<uint64_t> m_next_release = 0;
+};
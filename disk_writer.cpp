@@ -0,0 +1,132 @@
+#include "disk_writer.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "clock.hpp"
+#include "globals.hpp"
+#include "metrics.hpp"
+
+// Chunks start on a page, which block devices write without read-modify-write of partial pages
+static const size_t CHUNK_ALIGN = 4096;
+
+static Counter s_bytes_written("libcam_record_bytes_total", "Bytes written to recordings");
+static Counter s_write_errors("libcam_record_write_errors_total", "Failed recording file operations");
+static Histogram s_write_time("libcam_record_write_seconds", "Time to write a recording chunk to disk");
+
+DiskWriter::DiskWriter(std::string name)
+    : m_stage(std::move(name), RECORD_WRITE_QUEUE_DEPTH, [this](Job &job)
+              { run_job(job); })
+{
+}
+
+DiskWriter::~DiskWriter()
+{
+    m_stage.stop();
+
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+    }
+}
+
+uint8_t *DiskWriter::allocate_chunk()
+{
+    auto chunk = static_cast<uint8_t *>(aligned_alloc(CHUNK_ALIGN, CHUNK_SIZE));
+    if (!chunk)
+    {
+        spdlog::critical("Failed to allocate recording chunk");
+        throw;
+    }
+
+    return chunk;
+}
+
+void DiskWriter::free_chunk(uint8_t *chunk)
+{
+    free(chunk);
+}
+
+void DiskWriter::open(const std::string &path)
+{
+    m_stage.push_wait(Job{.type = JobType::Open, .path = path, .chunk = nullptr, .size = 0});
+}
+
+void DiskWriter::write(uint8_t *chunk, size_t size)
+{
+    m_stage.push_wait(Job{.type = JobType::Write, .path = {}, .chunk = chunk, .size = size});
+}
+
+void DiskWriter::close()
+{
+    m_stage.push_wait(Job{.type = JobType::Close, .path = {}, .chunk = nullptr, .size = 0});
+}
+
+void DiskWriter::run_job(Job &job)
+{
+    switch (job.type)
+    {
+    case JobType::Open:
+        m_path = job.path;
+        // Never overwrites an earlier recording
+        m_fd = ::open(m_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (m_fd < 0)
+        {
+            spdlog::error("Failed to open recording {}: {}", m_path, strerror(errno));
+            s_write_errors.add();
+            return;
+        }
+
+        spdlog::info("Recording to {}", m_path);
+        break;
+    case JobType::Write:
+    {
+        auto start_nsec = monotonic_nsec();
+
+        for (size_t offset = 0; m_fd >= 0 && offset < job.size;)
+        {
+            auto written = ::write(m_fd, job.chunk + offset, job.size - offset);
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written <= 0)
+            {
+                spdlog::error("Failed to write recording {}: {}", m_path, strerror(errno));
+                s_write_errors.add();
+                break;
+            }
+
+            offset += written;
+            s_bytes_written.add(written);
+        }
+
+        s_write_time.record(monotonic_nsec() - start_nsec);
+        free_chunk(job.chunk);
+        break;
+    }
+    case JobType::Close:
+        if (m_fd < 0)
+        {
+            return;
+        }
+
+        // Finished segments survive a power cut
+        if (fdatasync(m_fd) != 0)
+        {
+            spdlog::warn("Failed to sync recording {}: {}", m_path, strerror(errno));
+            s_write_errors.add();
+        }
+
+        ::close(m_fd);
+        m_fd = -1;
+        spdlog::debug("Closed recording {}", m_path);
+        break;
+    }
+}
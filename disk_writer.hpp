@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "pipeline_stage.hpp"
+
+// Writes files on a dedicated thread in large page aligned chunks, so the thread producing the data
+// only waits for the disk once RECORD_WRITE_QUEUE_DEPTH chunks are pending. Jobs run in order
+class DiskWriter
+{
+public:
+    static const size_t CHUNK_SIZE = 1024 * 1024;
+
+    DiskWriter(std::string name);
+    DiskWriter(const DiskWriter &other) = delete;
+    DiskWriter &operator=(const DiskWriter &other) = delete;
+    // Finishes all pending jobs
+    ~DiskWriter();
+
+    // A CHUNK_SIZE buffer to fill and pass to write
+    static uint8_t *allocate_chunk();
+    static void free_chunk(uint8_t *chunk);
+
+    // Starts a new file. Writes go to it until it's closed
+    void open(const std::string &path);
+    // Takes ownership of the chunk
+    void write(uint8_t *chunk, size_t size);
+    // Syncs and closes the file
+    void close();
+
+private:
+    enum class JobType
+    {
+        Open,
+        Write,
+        Close,
+    };
+
+    struct Job
+    {
+        JobType type;
+        std::string path;
+        uint8_t *chunk;
+        size_t size;
+    };
+
+    void run_job(Job &job);
+
+    // Owned by the writer thread
+    int m_fd = -1;
+    std::string m_path = {};
+
+    PipelineStage<Job> m_stage;
+};
@@ -4,43 +4,156 @@ extern "C"
 {
 #include <libavcodec/avcodec.h>
 #include <libavutil/opt.h>
+#include <libavutil/imgutils.h>
 }
 
+#include "clock.hpp"
+#include "frame_regions.hpp"
 #include "globals.hpp"
+#include "h264.hpp"
+#include "metrics.hpp"
 
-Encoder::Encoder(Metadata metadata) : m_metadata(metadata)
+static Histogram s_encode_time("libcam_encode_seconds", "Time to encode a frame and drain its packets");
+static Counter s_frames_dropped("libcam_frames_dropped_total", "Frames dropped before decoding or encoding", "stage=\"encode\"");
+static Counter s_frames_shed("libcam_frames_dropped_total", "Frames dropped before decoding or encoding", "stage=\"congestion\"");
+static Counter s_packets_shed("libcam_packets_dropped_total", "Disposable encoded frames dropped on a congested output");
+
+Encoder::Encoder(Metadata metadata, std::string stream_path, int64_t bit_rate, bool record)
+    : m_metadata(metadata),
+      m_stream_path(std::move(stream_path)),
+      m_bit_rate(bit_rate),
+      m_record(record),
+      m_rate_controller(bit_rate),
+      m_encode_stage("encode", FRAME_QUEUE_DEPTH, [this](AVFrame *&frame)
+                     { encode_frame(frame); av_frame_free(&frame); })
 {
     init();
-
-    static const char *FILENAME = "test.mpeg";
-    f = fopen(FILENAME, "wb");
-    if (!f)
-    {
-        fprintf(stderr, "could not open %s\n", FILENAME);
-        exit(1);
-    }
 }
 
 Encoder::~Encoder()
 {
-    static uint8_t endcode[] = {0, 0, 1, 0xb7};
-
+    m_encode_stage.stop();
     avcodec_free_context(&m_codec_context);
-
-    fwrite(endcode, 1, sizeof(endcode), f);
-    fclose(f);
 }
 
 void Encoder::push_frame(const uint8_t *data, size_t size, uint64_t pts_usec)
 {
     spdlog::trace("Received raw frame into encoder");
-    return;
+
+    if (data == nullptr)
+    {
+        push_frame(nullptr);
+        return;
+    }
+
+    // The caller doesn't keep the data alive for the encoder thread, so the frame is copied.
+    // Expects tightly packed planes. Camera frames take the zero-copy path instead
+    uint8_t *src_data[4] = {};
+    int src_linesize[4] = {};
+    auto frame_size = av_image_fill_arrays(src_data, src_linesize, data, m_codec_context->pix_fmt,
+                                           m_metadata.width, m_metadata.height, 1);
+    if (frame_size < 0 || size < (size_t)frame_size)
+    {
+        spdlog::error("Invalid raw frame size: {}", size);
+        return;
+    }
+
+    auto frame = m_frame_pool->get();
+    if (!frame)
+    {
+        spdlog::error("Failed to allocate raw frame");
+        return;
+    }
+
+    av_image_copy(frame->data, frame->linesize, (const uint8_t **)src_data, src_linesize,
+                  m_codec_context->pix_fmt, m_metadata.width, m_metadata.height);
+    frame->pts = pts_usec;
+    frame->pkt_dts = pts_usec;
+
+    push_frame(frame);
+    av_frame_free(&frame);
 }
 
 void Encoder::push_frame(const AVFrame *frame)
 {
     spdlog::trace("Received full-featured frame into encoder");
 
+    if (!frame)
+    {
+        m_encode_stage.push_wait(nullptr);
+        return;
+    }
+
+    if (skips_frame(frame->pts))
+    {
+        s_frames_shed.add();
+        return;
+    }
+
+    // Takes a new reference to the frame buffers. Data isn't copied
+    auto frame_ref = av_frame_clone(frame);
+    if (!frame_ref)
+    {
+        spdlog::error("Failed to reference frame for encoding");
+        return;
+    }
+
+    if (!m_encode_stage.push(frame_ref))
+    {
+        spdlog::warn("Encoder is saturated. Dropping frame {}", frame->pts);
+        s_frames_dropped.add();
+        av_frame_free(&frame_ref);
+    }
+}
+
+void Encoder::request_keyframe()
+{
+    m_keyframe_requested = true;
+}
+
+void Encoder::encode_frame(AVFrame *frame)
+{
+    auto start_nsec = monotonic_nsec();
+
+    // libx264 reconfigures itself when the bit rate changes between frames
+    auto bit_rate = m_rate_controller.bit_rate();
+    if (frame && bit_rate != m_codec_context->bit_rate)
+    {
+        m_codec_context->bit_rate = bit_rate;
+    }
+
+    // Masked regions must never be encoded, so the frame is dropped if they can't be applied
+    if (frame && (!mask_frame(frame) || !attach_regions_of_interest(frame)))
+    {
+        spdlog::error("Failed to apply frame regions. Dropping frame {}", frame->pts);
+        s_frames_dropped.add();
+        return;
+    }
+
+    // Frames shed while idle aren't analyzed, so motion is noticed within 1 / MOTION_IDLE_FPS
+    if (frame && m_motion_detector)
+    {
+        bool motion = m_motion_detector->analyze(frame->data[0], frame->linesize[0], frame->width, frame->height);
+        m_rate_controller.set_idle(!motion);
+
+        if (motion && m_recorder && MOTION_TRIGGERS_RECORDING)
+        {
+            m_recorder->trigger();
+        }
+    }
+
+    if (frame)
+    {
+        // Decoded JPEG frames are marked as intra, which would make every frame a keyframe
+        frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+        if (m_keyframe_requested.exchange(false))
+        {
+            spdlog::debug("Forcing keyframe at {}", frame->pts);
+            frame->pict_type = AV_PICTURE_TYPE_I;
+        }
+    }
+
     auto ret = avcodec_send_frame(m_codec_context, frame);
     if (frame && ret < 0)
     {
@@ -57,24 +170,72 @@ void Encoder::push_frame(const AVFrame *frame)
     {
         ret = avcodec_receive_packet(m_codec_context, m_packet);
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            return;
+            break;
         else if (ret < 0)
         {
             spdlog::error("Error during encoding");
             throw;
         }
 
-        m_packet->pts = frame->pts;
-        m_packet->dts = frame->pts;
         m_packet->stream_index = 0;
 
+        // libx264 flags intra refresh recovery points as keyframes, but decoding can only start on an IDR
+        if (m_intra_refresh && (m_packet->flags & AV_PKT_FLAG_KEY) && !contains_idr(m_packet->data, m_packet->size))
+        {
+            m_packet->flags &= ~AV_PKT_FLAG_KEY;
+        }
+
+        // Non-reference B-frames can go without breaking decoding of the frames after them
+        if ((m_packet->flags & AV_PKT_FLAG_DISPOSABLE) && m_rate_controller.skips_frame(m_packet->pts))
+        {
+            s_packets_shed.add();
+            continue;
+        }
+
         spdlog::trace("Encoded frame {} {}. Data: {}, Stream index: {}", m_packet->pts, m_packet->size,
                       (void *)m_packet->data, m_packet->stream_index);
-        // fwrite(m_packet->data, 1, m_packet->size, f);
+        // All take references to the same packet data
         m_streamer->push_packet(m_packet);
+        if (m_recorder)
+        {
+            m_recorder->push_packet(m_packet);
+        }
+        if (m_hls)
+        {
+            m_hls->push_packet(m_packet);
+        }
     }
 
-    return;
+    if (frame)
+    {
+        s_encode_time.record(monotonic_nsec() - start_nsec);
+    }
+}
+
+bool Encoder::mask_frame(AVFrame *frame)
+{
+    if (PRIVACY_MASKS.empty())
+    {
+        return true;
+    }
+
+    // Camera buffers are mapped read-only and other frames may be shared with other layers, so
+    // those are masked on a copy
+    if (!av_frame_is_writable(frame))
+    {
+        auto copy = m_frame_pool->get();
+        if (!copy || av_frame_copy(copy, frame) < 0 || av_frame_copy_props(copy, frame) < 0)
+        {
+            av_frame_free(&copy);
+            return false;
+        }
+
+        av_frame_unref(frame);
+        av_frame_move_ref(frame, copy);
+        av_frame_free(&copy);
+    }
+
+    return apply_privacy_masks(frame);
 }
 
 void Encoder::init()
@@ -102,23 +263,49 @@ void Encoder::init()
         throw;
     }
 
-    m_codec_context->bit_rate = 1024000;
+    m_codec_context->bit_rate = m_bit_rate;
     m_codec_context->width = m_metadata.width;
     m_codec_context->height = m_metadata.height;
-    m_codec_context->time_base = (AVRational){1, FPS};
+    // Frame timestamps are sensor timestamps in microseconds
+    m_codec_context->time_base = (AVRational){1, 1000000};
     m_codec_context->framerate = (AVRational){FPS, 1};
     m_codec_context->ticks_per_frame = 2;
 
-    /* emit one intra frame every ten frames
+    /* emit one intra frame every GOP_SIZE frames
      * check frame pict_type before passing frame
      * to encoder, if frame->pict_type is AV_PICTURE_TYPE_I
      * then gop_size is ignored and the output of encoder
      * will always be I frame irrespective to gop_size
      */
-    m_codec_context->gop_size = 10;
-    m_codec_context->max_b_frames = 4;
-    m_codec_context->pix_fmt = ENCODER_SRC_FORMAT;
+    m_codec_context->gop_size = GOP_SIZE;
+    // Raw camera frames are encoded in their native layout, decoded MJPEG is converted upfront
+    auto raw_pixel_format = m_metadata.raw_pixel_format();
+    m_codec_context->pix_fmt = raw_pixel_format != AV_PIX_FMT_NONE ? raw_pixel_format : ENCODER_SRC_FORMAT;
+    // Decoded JPEG frames keep their full range instead of being squeezed into video range
+    if (m_metadata.format == Format::MJPEG)
+    {
+        m_codec_context->color_range = AVCOL_RANGE_JPEG;
+    }
     av_opt_set(m_codec_context->priv_data, "preset", "fast", 0);
+    if (ENCODER_PROFILE == EncoderProfile::LowLatency)
+    {
+        // No frame reordering or lookahead, so each frame leaves the encoder as soon as it's encoded
+        m_codec_context->max_b_frames = 0;
+        av_opt_set(m_codec_context->priv_data, "tune", "zerolatency", 0);
+        // Refresh a moving column of intra blocks over the GOP instead of bitrate spiking IDR frames.
+        // Recordings and HLS cut segments on IDR frames, which intra refresh only sends on request
+        m_intra_refresh = !m_record && !HLS;
+        if (m_intra_refresh)
+        {
+            av_opt_set(m_codec_context->priv_data, "intra-refresh", "1", 0);
+        }
+    }
+    else
+    {
+        m_codec_context->max_b_frames = 4;
+    }
+    // Forced intra frames must be IDRs, so clients can start decoding from them
+    av_opt_set(m_codec_context->priv_data, "forced-idr", "1", 0);
 
     auto ret = avcodec_open2(m_codec_context, m_codec, nullptr);
     if (ret < 0)
@@ -136,7 +323,29 @@ void Encoder::init()
         throw;
     }
 
-    m_streamer = std::make_unique<Streamer>(&codec_params);
+    m_streamer = std::make_unique<Streamer>(
+        m_stream_path, &codec_params, m_codec_context->time_base, [this]()
+        { request_keyframe(); },
+        [this](const OutputCongestion &congestion)
+        { m_rate_controller.report(congestion.queued_bytes, congestion.blocked_usec); });
+    m_frame_pool = std::make_unique<FramePool>(m_codec_context->pix_fmt, m_metadata.width, m_metadata.height);
+
+    if (m_record)
+    {
+        // Named after the stream path, e.g. /stream_low -> stream_low
+        auto name = m_stream_path.substr(m_stream_path.find_first_not_of('/'));
+        m_recorder = std::make_unique<Recorder>(name, &codec_params, m_codec_context->time_base);
+    }
+
+    if (HLS)
+    {
+        m_hls = std::make_unique<HlsStream>(m_stream_path, &codec_params, m_codec_context->time_base);
+    }
+
+    if (MOTION_DETECTION)
+    {
+        m_motion_detector = std::make_unique<MotionDetector>(m_stream_path);
+    }
 
     spdlog::info("Coder opened succesfully");
 }
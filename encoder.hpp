@@ -1,6 +1,6 @@
 #pragma once
 
-#include <cstdio>
+#include <string>
 
 extern "C"
 {
@@ -12,25 +12,55 @@ extern "C"
 #include "metadata.hpp"
 #include "iframe_sink.hpp"
 #include "streamer.hpp"
+#include "pipeline_stage.hpp"
+#include "frame_pool.hpp"
+#include "hls_stream.hpp"
+#include "motion_detector.hpp"
+#include "rate_controller.hpp"
+#include "recorder.hpp"
 
 class Encoder final : public IFrameSink
 {
 public:
-    Encoder(Metadata metadata);
+    // Packets are also recorded if record is set
+    Encoder(Metadata metadata, std::string stream_path, int64_t bit_rate, bool record);
     ~Encoder();
 
     void push_frame(const uint8_t *data, size_t size, uint64_t pts_usec) override;
     void push_frame(const AVFrame *frame) override;
+    size_t backlog() const override { return m_encode_stage.size(); }
+    bool skips_frame(uint64_t pts_usec) const override { return m_rate_controller.skips_frame(pts_usec); }
+
+    // Makes the next encoded frame an IDR. Safe to call from any thread
+    void request_keyframe();
 
 private:
     void init();
+    void encode_frame(AVFrame *frame);
+    bool mask_frame(AVFrame *frame);
 
     Metadata m_metadata;
+    std::string m_stream_path;
+    int64_t m_bit_rate;
+    bool m_record;
+    bool m_intra_refresh = false;
+
+    // Fed by the streamer, so it has to outlive it
+    RateController m_rate_controller;
 
     const AVCodec *m_codec = nullptr;
     AVCodecContext *m_codec_context = nullptr;
     AVPacket *m_packet = av_packet_alloc();
     std::unique_ptr<Streamer> m_streamer;
+    std::unique_ptr<Recorder> m_recorder = nullptr;
+    std::unique_ptr<HlsStream> m_hls = nullptr;
+    std::unique_ptr<MotionDetector> m_motion_detector = nullptr;
+
+    // Backs copies of raw frames pushed by pointer
+    std::unique_ptr<FramePool> m_frame_pool = nullptr;
+
+    std::atomic_bool m_keyframe_requested = false;
 
-    FILE *f;
+    // Frames are encoded on a dedicated thread. Nullptr marks end of stream
+    PipelineStage<AVFrame *> m_encode_stage;
 };
\ No newline at end of file
@@ -0,0 +1,203 @@
+#include "event_loop.hpp"
+
+#include <future>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <spdlog/spdlog.h>
+
+static const int MAX_EVENTS = 64;
+
+EventLoop::EventLoop(std::string name) : m_name(std::move(name))
+{
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_epoll_fd < 0 || m_wake_fd < 0)
+    {
+        spdlog::critical("Failed to create event loop");
+        throw;
+    }
+
+    epoll_event event{.events = EPOLLIN, .data = {.fd = m_wake_fd}};
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &event);
+
+    m_thread = std::thread(&EventLoop::run, this);
+    pthread_setname_np(m_thread.native_handle(), m_name.substr(0, 15).c_str());
+}
+
+EventLoop::~EventLoop()
+{
+    stop();
+
+    close(m_wake_fd);
+    close(m_epoll_fd);
+}
+
+void EventLoop::add(int fd, uint32_t events, Handler handler)
+{
+    m_handlers[fd] = std::make_shared<Handler>(std::move(handler));
+
+    epoll_event event{.events = events, .data = {.fd = fd}};
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+    {
+        spdlog::error("Failed to add fd {} to event loop '{}'", fd, m_name);
+    }
+}
+
+void EventLoop::modify(int fd, uint32_t events)
+{
+    epoll_event event{.events = events, .data = {.fd = fd}};
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+void EventLoop::remove(int fd)
+{
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    m_handlers.erase(fd);
+}
+
+int EventLoop::add_timer(uint64_t interval_usec, Task task)
+{
+    auto fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+    {
+        spdlog::error("Failed to create timer on event loop '{}'", m_name);
+        return -1;
+    }
+
+    timespec interval{.tv_sec = (time_t)(interval_usec / 1000000), .tv_nsec = (long)(interval_usec % 1000000) * 1000};
+    itimerspec spec{.it_interval = interval, .it_value = interval};
+    timerfd_settime(fd, 0, &spec, nullptr);
+
+    add(fd, EPOLLIN, [fd, task = std::move(task)](uint32_t events)
+        {
+            // Expirations missed while the loop was busy run the task once
+            uint64_t expirations = 0;
+            if (read(fd, &expirations, sizeof(expirations)) > 0)
+            {
+                task();
+            } });
+    return fd;
+}
+
+void EventLoop::remove_timer(int timer)
+{
+    if (timer < 0)
+    {
+        return;
+    }
+
+    remove(timer);
+    close(timer);
+}
+
+void EventLoop::post(Task task)
+{
+    {
+        std::lock_guard lock(m_tasks_lock);
+        m_tasks.push_back(std::move(task));
+    }
+
+    uint64_t value = 1;
+    if (write(m_wake_fd, &value, sizeof(value)) < 0)
+    {
+        spdlog::trace("Event loop '{}' is already woken up", m_name);
+    }
+}
+
+void EventLoop::post_and_wait(Task task)
+{
+    if (is_loop_thread())
+    {
+        task();
+        return;
+    }
+
+    std::promise<void> done;
+    post([&task, &done]()
+         {
+             task();
+             done.set_value(); });
+
+    done.get_future().wait();
+}
+
+void EventLoop::stop()
+{
+    if (!m_thread.joinable())
+    {
+        return;
+    }
+
+    post([this]()
+         { m_stop = true; });
+    m_thread.join();
+}
+
+bool EventLoop::is_loop_thread() const
+{
+    return std::this_thread::get_id() == m_thread.get_id();
+}
+
+void EventLoop::run()
+{
+    epoll_event events[MAX_EVENTS];
+
+    while (!m_stop)
+    {
+        auto count = epoll_wait(m_epoll_fd, events, MAX_EVENTS, -1);
+        if (count < 0)
+        {
+            if (errno != EINTR)
+            {
+                spdlog::error("Event loop '{}' failed to wait: {}", m_name, errno);
+            }
+            continue;
+        }
+
+        for (int n = 0; n < count; n++)
+        {
+            auto fd = events[n].data.fd;
+
+            if (fd == m_wake_fd)
+            {
+                uint64_t value = 0;
+                while (read(m_wake_fd, &value, sizeof(value)) > 0)
+                {
+                }
+
+                run_posted_tasks();
+                continue;
+            }
+
+            // Handlers may remove themselves, so keep them alive for the duration of the call
+            auto it = m_handlers.find(fd);
+            if (it != m_handlers.end())
+            {
+                auto handler = it->second;
+                (*handler)(events[n].events);
+            }
+        }
+    }
+
+    spdlog::debug("Event loop '{}' stopped", m_name);
+}
+
+void EventLoop::run_posted_tasks()
+{
+    std::vector<Task> tasks;
+
+    {
+        std::lock_guard lock(m_tasks_lock);
+        tasks.swap(m_tasks);
+    }
+
+    for (auto &task : tasks)
+    {
+        task();
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Single-threaded epoll loop. File descriptors may only be added, modified or removed on the loop
+// thread; other threads hand work over with post()
+class EventLoop
+{
+public:
+    using Handler = std::function<void(uint32_t events)>;
+    using Task = std::function<void()>;
+
+    EventLoop(std::string name);
+    EventLoop(const EventLoop &other) = delete;
+    EventLoop &operator=(const EventLoop &other) = delete;
+    ~EventLoop();
+
+    void add(int fd, uint32_t events, Handler handler);
+    void modify(int fd, uint32_t events);
+    void remove(int fd);
+
+    // Runs the task on the loop thread every interval until the timer is removed. Like add(),
+    // only called on the loop thread
+    int add_timer(uint64_t interval_usec, Task task);
+    void remove_timer(int timer);
+
+    // Runs the task on the loop thread. Safe to call from any thread
+    void post(Task task);
+    // Same as post(), but waits for the task to complete
+    void post_and_wait(Task task);
+    void stop();
+
+    bool is_loop_thread() const;
+
+private:
+    void run();
+    void run_posted_tasks();
+
+    std::string m_name;
+    int m_epoll_fd = -1;
+    int m_wake_fd = -1;
+    bool m_stop = false;
+
+    std::unordered_map<int, std::shared_ptr<Handler>> m_handlers = {};
+
+    std::mutex m_tasks_lock = {};
+    std::vector<Task> m_tasks = {};
+
+    std::thread m_thread = {};
+};
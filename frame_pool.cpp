@@ -0,0 +1,57 @@
+#include "frame_pool.hpp"
+
+extern "C"
+{
+#include <libavutil/imgutils.h>
+}
+
+#include <spdlog/spdlog.h>
+
+FramePool::FramePool(AVPixelFormat format, int width, int height)
+    : m_format(format), m_width(width), m_height(height)
+{
+    auto size = av_image_get_buffer_size(m_format, m_width, m_height, ALIGN);
+    if (size < 0)
+    {
+        spdlog::critical("Invalid frame pool format");
+        throw;
+    }
+
+    m_pool = av_buffer_pool_init(size, av_buffer_alloc);
+    if (!m_pool)
+    {
+        spdlog::critical("Failed to allocate frame pool");
+        throw;
+    }
+}
+
+FramePool::~FramePool()
+{
+    // Buffers still referenced by in-flight frames keep the pool alive until they are freed
+    av_buffer_pool_uninit(&m_pool);
+}
+
+AVFrame *FramePool::get()
+{
+    auto frame = av_frame_alloc();
+    if (!frame)
+    {
+        return nullptr;
+    }
+
+    frame->buf[0] = av_buffer_pool_get(m_pool);
+    if (!frame->buf[0])
+    {
+        av_frame_free(&frame);
+        return nullptr;
+    }
+
+    frame->format = m_format;
+    frame->width = m_width;
+    frame->height = m_height;
+
+    av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data,
+                         m_format, m_width, m_height, ALIGN);
+
+    return frame;
+}
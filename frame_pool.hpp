@@ -0,0 +1,30 @@
+#pragma once
+
+extern "C"
+{
+#include <libavutil/frame.h>
+#include <libavutil/buffer.h>
+}
+
+// Hands out refcounted frames of a fixed format backed by a buffer pool, so a stage can keep
+// producing new frames while downstream stages still hold references to the previous ones
+class FramePool
+{
+public:
+    FramePool(AVPixelFormat format, int width, int height);
+    FramePool(const FramePool &other) = delete;
+    FramePool &operator=(const FramePool &other) = delete;
+    ~FramePool();
+
+    // Returns a new frame the caller owns, or nullptr on allocation failure
+    AVFrame *get();
+
+private:
+    static const int ALIGN = 32;
+
+    AVPixelFormat m_format;
+    int m_width;
+    int m_height;
+
+    AVBufferPool *m_pool = nullptr;
+};
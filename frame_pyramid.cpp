@@ -0,0 +1,150 @@
+#include "frame_pyramid.hpp"
+
+#include <spdlog/spdlog.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Averages 2x2 blocks of two rows. Rounds like pavgb and vrhadd, first vertically, then horizontally
+static void halve_rows(const uint8_t *top, const uint8_t *bottom, uint8_t *dst, size_t dst_width, size_t pixel_size)
+{
+    size_t x = 0;
+    auto dst_bytes = dst_width * pixel_size;
+
+#if defined(__SSE2__)
+    // Averages every byte with the one a pixel to the right, then keeps even pixels. Words are biased
+    // for packs_epi32, which saturates signed
+    const auto byte_mask = _mm_set1_epi16(0x00ff);
+    const auto word_mask = _mm_set1_epi32(0x0000ffff);
+    const auto word_bias = _mm_set1_epi32(0x8000);
+
+    for (; x + 16 <= dst_bytes; x += 16)
+    {
+        auto a = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(top + 2 * x)),
+                              _mm_loadu_si128((const __m128i *)(bottom + 2 * x)));
+        auto b = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(top + 2 * x + 16)),
+                              _mm_loadu_si128((const __m128i *)(bottom + 2 * x + 16)));
+
+        if (pixel_size == 1)
+        {
+            a = _mm_and_si128(_mm_avg_epu8(a, _mm_srli_si128(a, 1)), byte_mask);
+            b = _mm_and_si128(_mm_avg_epu8(b, _mm_srli_si128(b, 1)), byte_mask);
+            _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(a, b));
+        }
+        else
+        {
+            a = _mm_sub_epi32(_mm_and_si128(_mm_avg_epu8(a, _mm_srli_si128(a, 2)), word_mask), word_bias);
+            b = _mm_sub_epi32(_mm_and_si128(_mm_avg_epu8(b, _mm_srli_si128(b, 2)), word_mask), word_bias);
+            _mm_storeu_si128((__m128i *)(dst + x), _mm_add_epi16(_mm_packs_epi32(a, b), _mm_set1_epi16(-0x8000)));
+        }
+    }
+#elif defined(__ARM_NEON)
+    for (; x + 16 <= dst_bytes; x += 16)
+    {
+        if (pixel_size == 1)
+        {
+            auto a = vld2q_u8(top + 2 * x);
+            auto b = vld2q_u8(bottom + 2 * x);
+            vst1q_u8(dst + x, vrhaddq_u8(vrhaddq_u8(a.val[0], b.val[0]), vrhaddq_u8(a.val[1], b.val[1])));
+        }
+        else
+        {
+            auto a = vld2q_u16((const uint16_t *)(top + 2 * x));
+            auto b = vld2q_u16((const uint16_t *)(bottom + 2 * x));
+            auto even = vrhaddq_u8(vreinterpretq_u8_u16(a.val[0]), vreinterpretq_u8_u16(b.val[0]));
+            auto odd = vrhaddq_u8(vreinterpretq_u8_u16(a.val[1]), vreinterpretq_u8_u16(b.val[1]));
+            vst1q_u8(dst + x, vrhaddq_u8(even, odd));
+        }
+    }
+#endif
+
+    for (; x < dst_bytes; x++)
+    {
+        auto src_x = x / pixel_size * 2 * pixel_size + x % pixel_size;
+        auto left = (top[src_x] + bottom[src_x] + 1) >> 1;
+        auto right = (top[src_x + pixel_size] + bottom[src_x + pixel_size] + 1) >> 1;
+        dst[x] = (left + right + 1) >> 1;
+    }
+}
+
+void halve_plane(const uint8_t *src, size_t src_stride, uint8_t *dst, size_t dst_stride,
+                 size_t dst_width, size_t dst_height, size_t pixel_size)
+{
+    for (size_t y = 0; y < dst_height; y++)
+    {
+        halve_rows(src + 2 * y * src_stride, src + (2 * y + 1) * src_stride, dst + y * dst_stride, dst_width, pixel_size);
+    }
+}
+
+FramePyramid::FramePyramid(AVPixelFormat format, int width, int height, int levels)
+    : m_format(format), m_levels(levels, nullptr)
+{
+    if (format != AV_PIX_FMT_YUV420P && format != AV_PIX_FMT_NV12)
+    {
+        spdlog::critical("Unsupported frame pyramid format");
+        throw;
+    }
+
+    // Level 0 is never allocated
+    m_pools.resize(levels);
+    for (int n = 1; n < levels; n++)
+    {
+        m_pools[n] = std::make_unique<FramePool>(format, level_size(width, n), level_size(height, n));
+    }
+}
+
+FramePyramid::~FramePyramid()
+{
+    release();
+}
+
+bool FramePyramid::build(const AVFrame *frame)
+{
+    release();
+
+    m_levels[0] = av_frame_clone(frame);
+    if (!m_levels[0])
+    {
+        return false;
+    }
+
+    for (size_t n = 1; n < m_levels.size(); n++)
+    {
+        auto src = m_levels[n - 1];
+        auto dst = m_pools[n]->get();
+        if (!dst)
+        {
+            return false;
+        }
+
+        halve_plane(src->data[0], src->linesize[0], dst->data[0], dst->linesize[0], dst->width, dst->height, 1);
+        if (m_format == AV_PIX_FMT_NV12)
+        {
+            halve_plane(src->data[1], src->linesize[1], dst->data[1], dst->linesize[1], dst->width / 2, dst->height / 2, 2);
+        }
+        else
+        {
+            for (int plane = 1; plane <= 2; plane++)
+            {
+                halve_plane(src->data[plane], src->linesize[plane], dst->data[plane], dst->linesize[plane],
+                            dst->width / 2, dst->height / 2, 1);
+            }
+        }
+
+        av_frame_copy_props(dst, frame);
+        m_levels[n] = dst;
+    }
+
+    return true;
+}
+
+void FramePyramid::release()
+{
+    for (auto &level : m_levels)
+    {
+        av_frame_free(&level);
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+#include "frame_pool.hpp"
+
+// Halves both dimensions of a plane by averaging 2x2 blocks. Pixels are pixel_size bytes: 1 for
+// luma and planar chroma, 2 for interleaved NV12 chroma. Writes dst_width x dst_height pixels
+void halve_plane(const uint8_t *src, size_t src_stride, uint8_t *dst, size_t dst_stride,
+                 size_t dst_width, size_t dst_height, size_t pixel_size);
+
+// Successive halvings of a YUV420P or NV12 frame. Every level is built from the one above it,
+// so all downscaled sizes of a frame cost less than one extra full size pass
+class FramePyramid
+{
+public:
+    FramePyramid(AVPixelFormat format, int width, int height, int levels);
+    FramePyramid(const FramePyramid &other) = delete;
+    FramePyramid &operator=(const FramePyramid &other) = delete;
+    ~FramePyramid();
+
+    // Size of the level. Halved sizes are rounded down to even, as 4:2:0 chroma requires
+    static int level_size(int size, int level) { return (size >> level) & ~1; }
+
+    // Replaces the levels with ones built from the frame. Level 0 references the frame itself
+    bool build(const AVFrame *frame);
+    // Owned by the pyramid until the next build or release
+    const AVFrame *level(int index) const { return m_levels[index]; }
+    int levels() const { return m_levels.size(); }
+
+    // Drops the levels. Level 0 holds the camera buffer, so this is called as soon as consumers
+    // have taken their own references
+    void release();
+
+private:
+
+    AVPixelFormat m_format;
+    std::vector<std::unique_ptr<FramePool>> m_pools = {};
+    std::vector<AVFrame *> m_levels = {};
+};
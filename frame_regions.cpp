@@ -0,0 +1,149 @@
+#include "frame_regions.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+extern "C"
+{
+#include <libavutil/pixdesc.h>
+#include <libavutil/rational.h>
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "globals.hpp"
+
+struct PixelRect
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// Smallest rectangle of whole alignment units covering the region, clipped to the frame
+static PixelRect to_pixels(const FrameRegion &region, int width, int height, int align_x, int align_y)
+{
+    auto left = std::clamp<int>(std::floor(region.x * width), 0, width) / align_x * align_x;
+    auto top = std::clamp<int>(std::floor(region.y * height), 0, height) / align_y * align_y;
+    auto right = std::clamp<int>(std::ceil((region.x + region.width) * width), 0, width);
+    auto bottom = std::clamp<int>(std::ceil((region.y + region.height) * height), 0, height);
+
+    right = std::min((right + align_x - 1) / align_x * align_x, width / align_x * align_x);
+    bottom = std::min((bottom + align_y - 1) / align_y * align_y, height / align_y * align_y);
+
+    return PixelRect{.x = left, .y = top, .width = std::max(0, right - left), .height = std::max(0, bottom - top)};
+}
+
+// Repeats a 16 byte pattern over the row. Pixels of every plane fit evenly in it
+static void fill_row(uint8_t *dst, size_t size, const uint8_t *pattern)
+{
+    size_t x = 0;
+
+#if defined(__SSE2__)
+    auto value = _mm_loadu_si128((const __m128i *)pattern);
+    for (; x + 16 <= size; x += 16)
+    {
+        _mm_storeu_si128((__m128i *)(dst + x), value);
+    }
+#elif defined(__ARM_NEON)
+    auto value = vld1q_u8(pattern);
+    for (; x + 16 <= size; x += 16)
+    {
+        vst1q_u8(dst + x, value);
+    }
+#endif
+
+    for (; x < size; x++)
+    {
+        dst[x] = pattern[x % 16];
+    }
+}
+
+bool apply_privacy_masks(AVFrame *frame)
+{
+    if (PRIVACY_MASKS.empty())
+    {
+        return true;
+    }
+
+    auto desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_RGB)) ||
+        desc->nb_components < 3)
+    {
+        return false;
+    }
+
+    // One pattern per plane, with every component at its offset, e.g. UVUV... for NV12
+    uint8_t patterns[4][16] = {};
+    size_t steps[4] = {};
+    for (int n = 0; n < 3; n++)
+    {
+        auto &component = desc->comp[n];
+        if (component.depth != 8 || 16 % component.step != 0)
+        {
+            return false;
+        }
+
+        steps[component.plane] = component.step;
+        for (int x = component.offset; x < 16; x += component.step)
+        {
+            patterns[component.plane][x] = PRIVACY_MASK_COLOR[n];
+        }
+    }
+
+    for (auto &mask : PRIVACY_MASKS)
+    {
+        // Aligned to chroma samples, so the mask covers the same area on every plane
+        auto rect = to_pixels(mask, frame->width, frame->height, 1 << desc->log2_chroma_w, 1 << desc->log2_chroma_h);
+
+        for (int plane = 0; plane < 4 && steps[plane]; plane++)
+        {
+            auto shift_x = plane ? desc->log2_chroma_w : 0;
+            auto shift_y = plane ? desc->log2_chroma_h : 0;
+
+            auto row = frame->data[plane] + (rect.x >> shift_x) * steps[plane];
+            for (int y = rect.y >> shift_y; y < (rect.y + rect.height) >> shift_y; y++)
+            {
+                fill_row(row + y * frame->linesize[plane], (rect.width >> shift_x) * steps[plane], patterns[plane]);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool attach_regions_of_interest(AVFrame *frame)
+{
+    if (REGIONS_OF_INTEREST.empty())
+    {
+        return true;
+    }
+
+    auto side_data = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+                                            REGIONS_OF_INTEREST.size() * sizeof(AVRegionOfInterest));
+    if (!side_data)
+    {
+        return false;
+    }
+
+    auto regions = reinterpret_cast<AVRegionOfInterest *>(side_data->data);
+    for (size_t n = 0; n < REGIONS_OF_INTEREST.size(); n++)
+    {
+        auto &roi = REGIONS_OF_INTEREST[n];
+        auto rect = to_pixels(roi.region, frame->width, frame->height, 1, 1);
+
+        regions[n] = AVRegionOfInterest{.self_size = sizeof(AVRegionOfInterest),
+                                        .top = rect.y,
+                                        .bottom = rect.y + rect.height,
+                                        .left = rect.x,
+                                        .right = rect.x + rect.width,
+                                        .qoffset = av_d2q(std::clamp(roi.qoffset, -1.0, 1.0), 100)};
+    }
+
+    return true;
+}
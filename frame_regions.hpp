@@ -0,0 +1,13 @@
+#pragma once
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+// Fills PRIVACY_MASKS with PRIVACY_MASK_COLOR in place. The frame has to be writable and
+// 8-bit YUV. Returns false for other formats
+bool apply_privacy_masks(AVFrame *frame);
+
+// Attaches REGIONS_OF_INTEREST as AV_FRAME_DATA_REGIONS_OF_INTEREST side data for the encoder
+bool attach_regions_of_interest(AVFrame *frame);
@@ -1,10 +1,260 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
 extern "C"
 {
 #include <libavutil/pixfmt.h>
 }
 
 static const int FPS = 25;
+
+enum class FrameSource
+{
+    // Cameras reported by libcamera, one pipeline each
+    Camera,
+    // Generated moving test pattern
+    Synthetic,
+    // Frames recorded to REPLAY_PATH, looped
+    Replay,
+};
+
+static const FrameSource FRAME_SOURCE = FrameSource::Camera;
+// libcamera ids of the cameras to stream. Empty streams every camera found
+static const std::vector<std::string> CAMERA_IDS = {};
+// CPU cores for the threads of each camera pipeline, in camera order. Pipelines without
+// an entry or with an empty one aren't pinned, e.g. {{0, 1}, {2, 3}} for two 1080p cameras
+static const std::vector<std::vector<int>> PIPELINE_CPU_CORES = {};
+// Recorded frames of the virtual camera format. MJPEG captures are concatenated JPEG frames,
+// raw captures are tightly packed frames back to back
+static const char *REPLAY_PATH = "capture.mjpeg";
+// Virtual camera format: "MJPEG", "YUV420" or "NV12"
+static const char *VIRTUAL_CAMERA_FORMAT = "MJPEG";
+static const size_t VIRTUAL_CAMERA_WIDTH = 1280;
+static const size_t VIRTUAL_CAMERA_HEIGHT = 720;
+
+// Second, ISP scaled stream of every camera, requested with the Viewfinder role and encoded on the
+// stream path with VIEWFINDER_PATH_SUFFIX. Cameras that can't produce it stream the main one only
+static const bool VIEWFINDER_STREAM = false;
+static const uint32_t VIEWFINDER_WIDTH = 640;
+static const uint32_t VIEWFINDER_HEIGHT = 360;
+static const int64_t VIEWFINDER_BIT_RATE = 400000;
+static const char *VIEWFINDER_PATH_SUFFIX = "_viewfinder";
+
+enum class RequeueMode
+{
+    // Requeue one request per frame interval from the worker thread
+    Paced,
+    // Queue every buffer up front and requeue each request as soon as its frame is consumed.
+    // Frame rate is set by the sensor through FrameDurationLimits
+    OnCompletion,
+};
+
+static const RequeueMode REQUEUE_MODE = RequeueMode::OnCompletion;
 static const AVPixelFormat ENCODER_SRC_FORMAT = AV_PIX_FMT_YUV420P;
-static const char *STREAM_URL = "rtmp://0.0.0.0";
\ No newline at end of file
+// Keyframe interval. New viewers get the cached GOP or an on-demand IDR, so it can be long
+static const int GOP_SIZE = 4 * FPS;
+
+// An encoding of every camera frame. Layers are the capture size divided by a power of two and
+// are served on the stream path with their suffix
+struct SimulcastLayer
+{
+    int scale_divisor;
+    int64_t bit_rate;
+    const char *path_suffix;
+    // Also written to RECORD_DIRECTORY
+    bool record;
+};
+
+// The first layer is usually the full size, e.g. {{1, 4000000, "", true}, {4, 500000, "_low", false}}
+// records the full size and adds a quarter size stream on /stream_low. Downscaled layers share one
+// downscaling pass per frame
+static const std::vector<SimulcastLayer> SIMULCAST_LAYERS = {
+    {.scale_divisor = 1, .bit_rate = 1024000, .path_suffix = "", .record = false}};
+
+// Encoder tuning. LowLatency trades compression for delay: no B-frames, no lookahead and
+// intra refresh instead of periodic IDR frames
+enum class EncoderProfile
+{
+    Default,
+    LowLatency,
+};
+static const EncoderProfile ENCODER_PROFILE = EncoderProfile::LowLatency;
+
+// RTSP output
+static const uint16_t RTSP_PORT = 8554;
+// Path of the first camera. Further cameras are served on /stream1, /stream2 and so on
+static const char *STREAM_PATH = "/stream";
+static const size_t RTP_MTU = 1400;
+
+enum class SlowClientPolicy
+{
+    Disconnect,
+    // Drop everything queued for the client and resume it from the next keyframe
+    SkipToKeyframe,
+};
+
+static const SlowClientPolicy SLOW_CLIENT_POLICY = SlowClientPolicy::SkipToKeyframe;
+// Bytes queued for an RTSP client before it's considered too slow
+static const size_t RTSP_MAX_QUEUED_BYTES = 2 * 1024 * 1024;
+// RTP multicast of every H.264 stream, sent once for all receivers on the LAN. Streams take
+// consecutive even ports from MULTICAST_BASE_PORT. Their SDP is served on the stream path with
+// MULTICAST_SDP_SUFFIX, e.g. http://host:8080/stream.sdp. An empty interface uses the default route,
+// "127.0.0.1" keeps the stream on loopback for testing
+static const bool MULTICAST = false;
+static const char *MULTICAST_GROUP = "239.255.42.1";
+static const uint16_t MULTICAST_BASE_PORT = 5004;
+static const char *MULTICAST_INTERFACE = "";
+static const int MULTICAST_TTL = 1;
+static const bool MULTICAST_LOOPBACK = true;
+static const char *MULTICAST_SDP_SUFFIX = ".sdp";
+// Output congestion feedback. Encoders cut their bit rate while any viewer has more than
+// CONGESTION_QUEUED_BYTES queued, counting the socket send buffer, or its socket has been blocked
+// for CONGESTION_BLOCKED_USEC. Congestion lasting CONGESTION_SUSTAINED_USEC also halves the frame rate
+static const bool ADAPTIVE_BIT_RATE = true;
+static const size_t CONGESTION_QUEUED_BYTES = 256 * 1024;
+static const uint64_t CONGESTION_BLOCKED_USEC = 200000;
+static const uint64_t CONGESTION_SUSTAINED_USEC = 2000000;
+// Lowest adapted bit rate relative to the configured one
+static const double MIN_BIT_RATE_RATIO = 0.2;
+// Upper bound of the GOP replayed to joining clients. Longer GOPs aren't cached
+static const size_t RTSP_GOP_CACHE_MAX_BYTES = RTSP_MAX_QUEUED_BYTES / 2;
+
+enum class OutputMode
+{
+    // Decode and re-encode camera frames to H.264
+    Transcode,
+    // Send MJPEG camera frames as is. Raw cameras are always transcoded
+    MjpegPassthrough,
+};
+
+static const OutputMode OUTPUT_MODE = OutputMode::Transcode;
+
+// Part of the frame relative to its size, so it applies to every layer, e.g.
+// {.x = 0.5, .y = 0, .width = 0.5, .height = 0.5} is the top right quarter
+struct FrameRegion
+{
+    double x;
+    double y;
+    double width;
+    double height;
+};
+
+// Regions encoded at a different quality. qoffset ranges from -1, the most bits, to 1, the fewest.
+// Ignored by encoders without ROI support, e.g. the hardware one
+struct RegionOfInterest
+{
+    FrameRegion region;
+    double qoffset;
+};
+
+static const std::vector<RegionOfInterest> REGIONS_OF_INTEREST = {};
+// Regions filled with PRIVACY_MASK_COLOR before encoding and motion detection. MJPEG passthrough
+// streams aren't masked
+static const std::vector<FrameRegion> PRIVACY_MASKS = {};
+// Y, U and V of the mask. Black in video range
+static const uint8_t PRIVACY_MASK_COLOR[3] = {16, 128, 128};
+
+// HTTP endpoints, served on all interfaces like the RTSP server
+static const uint16_t HTTP_PORT = 8080;
+// Passthrough streams are served on the RTSP stream path with this suffix, e.g. /stream.mjpg
+static const char *MJPEG_STREAM_SUFFIX = ".mjpg";
+// Pipeline counters and latency histograms in Prometheus text format
+static const char *METRICS_PATH = "/metrics";
+// JPEG frames queued for a passthrough viewer before it starts skipping frames
+static const size_t MJPEG_MAX_QUEUED_FRAMES = 2;
+
+// Cached images of MJPEG cameras for dashboards, refreshed PREVIEW_FPS times a second. 0 disables them.
+// The camera frame is served as is on the stream path with SNAPSHOT_SUFFIX, e.g. /stream.jpg, and
+// a copy decoded at 1/2^PREVIEW_LOWRES size, up to 1/8, on PREVIEW_SUFFIX, e.g. /stream_preview.jpg.
+// Neither is masked, so they're off while PRIVACY_MASKS are set
+static const int PREVIEW_FPS = 1;
+static const char *SNAPSHOT_SUFFIX = ".jpg";
+static const char *PREVIEW_SUFFIX = "_preview.jpg";
+static const int PREVIEW_LOWRES = 2;
+// JPEG quantizer of the preview, from 2, the best, to 31
+static const int PREVIEW_QUALITY = 5;
+
+// MJPEG decoders working on consecutive frames. Decoded frames are reordered before encoding.
+// 1 decodes on the capture thread
+static const size_t MJPEG_DECODE_THREADS = 2;
+
+// Low-latency HLS of every H.264 stream, muxed into CMAF fragments in memory and served on the
+// stream path, e.g. http://host:8080/stream/index.m3u8. Parts of up to HLS_PART_USEC, a multiple of
+// the frame interval, are published as soon as they're encoded. Segments start on keyframes
+static const bool HLS = false;
+static const uint64_t HLS_PART_USEC = 200000;
+// Complete segments listed in the playlist
+static const size_t HLS_PLAYLIST_SEGMENTS = 4;
+// Memory for each stream, including parts still being sent. The oldest segments are dropped
+// beyond three quarters of it, and new parts are dropped if it runs out
+static const size_t HLS_STORE_BYTES = 8 * 1024 * 1024;
+
+// Recordings of layers with the record flag. Segments are fragmented MP4, split on the first
+// keyframe after RECORD_SEGMENT_USEC and fragmented every RECORD_FRAGMENT_USEC
+static const char *RECORD_DIRECTORY = "recordings";
+static const uint64_t RECORD_SEGMENT_USEC = 60 * 1000000;
+static const uint64_t RECORD_FRAGMENT_USEC = 1000000;
+// 1 MiB chunks buffered for the disk before the recorder starts dropping packets
+static const size_t RECORD_WRITE_QUEUE_DEPTH = 16;
+
+// Continuous records everything. OnEvent keeps the last RECORD_PRE_EVENT_USEC of packets in memory
+// and only records when triggered, from RECORD_PRE_EVENT_USEC before the trigger until
+// RECORD_POST_EVENT_USEC after the last one
+enum class RecordMode
+{
+    Continuous,
+    OnEvent,
+};
+
+static const RecordMode RECORD_MODE = RecordMode::Continuous;
+static const uint64_t RECORD_PRE_EVENT_USEC = 10 * 1000000;
+static const uint64_t RECORD_POST_EVENT_USEC = 30 * 1000000;
+// Memory reserved per recorded stream for pre-event packets. The oldest GOPs are dropped beyond it
+static const size_t RECORD_PRE_EVENT_BYTES = 16 * 1024 * 1024;
+// A POST to this path followed by the stream path triggers a recording, e.g. /record/stream
+static const char *RECORD_TRIGGER_PATH = "/record";
+
+// Motion detection on the luma plane of encoded frames. Streams without motion for MOTION_IDLE_USEC
+// drop to MOTION_IDLE_FPS and MOTION_IDLE_BIT_RATE_RATIO of their bit rate until the next motion
+static const bool MOTION_DETECTION = false;
+// 16x16 blocks have changed if their sum of absolute differences from the background over the
+// sampled rows, divided by the pixels sampled, is above this
+static const int MOTION_PIXEL_THRESHOLD = 12;
+// Share of changed blocks that counts as motion
+static const double MOTION_AREA_RATIO = 0.005;
+static const uint64_t MOTION_IDLE_USEC = 5000000;
+static const int MOTION_IDLE_FPS = 5;
+static const double MOTION_IDLE_BIT_RATE_RATIO = 0.25;
+// Motion starts or extends event recordings of recorded streams in RecordMode::OnEvent
+static const bool MOTION_TRIGGERS_RECORDING = true;
+// Motion state as JSON on this path followed by the stream path, e.g. /motion/stream
+static const char *MOTION_PATH = "/motion";
+
+// Depth of the bounded queues between pipeline stages
+static const size_t FRAME_QUEUE_DEPTH = 4;
+
+// What the camera does with new frames while the pipeline behind it can't keep up. Frames are
+// always dropped once the capture sink queue is full
+enum class AdmissionPolicy
+{
+    // No shedding before the queue is full
+    None,
+    // Drop every ADMISSION_DECIMATION-th frame
+    Decimate,
+    // Skip queued frames that already have a newer frame behind them
+    LatestOnly,
+    // Stretch the sensor frame duration, down to ADMISSION_MIN_FPS
+    FrameRate,
+};
+
+static const AdmissionPolicy ADMISSION_POLICY = AdmissionPolicy::LatestOnly;
+// Frames queued downstream of the camera at which the pipeline is overloaded. It stays overloaded
+// until the queues drain
+static const size_t ADMISSION_BACKLOG_HIGH = FRAME_QUEUE_DEPTH / 2;
+static const size_t ADMISSION_DECIMATION = 2;
+static const int ADMISSION_MIN_FPS = FPS / 4;
+static const size_t PACKET_QUEUE_DEPTH = 64;
\ No newline at end of file
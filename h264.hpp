@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+enum class NalType : uint8_t
+{
+    Slice = 1,
+    Idr = 5,
+    Sei = 6,
+    Sps = 7,
+    Pps = 8,
+    AccessUnitDelimiter = 9,
+    FuA = 28,
+};
+
+struct NalUnit
+{
+    const uint8_t *data;
+    size_t size;
+
+    NalType type() const
+    {
+        return (NalType)(data[0] & 0x1f);
+    }
+};
+
+// Calls the function for every NAL unit of an Annex B byte stream. Start codes are stripped
+template <typename F>
+void for_each_nal_unit(const uint8_t *data, size_t size, F &&function)
+{
+    auto find_start_code = [data, size](size_t from)
+    {
+        for (size_t n = from; n + 3 <= size; n++)
+        {
+            if (data[n] == 0 && data[n + 1] == 0 && data[n + 2] == 1)
+            {
+                return n;
+            }
+        }
+
+        return size;
+    };
+
+    auto start = find_start_code(0);
+
+    while (start < size)
+    {
+        auto nal_start = start + 3;
+        auto next = find_start_code(nal_start);
+
+        // The zero byte of a 4-byte start code belongs to the next start code
+        auto nal_end = next;
+        while (nal_end > nal_start && data[nal_end - 1] == 0)
+        {
+            nal_end--;
+        }
+
+        if (nal_end > nal_start)
+        {
+            function(NalUnit{.data = data + nal_start, .size = nal_end - nal_start});
+        }
+
+        start = next;
+    }
+}
+
+// Whether an Annex B access unit has an IDR slice, so decoding can start from it
+inline bool contains_idr(const uint8_t *data, size_t size)
+{
+    bool idr = false;
+    for_each_nal_unit(data, size, [&idr](const NalUnit &nal)
+                      { idr |= nal.type() == NalType::Idr; });
+    return idr;
+}
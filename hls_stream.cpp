@@ -0,0 +1,686 @@
+#include "hls_stream.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+
+extern "C"
+{
+#include <libavutil/mem.h>
+}
+
+#include <spdlog/spdlog.h>
+
+#include "clock.hpp"
+#include "globals.hpp"
+#include "http_server.hpp"
+
+// Parts start on a new block, so blocks are sized for a P-frame part rather than a keyframe
+static const size_t BLOCK_SIZE = 16 * 1024;
+// Segments are kept within three quarters of HLS_STORE_BYTES. The rest holds the part being muxed,
+// the init section and evicted parts that responses are still sending
+static const size_t STORE_BUDGET_BYTES = HLS_STORE_BYTES / 4 * 3;
+// Parts are listed for the segments within about three target durations of the live edge
+static const size_t PART_LISTED_SEGMENTS = 3;
+// Held requests are answered with 503 after this many target durations, checked every second
+static const uint64_t HOLD_TARGET_DURATIONS = 3;
+static const uint64_t EXPIRY_CHECK_USEC = 1000000;
+
+static Counter s_parts("libcam_hls_parts_total", "HLS parts published");
+static Counter s_parts_dropped("libcam_hls_dropped_parts_total", "HLS parts dropped because their blocks ran out");
+static Counter s_packets_dropped("libcam_hls_dropped_packets_total", "Encoded packets the HLS muxer couldn't keep up with");
+static Counter s_requests_expired("libcam_hls_expired_requests_total", "Blocking HLS requests that timed out");
+
+static const AVRational USEC_TIME_BASE = {1, 1000000};
+
+// Parses a non-negative integer query parameter. Empty if it's missing or invalid, and invalid is
+// set for values that aren't numbers from 0 to INT64_MAX
+static std::optional<int64_t> index_param(const HttpRequest &request, std::string_view name, bool &invalid)
+{
+    auto value = request.query_param(name);
+    if (!value)
+    {
+        return std::nullopt;
+    }
+
+    char *end = nullptr;
+    errno = 0;
+    auto index = strtoull(value->c_str(), &end, 10);
+    if (value->empty() || *end != '\0' || (*value)[0] == '-' || errno == ERANGE || index > INT64_MAX)
+    {
+        invalid = true;
+        return std::nullopt;
+    }
+    return (int64_t)index;
+}
+
+HlsStream::Part::~Part()
+{
+    for (auto &block : blocks)
+    {
+        av_buffer_unref(&block);
+    }
+}
+
+HlsStream::Store::Store(const std::string &stream_path, uint64_t target_duration_usec)
+    : m_target_duration_usec(target_duration_usec),
+      m_store_bytes("libcam_hls_store_bytes", "Memory held by HLS segments",
+                    fmt::format("stream=\"{}\"", stream_path.substr(stream_path.find_first_not_of('/'))))
+{
+}
+
+void HlsStream::Store::add_part(std::shared_ptr<const Part> part, bool ends_segment)
+{
+    // A segment whose last parts were dropped ends with the next keyframe
+    if (!m_segments.empty() && part->independent)
+    {
+        m_segments.back().complete = true;
+    }
+
+    if (m_segments.empty() || m_segments.back().complete)
+    {
+        m_segments.push_back(Segment{.sequence = m_next_sequence++});
+    }
+
+    auto &segment = m_segments.back();
+    segment.duration_usec += part->duration_usec;
+    segment.complete = ends_segment;
+    m_bytes += part->blocks.size() * BLOCK_SIZE;
+    segment.parts.push_back(std::move(part));
+
+    evict();
+    m_store_bytes.set(m_bytes);
+    answer_pending();
+}
+
+void HlsStream::Store::start(EventLoop &loop)
+{
+    // Stopped in close(), before the store can go away
+    m_loop = &loop;
+    m_expiry_timer = loop.add_timer(EXPIRY_CHECK_USEC, [this]()
+                                    { expire_pending(); });
+}
+
+void HlsStream::Store::close()
+{
+    m_closed = true;
+    if (m_loop)
+    {
+        m_loop->remove_timer(m_expiry_timer);
+        m_expiry_timer = -1;
+    }
+
+    for (auto &pending : m_pending)
+    {
+        if (auto connection = pending.connection.lock())
+        {
+            connection->respond(503, "text/plain", "Stream ended\n");
+        }
+    }
+    m_pending.clear();
+}
+
+void HlsStream::Store::answer_pending()
+{
+    std::erase_if(m_pending, [this](const PendingRequest &pending)
+                  {
+                      auto connection = pending.connection.lock();
+                      if (!connection || connection->is_closed())
+                      {
+                          return true;
+                      }
+
+                      if (has(pending.sequence, pending.part))
+                      {
+                          answer(connection, pending.sequence, pending.part, pending.playlist);
+                          return true;
+                      }
+                      return false; });
+}
+
+void HlsStream::Store::expire_pending()
+{
+    // Covers streams that stopped, when no part arrives to answer the requests
+    auto now = monotonic_usec();
+    std::erase_if(m_pending, [now](const PendingRequest &pending)
+                  {
+                      auto connection = pending.connection.lock();
+                      if (!connection || connection->is_closed())
+                      {
+                          return true;
+                      }
+
+                      if (now >= pending.deadline_usec)
+                      {
+                          s_requests_expired.add();
+                          connection->respond(503, "text/plain", "Timed out waiting for the part\n");
+                          return true;
+                      }
+                      return false; });
+}
+
+void HlsStream::Store::serve_playlist(const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection)
+{
+    bool invalid = false;
+    auto sequence = index_param(request, "_HLS_msn", invalid);
+    auto part = index_param(request, "_HLS_part", invalid);
+    if (invalid)
+    {
+        connection->respond(400, "text/plain", "Invalid _HLS_msn or _HLS_part\n");
+        return;
+    }
+    if (part && !sequence)
+    {
+        connection->respond(400, "text/plain", "_HLS_part needs _HLS_msn\n");
+        return;
+    }
+
+    // Plain reloads only wait for the first part
+    if (!sequence)
+    {
+        hold(connection, 0, 0, true);
+        return;
+    }
+
+    if ((uint64_t)*sequence > m_next_sequence + 1)
+    {
+        connection->respond(400, "text/plain", "Media sequence number is too far ahead\n");
+        return;
+    }
+    hold(connection, *sequence, part ? *part : -1, true);
+}
+
+void HlsStream::Store::serve_init(const std::shared_ptr<HttpConnection> &connection)
+{
+    if (!m_init)
+    {
+        connection->respond(503, "text/plain", "No init section yet\n");
+        return;
+    }
+    send(connection, {m_init});
+}
+
+void HlsStream::Store::serve_media(const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection,
+                                   bool part)
+{
+    bool invalid = false;
+    auto sequence = index_param(request, "msn", invalid);
+    auto index = index_param(request, "part", invalid);
+    if (invalid || !sequence || (part && !index))
+    {
+        connection->respond(400, "text/plain", part ? "Expected msn and part\n" : "Expected msn\n");
+        return;
+    }
+
+    // Requests for the next part, like the preload hint, are held until it's published
+    bool evicted = !m_segments.empty() && (uint64_t)*sequence < m_segments.front().sequence;
+    if (evicted || (uint64_t)*sequence > m_next_sequence)
+    {
+        connection->respond(404, "text/plain", "Not found\n");
+        return;
+    }
+    hold(connection, *sequence, part ? *index : -1, false);
+}
+
+bool HlsStream::Store::has(uint64_t sequence, int64_t part) const
+{
+    if (m_segments.empty() || sequence > m_segments.back().sequence)
+    {
+        return false;
+    }
+
+    auto segment = find(sequence);
+    if (!segment)
+    {
+        return true;
+    }
+    return segment->complete || (part >= 0 && (size_t)part < segment->parts.size());
+}
+
+const HlsStream::Segment *HlsStream::Store::find(uint64_t sequence) const
+{
+    if (m_segments.empty() || sequence < m_segments.front().sequence || sequence > m_segments.back().sequence)
+    {
+        return nullptr;
+    }
+    return &m_segments[sequence - m_segments.front().sequence];
+}
+
+std::string HlsStream::Store::playlist() const
+{
+    auto target_duration_usec = m_target_duration_usec;
+    for (auto &segment : m_segments)
+    {
+        target_duration_usec = std::max(target_duration_usec, segment.duration_usec);
+    }
+
+    auto part_target = HLS_PART_USEC / 1e6;
+    auto text = fmt::format("#EXTM3U\n"
+                            "#EXT-X-VERSION:9\n"
+                            "#EXT-X-TARGETDURATION:{}\n"
+                            "#EXT-X-PART-INF:PART-TARGET={:.3f}\n"
+                            "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK={:.3f}\n"
+                            "#EXT-X-INDEPENDENT-SEGMENTS\n"
+                            "#EXT-X-MEDIA-SEQUENCE:{}\n"
+                            "#EXT-X-MAP:URI=\"init.mp4\"\n",
+                            (uint64_t)ceil(target_duration_usec / 1e6), part_target, 3 * part_target,
+                            m_segments.front().sequence);
+
+    for (size_t n = 0; n < m_segments.size(); n++)
+    {
+        auto &segment = m_segments[n];
+
+        if (n + PART_LISTED_SEGMENTS >= m_segments.size())
+        {
+            for (size_t part = 0; part < segment.parts.size(); part++)
+            {
+                text += fmt::format("#EXT-X-PART:DURATION={:.5f},URI=\"part.m4s?msn={}&part={}\"{}\n",
+                                    segment.parts[part]->duration_usec / 1e6, segment.sequence, part,
+                                    segment.parts[part]->independent ? ",INDEPENDENT=YES" : "");
+            }
+        }
+
+        if (segment.complete)
+        {
+            text += fmt::format("#EXTINF:{:.5f},\nsegment.m4s?msn={}\n", segment.duration_usec / 1e6, segment.sequence);
+        }
+    }
+
+    auto &last = m_segments.back();
+    text += fmt::format("#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"part.m4s?msn={}&part={}\"\n",
+                        last.complete ? last.sequence + 1 : last.sequence, last.complete ? 0 : last.parts.size());
+    return text;
+}
+
+void HlsStream::Store::hold(const std::shared_ptr<HttpConnection> &connection, uint64_t sequence, int64_t part,
+                            bool playlist)
+{
+    if (has(sequence, part))
+    {
+        answer(connection, sequence, part, playlist);
+        return;
+    }
+
+    if (m_closed)
+    {
+        connection->respond(503, "text/plain", "Stream ended\n");
+        return;
+    }
+
+    m_pending.push_back(PendingRequest{
+        .connection = connection,
+        .sequence = sequence,
+        .part = part,
+        .playlist = playlist,
+        .deadline_usec = monotonic_usec() + HOLD_TARGET_DURATIONS * m_target_duration_usec,
+    });
+}
+
+void HlsStream::Store::answer(const std::shared_ptr<HttpConnection> &connection, uint64_t sequence, int64_t part,
+                              bool playlist)
+{
+    if (playlist)
+    {
+        connection->respond(200, "application/vnd.apple.mpegurl", this->playlist());
+        return;
+    }
+
+    // A segment may end before the part a client guessed at, and old ones are evicted
+    auto segment = find(sequence);
+    if (segment && part < 0 && segment->complete)
+    {
+        send(connection, segment->parts);
+    }
+    else if (segment && part >= 0 && (size_t)part < segment->parts.size())
+    {
+        send(connection, {segment->parts[part]});
+    }
+    else
+    {
+        connection->respond(404, "text/plain", "Not found\n");
+    }
+}
+
+void HlsStream::Store::send(const std::shared_ptr<HttpConnection> &connection,
+                            const std::vector<std::shared_ptr<const Part>> &parts)
+{
+    size_t size = 0;
+    for (auto &part : parts)
+    {
+        size += part->size;
+    }
+
+    // Blocks are sent by reference, so an evicted part stays valid until it's written
+    connection->start_response(200, "video/mp4", size);
+    for (auto &part : parts)
+    {
+        for (size_t n = 0; n < part->blocks.size(); n++)
+        {
+            auto block = part->blocks[n];
+            connection->queue(block, block->data, std::min(BLOCK_SIZE, part->size - n * BLOCK_SIZE));
+        }
+    }
+    connection->flush();
+}
+
+void HlsStream::Store::evict()
+{
+    auto complete = std::count_if(m_segments.begin(), m_segments.end(), [](const Segment &segment)
+                                  { return segment.complete; });
+
+    while (m_segments.size() > 1 && ((size_t)complete > HLS_PLAYLIST_SEGMENTS || m_bytes > STORE_BUDGET_BYTES))
+    {
+        for (auto &part : m_segments.front().parts)
+        {
+            m_bytes -= part->blocks.size() * BLOCK_SIZE;
+        }
+        complete -= m_segments.front().complete;
+        m_segments.pop_front();
+    }
+}
+
+HlsStream::HlsStream(const std::string &stream_path, const AVCodecParameters *codec_params, AVRational time_base)
+    : m_path(stream_path),
+      m_time_base(time_base),
+      m_hls_stage("hls", PACKET_QUEUE_DEPTH, [this](AVPacket *&packet)
+                  { mux_packet(packet); })
+{
+    // Segments normally run a GOP, unless a keyframe is forced early
+    auto target_duration_usec = std::max<uint64_t>((uint64_t)GOP_SIZE * 1000000 / FPS, HLS_PART_USEC);
+    m_store = std::make_shared<Store>(m_path, target_duration_usec);
+
+    // Every block is allocated up front. The pool never grows beyond them, so memory stays
+    // bounded however long responses hold on to evicted parts
+    m_block_pool = av_buffer_pool_init2(BLOCK_SIZE, this, &HlsStream::allocate_block, nullptr);
+    std::vector<AVBufferRef *> blocks;
+    for (size_t n = 0; m_block_pool && n < HLS_STORE_BYTES / BLOCK_SIZE; n++)
+    {
+        blocks.push_back(av_buffer_pool_get(m_block_pool));
+    }
+    bool allocated = std::none_of(blocks.begin(), blocks.end(), [](AVBufferRef *block)
+                                  { return block == nullptr; });
+    for (auto &block : blocks)
+    {
+        av_buffer_unref(&block);
+    }
+
+    if (!m_block_pool || !allocated)
+    {
+        spdlog::critical("Failed to allocate {} KiB of HLS blocks", HLS_STORE_BYTES / 1024);
+        throw;
+    }
+
+    open_muxer(codec_params);
+
+    auto &server = HttpServer::instance();
+    server.loop().post([store = m_store, &loop = server.loop()]()
+                       { store->start(loop); });
+
+    m_routes = {m_path + "/index.m3u8", m_path + "/init.mp4", m_path + "/segment.m4s", m_path + "/part.m4s"};
+    server.route(m_routes[0], [store = m_store](const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection)
+                 { store->serve_playlist(request, connection); });
+    server.route(m_routes[1], [store = m_store](const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection)
+                 { store->serve_init(connection); });
+    server.route(m_routes[2], [store = m_store](const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection)
+                 { store->serve_media(request, connection, false); });
+    server.route(m_routes[3], [store = m_store](const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection)
+                 { store->serve_media(request, connection, true); });
+
+    spdlog::info("Serving low-latency HLS on http://0.0.0.0:{}{} with {} ms parts", HTTP_PORT, m_routes[0],
+                 HLS_PART_USEC / 1000);
+}
+
+HlsStream::~HlsStream()
+{
+    auto &server = HttpServer::instance();
+    for (auto &route : m_routes)
+    {
+        server.unroute(route);
+    }
+    server.loop().post([store = m_store]()
+                       { store->close(); });
+
+    m_hls_stage.stop();
+    av_packet_free(&m_held_packet);
+
+    av_freep(&m_format_context->pb->buffer);
+    avio_context_free(&m_format_context->pb);
+    avformat_free_context(m_format_context);
+
+    // Freed once the last block is returned
+    av_buffer_pool_uninit(&m_block_pool);
+}
+
+void HlsStream::push_packet(const AVPacket *packet)
+{
+    bool keyframe = packet->flags & AV_PKT_FLAG_KEY;
+    if (m_waiting_keyframe && !keyframe)
+    {
+        return;
+    }
+    m_waiting_keyframe = false;
+
+    auto packet_ref = av_packet_clone(packet);
+    if (!packet_ref || !m_hls_stage.push(packet_ref))
+    {
+        spdlog::warn("HLS muxer is saturated. Dropping packets until the next keyframe");
+        s_packets_dropped.add();
+        av_packet_free(&packet_ref);
+        m_waiting_keyframe = true;
+    }
+}
+
+void HlsStream::mux_packet(AVPacket *packet)
+{
+    bool keyframe = packet->flags & AV_PKT_FLAG_KEY;
+
+    // Skipped frames stretch the one before them, so the timeline has no gaps
+    if (m_held_packet)
+    {
+        auto duration = packet->dts - m_held_packet->dts;
+        m_held_packet->duration = duration > 0 ? duration : m_last_duration;
+        write_packet(m_held_packet);
+    }
+
+    // Parts end before they'd outgrow HLS_PART_USEC, assuming the next frame is as long as the last
+    auto part_usec = av_rescale_q(m_part_duration + m_last_duration, m_time_base, USEC_TIME_BASE);
+    if (m_part_packets > 0 && (keyframe || part_usec > (int64_t)HLS_PART_USEC))
+    {
+        flush_part(keyframe);
+    }
+
+    m_held_packet = packet;
+}
+
+void HlsStream::write_packet(AVPacket *packet)
+{
+    if (m_part_packets == 0)
+    {
+        m_part->independent = packet->flags & AV_PKT_FLAG_KEY;
+    }
+    m_last_duration = packet->duration;
+    m_part_duration += packet->duration;
+    m_part_packets++;
+
+    // The timeline starts at zero and runs on across segments
+    if (m_start_dts == AV_NOPTS_VALUE)
+    {
+        m_start_dts = packet->dts;
+    }
+    packet->pts -= m_start_dts;
+    packet->dts -= m_start_dts;
+    packet->stream_index = 0;
+    av_packet_rescale_ts(packet, m_time_base, m_format_context->streams[0]->time_base);
+
+    if (av_write_frame(m_format_context, packet) < 0)
+    {
+        spdlog::warn("Error muxing HLS packet");
+    }
+    av_packet_free(&packet);
+}
+
+void HlsStream::open_muxer(const AVCodecParameters *codec_params)
+{
+    avformat_alloc_output_context2(&m_format_context, nullptr, "mp4", nullptr);
+    if (!m_format_context)
+    {
+        spdlog::critical("Failed to create HLS muxer");
+        throw;
+    }
+
+    auto stream = avformat_new_stream(m_format_context, nullptr);
+    auto io_buffer = static_cast<uint8_t *>(av_malloc(BLOCK_SIZE));
+    if (!stream || !io_buffer || avcodec_parameters_copy(stream->codecpar, codec_params) < 0)
+    {
+        spdlog::critical("Failed to set up HLS stream");
+        throw;
+    }
+    stream->time_base = m_time_base;
+
+    m_format_context->pb = avio_alloc_context(io_buffer, BLOCK_SIZE, 1, this, nullptr, &HlsStream::write_output, nullptr);
+    m_format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    // A fragment is written for every part on request. The moov waits for the first keyframe,
+    // which carries the parameter sets
+    AVDictionary *options = nullptr;
+    av_dict_set(&options, "movflags", "empty_moov+delay_moov+default_base_moof+frag_custom", 0);
+
+    auto ret = avformat_write_header(m_format_context, &options);
+    av_dict_free(&options);
+
+    if (ret < 0)
+    {
+        spdlog::critical("Failed to start HLS muxer");
+        throw;
+    }
+}
+
+void HlsStream::flush_part(bool ends_segment)
+{
+    av_write_frame(m_format_context, nullptr);
+    avio_flush(m_format_context->pb);
+
+    m_part->duration_usec = av_rescale_q(m_part_duration, m_time_base, USEC_TIME_BASE);
+    m_part_duration = 0;
+    m_part_packets = 0;
+
+    auto &loop = HttpServer::instance().loop();
+    if (m_init && m_init->size > 0)
+    {
+        if (m_init->failed)
+        {
+            spdlog::error("No blocks left for the HLS init section of {}", m_path);
+            m_init.reset();
+        }
+        else
+        {
+            loop.post([store = m_store, init = std::shared_ptr<const Part>(std::move(m_init))]()
+                      { store->set_init(init); });
+        }
+    }
+
+    if (m_part->size == 0)
+    {
+        return;
+    }
+
+    // Parts after a dropped one reference frames that are gone, up to the next segment
+    if (m_part->failed || (m_skipping_segment && !m_part->independent))
+    {
+        if (!m_skipping_segment)
+        {
+            spdlog::warn("HLS store of {} is out of blocks. Dropping parts until the next segment", m_path);
+        }
+        s_parts_dropped.add();
+        m_skipping_segment = true;
+        m_part = std::make_unique<Part>();
+        return;
+    }
+    m_skipping_segment = false;
+
+    loop.post([store = m_store, part = std::shared_ptr<const Part>(std::move(m_part)), ends_segment]()
+              { store->add_part(part, ends_segment); });
+    m_part = std::make_unique<Part>();
+    s_parts.add();
+}
+
+void HlsStream::append(const uint8_t *data, size_t size)
+{
+    auto &target = m_box_is_init && m_init ? m_init : m_part;
+
+    while (size > 0 && !target->failed)
+    {
+        auto used = target->size % BLOCK_SIZE;
+        if (used == 0)
+        {
+            auto block = av_buffer_pool_get(m_block_pool);
+            if (!block)
+            {
+                target->failed = true;
+                return;
+            }
+            target->blocks.push_back(block);
+        }
+
+        auto count = std::min(BLOCK_SIZE - used, size);
+        memcpy(target->blocks.back()->data + used, data, count);
+        target->size += count;
+        data += count;
+        size -= count;
+    }
+}
+
+int HlsStream::write_output(void *opaque, const uint8_t *data, int size)
+{
+    auto stream = static_cast<HlsStream *>(opaque);
+
+    for (int offset = 0; offset < size;)
+    {
+        if (stream->m_box_remaining > 0)
+        {
+            // Output of a failed part is still parsed, so the next box is found
+            auto count = (int)std::min<uint64_t>(stream->m_box_remaining, size - offset);
+            stream->append(data + offset, count);
+            stream->m_box_remaining -= count;
+            offset += count;
+            continue;
+        }
+
+        // Box headers may be split across writes
+        auto &header = stream->m_box_header;
+        auto count = std::min<size_t>(sizeof(header) - stream->m_box_header_size, size - offset);
+        memcpy(header + stream->m_box_header_size, data + offset, count);
+        stream->m_box_header_size += count;
+        offset += count;
+        if (stream->m_box_header_size < sizeof(header))
+        {
+            continue;
+        }
+        stream->m_box_header_size = 0;
+
+        uint64_t box_size = (uint64_t)header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3];
+        stream->m_box_is_init = !memcmp(header + 4, "ftyp", 4) || !memcmp(header + 4, "moov", 4);
+        // Sizes of 0 and 1 mean the box runs to the end or has a 64-bit size. The muxer writes
+        // neither for fragments, so the rest of the output goes to the same place
+        stream->m_box_remaining = box_size >= sizeof(header) ? box_size - sizeof(header) : UINT64_MAX;
+
+        stream->append(header, sizeof(header));
+    }
+    return size;
+}
+
+AVBufferRef *HlsStream::allocate_block(void *opaque, size_t size)
+{
+    auto stream = static_cast<HlsStream *>(opaque);
+    if (stream->m_blocks_allocated >= HLS_STORE_BYTES / BLOCK_SIZE)
+    {
+        return nullptr;
+    }
+
+    auto block = av_buffer_alloc(size);
+    stream->m_blocks_allocated += block != nullptr;
+    return block;
+}
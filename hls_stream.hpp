@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/buffer.h>
+}
+
+#include "metrics.hpp"
+#include "pipeline_stage.hpp"
+
+class EventLoop;
+class HttpConnection;
+struct HttpRequest;
+
+// Serves a stream as low-latency HLS. Packets are muxed into CMAF fragments on their own thread,
+// one per part, and kept in fixed-size blocks from a pool capped at HLS_STORE_BYTES. The
+// playlist, parts and segments are served from memory on the HTTP server thread, which also holds
+// blocking playlist reloads until the part they wait for is published
+class HlsStream
+{
+public:
+    // Served on the stream path, e.g. /stream/index.m3u8
+    HlsStream(const std::string &stream_path, const AVCodecParameters *codec_params, AVRational time_base);
+    HlsStream(const HlsStream &other) = delete;
+    HlsStream &operator=(const HlsStream &other) = delete;
+    ~HlsStream();
+
+    // Never blocks. Called from a single thread
+    void push_packet(const AVPacket *packet);
+
+private:
+    // Muxer output, in blocks referenced by every response that sends it
+    struct Part
+    {
+        Part() = default;
+        Part(const Part &other) = delete;
+        Part &operator=(const Part &other) = delete;
+        ~Part();
+
+        std::vector<AVBufferRef *> blocks = {};
+        size_t size = 0;
+        uint64_t duration_usec = 0;
+        bool independent = false;
+        // Set if the pool ran out of blocks. The part is dropped
+        bool failed = false;
+    };
+
+    struct Segment
+    {
+        uint64_t sequence;
+        std::vector<std::shared_ptr<const Part>> parts = {};
+        uint64_t duration_usec = 0;
+        bool complete = false;
+    };
+
+    // A request held until the part or playlist it asks for exists
+    struct PendingRequest
+    {
+        std::weak_ptr<HttpConnection> connection;
+        uint64_t sequence;
+        // Index of the part, or -1 for the whole segment
+        int64_t part;
+        bool playlist;
+        uint64_t deadline_usec;
+    };
+
+    // Owned by the HTTP server thread. Shared with the routes, which may outlive the stream for a
+    // moment
+    class Store
+    {
+    public:
+        Store(const std::string &stream_path, uint64_t target_duration_usec);
+
+        // Starts expiring held requests. Runs on the loop thread
+        void start(EventLoop &loop);
+        void set_init(std::shared_ptr<const Part> init) { m_init = std::move(init); }
+        // Completes the current segment after the part if ends_segment is set
+        void add_part(std::shared_ptr<const Part> part, bool ends_segment);
+        // Answers every held request and stops the timer
+        void close();
+
+        void serve_playlist(const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection);
+        void serve_init(const std::shared_ptr<HttpConnection> &connection);
+        void serve_media(const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection, bool part);
+
+    private:
+        // Whether the playlist lists the part, or the whole segment if part is -1
+        bool has(uint64_t sequence, int64_t part) const;
+        const Segment *find(uint64_t sequence) const;
+        std::string playlist() const;
+        void hold(const std::shared_ptr<HttpConnection> &connection, uint64_t sequence, int64_t part, bool playlist);
+        void answer(const std::shared_ptr<HttpConnection> &connection, uint64_t sequence, int64_t part, bool playlist);
+        void send(const std::shared_ptr<HttpConnection> &connection, const std::vector<std::shared_ptr<const Part>> &parts);
+        void evict();
+        // Answers held requests for parts that are published now
+        void answer_pending();
+        // Answers held requests past their deadline with 503
+        void expire_pending();
+
+        uint64_t m_target_duration_usec;
+        std::shared_ptr<const Part> m_init = nullptr;
+        std::deque<Segment> m_segments = {};
+        uint64_t m_next_sequence = 0;
+        size_t m_bytes = 0;
+        std::vector<PendingRequest> m_pending = {};
+        bool m_closed = false;
+        EventLoop *m_loop = nullptr;
+        int m_expiry_timer = -1;
+
+        Gauge m_store_bytes;
+    };
+
+    void mux_packet(AVPacket *packet);
+    void write_packet(AVPacket *packet);
+    void open_muxer(const AVCodecParameters *codec_params);
+    void flush_part(bool ends_segment);
+    void append(const uint8_t *data, size_t size);
+    static int write_output(void *opaque, const uint8_t *data, int size);
+    // Pool allocator that fails beyond HLS_STORE_BYTES. Called with the pool locked
+    static AVBufferRef *allocate_block(void *opaque, size_t size);
+
+    std::string m_path;
+    std::vector<std::string> m_routes;
+    AVRational m_time_base;
+    AVBufferPool *m_block_pool = nullptr;
+    size_t m_blocks_allocated = 0;
+    std::shared_ptr<Store> m_store;
+
+    // Producer side. Packets after a dropped one are useless until the next keyframe
+    bool m_waiting_keyframe = true;
+
+    // Owned by the HLS stage. Each packet is held until the next one gives its duration
+    AVFormatContext *m_format_context = nullptr;
+    AVPacket *m_held_packet = nullptr;
+    int64_t m_start_dts = AV_NOPTS_VALUE;
+    int64_t m_last_duration = 0;
+    int64_t m_part_duration = 0;
+    size_t m_part_packets = 0;
+    // Set after a dropped part. Parts are dropped up to the next segment, which doesn't need them
+    bool m_skipping_segment = false;
+    std::unique_ptr<Part> m_init = std::make_unique<Part>();
+    std::unique_ptr<Part> m_part = std::make_unique<Part>();
+
+    // Muxer output is split by top-level box. ftyp and moov go to the init section
+    uint8_t m_box_header[8] = {};
+    size_t m_box_header_size = 0;
+    uint64_t m_box_remaining = 0;
+    bool m_box_is_init = false;
+
+    PipelineStage<AVPacket *> m_hls_stage;
+};
@@ -0,0 +1,340 @@
+#include "http_server.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "globals.hpp"
+#include "socket_utils.hpp"
+
+static const size_t MAX_REQUEST_SIZE = 8192;
+
+static std::string_view status_text(int status)
+{
+    switch (status)
+    {
+    case 200:
+        return "OK";
+    case 202:
+        return "Accepted";
+    case 204:
+        return "No Content";
+    case 400:
+        return "Bad Request";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 503:
+        return "Service Unavailable";
+    default:
+        return "Unknown";
+    }
+}
+
+std::optional<std::string> HttpRequest::query_param(std::string_view name) const
+{
+    std::string_view query = this->query;
+
+    while (!query.empty())
+    {
+        auto end = query.find('&');
+        auto param = query.substr(0, end);
+        auto separator = param.find('=');
+
+        if (param.substr(0, separator) == name)
+        {
+            return std::string(separator == std::string_view::npos ? "" : param.substr(separator + 1));
+        }
+
+        if (end == std::string_view::npos)
+        {
+            break;
+        }
+        query.remove_prefix(end + 1);
+    }
+
+    return std::nullopt;
+}
+
+HttpConnection::HttpConnection(HttpServer &server, int fd) : m_server(server), m_fd(fd)
+{
+}
+
+HttpConnection::~HttpConnection()
+{
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+    }
+}
+
+void HttpConnection::respond(int status, std::string_view content_type, std::string_view body)
+{
+    send_headers(status, content_type, body.size());
+    m_send_queue.push(body);
+    m_close_after_flush = true;
+    flush();
+}
+
+void HttpConnection::respond(int status, std::string_view content_type, const AVBufferRef *body,
+                             const uint8_t *data, size_t size)
+{
+    send_headers(status, content_type, size);
+    m_send_queue.push(body, data, size);
+    m_close_after_flush = true;
+    flush();
+}
+
+void HttpConnection::start_response(int status, std::string_view content_type, size_t content_length)
+{
+    send_headers(status, content_type, content_length);
+    m_close_after_flush = true;
+}
+
+void HttpConnection::start_stream(std::string_view content_type)
+{
+    send_headers(200, content_type, std::nullopt);
+    flush();
+}
+
+void HttpConnection::queue(const AVBufferRef *buffer, const uint8_t *data, size_t size)
+{
+    if (!is_closed())
+    {
+        m_send_queue.push(buffer, data, size);
+    }
+}
+
+void HttpConnection::queue(std::string_view data)
+{
+    if (!is_closed())
+    {
+        m_send_queue.push(data);
+    }
+}
+
+void HttpConnection::close()
+{
+    if (is_closed())
+    {
+        return;
+    }
+
+    m_send_queue.clear();
+    m_server.remove_connection(m_fd);
+    ::close(m_fd);
+    m_fd = -1;
+}
+
+void HttpConnection::on_events(uint32_t events)
+{
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        close();
+        return;
+    }
+
+    if (events & EPOLLIN)
+    {
+        on_readable();
+    }
+
+    if (!is_closed() && (events & EPOLLOUT))
+    {
+        flush();
+    }
+}
+
+void HttpConnection::on_readable()
+{
+    char data[1024];
+
+    while (!is_closed())
+    {
+        auto size = recv(m_fd, data, sizeof(data), MSG_DONTWAIT);
+        if (size == 0)
+        {
+            close();
+            return;
+        }
+
+        if (size < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                close();
+            }
+            return;
+        }
+
+        // Anything after the request, e.g. on a streaming connection, is ignored
+        if (m_request_handled)
+        {
+            continue;
+        }
+
+        m_request_data.append(data, size);
+
+        auto header_end = m_request_data.find("\r\n\r\n");
+        if (header_end == std::string::npos)
+        {
+            if (m_request_data.size() > MAX_REQUEST_SIZE)
+            {
+                respond(400, "text/plain", "Request is too large\n");
+            }
+            continue;
+        }
+
+        m_request_handled = true;
+
+        auto request_line = std::string_view(m_request_data).substr(0, m_request_data.find("\r\n"));
+        auto method_end = request_line.find(' ');
+        auto target_end = request_line.find(' ', method_end + 1);
+        if (method_end == std::string_view::npos || target_end == std::string_view::npos)
+        {
+            respond(400, "text/plain", "Malformed request\n");
+            continue;
+        }
+
+        auto target = request_line.substr(method_end + 1, target_end - method_end - 1);
+        auto query_start = target.find('?');
+
+        HttpRequest request{
+            .method = std::string(request_line.substr(0, method_end)),
+            .path = std::string(target.substr(0, query_start)),
+            .query = query_start == std::string_view::npos ? "" : std::string(target.substr(query_start + 1))};
+
+        spdlog::debug("HTTP request: {} {}", request.method, request.path);
+        m_server.dispatch(request, shared_from_this());
+    }
+}
+
+void HttpConnection::send_headers(int status, std::string_view content_type, std::optional<size_t> content_length)
+{
+    auto headers = fmt::format("HTTP/1.1 {} {}\r\n"
+                               "Content-Type: {}\r\n"
+                               "Cache-Control: no-cache\r\n"
+                               "Access-Control-Allow-Origin: *\r\n"
+                               "Connection: close\r\n",
+                               status, status_text(status), content_type);
+
+    if (content_length)
+    {
+        headers += fmt::format("Content-Length: {}\r\n", *content_length);
+    }
+
+    headers += "\r\n";
+    m_send_queue.push(headers);
+}
+
+void HttpConnection::flush()
+{
+    if (is_closed())
+    {
+        return;
+    }
+
+    if (!m_send_queue.flush(m_fd))
+    {
+        close();
+        return;
+    }
+
+    if (m_send_queue.empty() && m_close_after_flush)
+    {
+        close();
+        return;
+    }
+
+    // Only wait for writability while there is something left to write
+    bool waiting_writable = !m_send_queue.empty();
+    if (waiting_writable != m_waiting_writable)
+    {
+        m_waiting_writable = waiting_writable;
+        m_server.loop().modify(m_fd, EPOLLIN | EPOLLRDHUP | (waiting_writable ? EPOLLOUT : 0));
+    }
+}
+
+HttpServer::HttpServer(uint16_t port) : m_loop("http")
+{
+    m_listen_fd = create_listen_socket(port);
+
+    m_loop.post([this]()
+                { m_loop.add(m_listen_fd, EPOLLIN, [this](uint32_t)
+                             { on_accept(); }); });
+
+    spdlog::info("HTTP server listening on port {}", port);
+}
+
+HttpServer::~HttpServer()
+{
+    m_loop.stop();
+    m_connections.clear();
+    ::close(m_listen_fd);
+}
+
+HttpServer &HttpServer::instance()
+{
+    static HttpServer server(HTTP_PORT);
+    return server;
+}
+
+void HttpServer::route(const std::string &path, Handler handler)
+{
+    m_loop.post([this, path, handler = std::move(handler)]()
+                { m_routes[path] = handler; });
+}
+
+void HttpServer::unroute(const std::string &path)
+{
+    m_loop.post([this, path]()
+                { m_routes.erase(path); });
+}
+
+void HttpServer::on_accept()
+{
+    int fd;
+    while ((fd = accept_connection(m_listen_fd)) >= 0)
+    {
+        auto connection = std::make_shared<HttpConnection>(*this, fd);
+        m_connections[fd] = connection;
+
+        std::weak_ptr<HttpConnection> weak_connection = connection;
+        m_loop.add(fd, EPOLLIN | EPOLLRDHUP, [weak_connection](uint32_t events)
+                   {
+                       if (auto connection = weak_connection.lock())
+                       {
+                           connection->on_events(events);
+                       } });
+    }
+}
+
+void HttpServer::dispatch(const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection)
+{
+    auto it = m_routes.find(request.path);
+    if (it == m_routes.end())
+    {
+        connection->respond(404, "text/plain", "Not found\n");
+        return;
+    }
+
+    if (request.method != "GET" && request.method != "POST")
+    {
+        connection->respond(405, "text/plain", "Method not allowed\n");
+        return;
+    }
+
+    it->second(request, connection);
+}
+
+void HttpServer::remove_connection(int fd)
+{
+    m_loop.remove(fd);
+    m_connections.erase(fd);
+}
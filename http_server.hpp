@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "event_loop.hpp"
+#include "send_queue.hpp"
+
+class HttpServer;
+
+struct HttpRequest
+{
+    std::string method;
+    std::string path;
+    std::string query;
+
+    // Value of a query string parameter, if present
+    std::optional<std::string> query_param(std::string_view name) const;
+};
+
+// A client connection. Lives on the server loop thread and must only be used from there
+class HttpConnection : public std::enable_shared_from_this<HttpConnection>
+{
+public:
+    HttpConnection(HttpServer &server, int fd);
+    HttpConnection(const HttpConnection &other) = delete;
+    HttpConnection &operator=(const HttpConnection &other) = delete;
+    ~HttpConnection();
+
+    // Sends a complete response and closes the connection once it's written
+    void respond(int status, std::string_view content_type, std::string_view body);
+    void respond(int status, std::string_view content_type, const AVBufferRef *body, const uint8_t *data, size_t size);
+
+    // Sends response headers for a body of content_length bytes. The body is then written with queue()
+    // and flush(), and the connection closes once it's written
+    void start_response(int status, std::string_view content_type, size_t content_length);
+
+    // Sends response headers without a length. The body is then written with queue() and flush()
+    void start_stream(std::string_view content_type);
+    void queue(const AVBufferRef *buffer, const uint8_t *data, size_t size);
+    void queue(std::string_view data);
+    void flush();
+
+    void close();
+
+    bool is_closed() const { return m_fd < 0; }
+    const SendQueue &send_queue() const { return m_send_queue; }
+
+private:
+    friend class HttpServer;
+
+    void on_events(uint32_t events);
+    void on_readable();
+    void send_headers(int status, std::string_view content_type, std::optional<size_t> content_length);
+
+    HttpServer &m_server;
+    int m_fd;
+
+    std::string m_request_data = {};
+    bool m_request_handled = false;
+    bool m_close_after_flush = false;
+    bool m_waiting_writable = false;
+
+    SendQueue m_send_queue = {};
+};
+
+// Minimal HTTP/1.1 server for metrics, images and control endpoints. Listens on all interfaces.
+// Routes match the request path exactly
+class HttpServer
+{
+public:
+    using Handler = std::function<void(const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection)>;
+
+    HttpServer(uint16_t port);
+    HttpServer(const HttpServer &other) = delete;
+    HttpServer &operator=(const HttpServer &other) = delete;
+    ~HttpServer();
+
+    // Process-wide server listening on HTTP_PORT
+    static HttpServer &instance();
+
+    // Safe to call from any thread
+    void route(const std::string &path, Handler handler);
+    void unroute(const std::string &path);
+
+    EventLoop &loop() { return m_loop; }
+
+private:
+    friend class HttpConnection;
+
+    void on_accept();
+    void dispatch(const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection);
+    void remove_connection(int fd);
+
+    int m_listen_fd = -1;
+    std::unordered_map<std::string, Handler> m_routes = {};
+    std::unordered_map<int, std::shared_ptr<HttpConnection>> m_connections = {};
+
+    EventLoop m_loop;
+};
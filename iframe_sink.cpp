@@ -0,0 +1,46 @@
+#include "iframe_sink.hpp"
+
+#include "globals.hpp"
+#include "encoder.hpp"
+#include "decoder.hpp"
+#include "mjpeg_streamer.hpp"
+#include "preview.hpp"
+#include "simulcast.hpp"
+
+std::unique_ptr<IFrameSink> create_frame_sink(const Metadata &metadata, const std::string &stream_path)
+{
+    if (metadata.format != Format::MJPEG)
+    {
+        return create_encoder_sink(metadata, stream_path);
+    }
+
+    std::unique_ptr<IFrameSink> sink;
+    if (OUTPUT_MODE == OutputMode::MjpegPassthrough)
+    {
+        sink = std::make_unique<MjpegStreamer>(metadata, stream_path + MJPEG_STREAM_SUFFIX);
+    }
+    else
+    {
+        sink = std::make_unique<Decoder>(metadata, stream_path);
+    }
+
+    // Previews come from the camera JPEG, which has no privacy masks
+    if (PREVIEW_FPS > 0 && PRIVACY_MASKS.empty())
+    {
+        return std::make_unique<Preview>(metadata, stream_path, std::move(sink));
+    }
+
+    return sink;
+}
+
+std::unique_ptr<IFrameSink> create_encoder_sink(const Metadata &metadata, const std::string &stream_path)
+{
+    // A single full size layer doesn't need a pyramid stage
+    if (SIMULCAST_LAYERS.size() == 1 && SIMULCAST_LAYERS[0].scale_divisor == 1)
+    {
+        auto &layer = SIMULCAST_LAYERS[0];
+        return std::make_unique<Encoder>(metadata, stream_path + layer.path_suffix, layer.bit_rate, layer.record);
+    }
+
+    return std::make_unique<Simulcast>(metadata, stream_path);
+}
@@ -2,6 +2,8 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <memory>
+#include <string>
 
 extern "C"
 {
@@ -9,9 +11,24 @@ extern "C"
 #include <libavutil/frame.h>
 }
 
+#include "metadata.hpp"
+
 class IFrameSink
 {
 public:
+    virtual ~IFrameSink() = default;
+
     virtual void push_frame(const uint8_t *data, size_t size, uint64_t pts_usec) = 0;
     virtual void push_frame(const AVFrame *frame) = 0;
+
+    // Frames queued downstream and not processed yet
+    virtual size_t backlog() const { return 0; }
+    // Whether the sink sheds the frame under output congestion, so producers can skip work on it
+    virtual bool skips_frame(uint64_t pts_usec) const { return false; }
 };
+
+// Sink for frames of the given format according to OUTPUT_MODE, streaming on the given path
+std::unique_ptr<IFrameSink> create_frame_sink(const Metadata &metadata, const std::string &stream_path);
+
+// Sink encoding raw or decoded frames into every SIMULCAST_LAYERS stream
+std::unique_ptr<IFrameSink> create_encoder_sink(const Metadata &metadata, const std::string &stream_path);
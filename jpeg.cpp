@@ -0,0 +1,214 @@
+#include "jpeg.hpp"
+
+#include <cstddef>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <spdlog/spdlog.h>
+
+static const uint8_t MARKER = 0xff;
+static const uint8_t SOI = 0xd8;
+static const uint8_t EOI = 0xd9;
+static const uint8_t SOF0 = 0xc0;
+static const uint8_t SOF15 = 0xcf;
+static const uint8_t DHT = 0xc4;
+static const uint8_t JPG = 0xc8;
+static const uint8_t DAC = 0xcc;
+static const uint8_t SOS = 0xda;
+static const uint8_t RST0 = 0xd0;
+static const uint8_t RST7 = 0xd7;
+static const uint8_t TEM = 0x01;
+
+static uint16_t read_u16(const uint8_t *data)
+{
+    return (data[0] << 8) | data[1];
+}
+
+// Offset of the last 0xff 0xd9 pair starting before the limit, or -1. Compares 16 candidate
+// positions per step, so heavily padded buffers are scanned at memory speed
+static ptrdiff_t find_last_eoi(const uint8_t *data, size_t size)
+{
+    ptrdiff_t n = (ptrdiff_t)size - 2;
+
+#if defined(__SSE2__)
+    auto marker = _mm_set1_epi8((char)MARKER);
+    auto eoi = _mm_set1_epi8((char)EOI);
+
+    // Positions n - 15..n, the second load reaches the byte after n
+    for (; n >= 15; n -= 16)
+    {
+        auto first = _mm_loadu_si128((const __m128i *)(data + n - 15));
+        auto second = _mm_loadu_si128((const __m128i *)(data + n - 14));
+        auto mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, marker), _mm_cmpeq_epi8(second, eoi)));
+
+        if (mask)
+        {
+            return n - 15 + (31 - __builtin_clz(mask));
+        }
+    }
+#elif defined(__ARM_NEON)
+    for (; n >= 15; n -= 16)
+    {
+        auto first = vld1q_u8(data + n - 15);
+        auto second = vld1q_u8(data + n - 14);
+        auto matches = vandq_u8(vceqq_u8(first, vdupq_n_u8(MARKER)), vceqq_u8(second, vdupq_n_u8(EOI)));
+        // Narrows every byte to a nibble of the 64-bit mask
+        auto mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+
+        if (mask)
+        {
+            return n - 15 + (63 - __builtin_clzll(mask)) / 4;
+        }
+    }
+#endif
+
+    for (; n >= 0; n--)
+    {
+        if (data[n] == MARKER && data[n + 1] == EOI)
+        {
+            return n;
+        }
+    }
+
+    return -1;
+}
+
+// FFMPEG decoder finds frame end looking for the next frame start sequence (0xffd8),
+// not current frame end (0xffd9). It obviously expects a bunch of well-formated frames going sequentially
+// as an input. But, we have a buffer, which is padded and may even contain zeroes at the end of the data.
+// This breaks the parser. So, we find frame end ourselves and set parser flag that we send complete frames.
+size_t find_jpeg_end(uint8_t const *data, size_t size)
+{
+    if (size < 4)
+    {
+        return 0;
+    }
+
+    auto eoi = find_last_eoi(data, size);
+    if (eoi < 2)
+    {
+        return 0;
+    }
+
+    spdlog::trace("JPEG frame true size: {}", eoi + 2);
+    return eoi + 2;
+}
+
+bool validate_jpeg_frame(const uint8_t *data, size_t frame_size, size_t width, size_t height)
+{
+    auto header = parse_jpeg_header(data, frame_size);
+    if (!header)
+    {
+        return false;
+    }
+
+    if (header->width != width || header->height != height)
+    {
+        spdlog::debug("JPEG frame size {}x{} doesn't match the stream", header->width, header->height);
+        return false;
+    }
+
+    // Entropy-coded data can't contain an EOI, so one found inside the headers belongs to a stale frame
+    if (header->scan_data > data + frame_size - 2)
+    {
+        spdlog::debug("JPEG frame ends before its scan");
+        return false;
+    }
+
+    return true;
+}
+
+std::optional<JpegHeader> parse_jpeg_header(const uint8_t *data, size_t size)
+{
+    if (size < 4 || data[0] != MARKER || data[1] != SOI)
+    {
+        spdlog::debug("JPEG frame doesn't start with SOI");
+        return std::nullopt;
+    }
+
+    JpegHeader header{};
+    bool has_frame_header = false;
+    size_t offset = 2;
+
+    while (offset + 4 <= size)
+    {
+        if (data[offset] != MARKER)
+        {
+            spdlog::debug("Unexpected JPEG data at offset {}", offset);
+            return std::nullopt;
+        }
+
+        auto marker = data[offset + 1];
+
+        // Fill bytes and standalone markers carry no segment
+        if (marker == MARKER)
+        {
+            offset++;
+            continue;
+        }
+        if (marker == TEM || (marker >= RST0 && marker <= RST7))
+        {
+            offset += 2;
+            continue;
+        }
+        if (marker == EOI)
+        {
+            break;
+        }
+
+        auto length = read_u16(data + offset + 2);
+        auto segment = data + offset + 4;
+        auto segment_size = length - 2;
+
+        if (length < 2 || offset + 2 + length > size)
+        {
+            spdlog::debug("Truncated JPEG segment {:#x}", marker);
+            return std::nullopt;
+        }
+
+        if (marker >= SOF0 && marker <= SOF15 && marker != DHT && marker != JPG && marker != DAC)
+        {
+            if (segment_size < 6)
+            {
+                return std::nullopt;
+            }
+
+            header.height = read_u16(segment + 1);
+            header.width = read_u16(segment + 3);
+            auto num_components = segment[5];
+
+            if (segment_size < 6 + 3 * num_components)
+            {
+                return std::nullopt;
+            }
+
+            has_frame_header = true;
+        }
+        else if (marker == SOS)
+        {
+            if (!has_frame_header)
+            {
+                spdlog::debug("JPEG scan without a frame header");
+                return std::nullopt;
+            }
+
+            auto scan_start = offset + 2 + length;
+            if (scan_start + 2 > size)
+            {
+                return std::nullopt;
+            }
+
+            header.scan_data = data + scan_start;
+            return header;
+        }
+
+        offset += 2 + length;
+    }
+
+    spdlog::debug("JPEG frame has no scan");
+    return std::nullopt;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+// Fields of a JPEG header needed to validate a frame without decoding
+struct JpegHeader
+{
+    uint16_t width;
+    uint16_t height;
+
+    // Entropy-coded data after the scan header, up to EOI
+    const uint8_t *scan_data;
+};
+
+// Size of the JPEG frame including the EOI marker, or 0 if there is none.
+// Camera buffers are padded, so the frame end has to be found explicitly. Pass the bytes used
+// by the frame rather than the buffer size, so the padding doesn't have to be scanned
+size_t find_jpeg_end(const uint8_t *data, size_t size);
+
+// Whether a frame trimmed with find_jpeg_end starts with SOI, has a frame header of the expected
+// dimensions and a scan before EOI. Only the headers are read
+bool validate_jpeg_frame(const uint8_t *data, size_t frame_size, size_t width, size_t height);
+
+// Parses markers up to the start of scan. Expects a frame trimmed with find_jpeg_end
+std::optional<JpegHeader> parse_jpeg_header(const uint8_t *data, size_t size);
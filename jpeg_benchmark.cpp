@@ -0,0 +1,92 @@
+// Measures JPEG frame end scanning on camera-like buffers, where a frame is followed by padding.
+// Compares the vectorized scanner with a byte by byte reference at several padding ratios.
+//
+// Usage: libcam-jpeg-bench [frame size in KiB]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "jpeg.hpp"
+
+static const size_t DEFAULT_FRAME_KIB = 256;
+static const double PADDING_RATIOS[] = {0.0, 0.5, 0.9, 0.99};
+static const auto MIN_DURATION = std::chrono::milliseconds(200);
+
+static size_t reference_find_jpeg_end(const uint8_t *data, size_t size)
+{
+    for (size_t n = size; n >= 4; n--)
+    {
+        if (data[n - 1] == 0xd9 && data[n - 2] == 0xff)
+        {
+            return n;
+        }
+    }
+
+    return 0;
+}
+
+// Frame of random entropy-coded-like data. 0xff is always followed by a stuffed zero,
+// so the only EOI is the last one
+static std::vector<uint8_t> make_buffer(size_t frame_size, double padding_ratio)
+{
+    std::mt19937 random(frame_size);
+    std::vector<uint8_t> buffer(frame_size / (1 - padding_ratio), 0);
+
+    buffer[0] = 0xff;
+    buffer[1] = 0xd8;
+    for (size_t n = 2; n < frame_size - 2; n++)
+    {
+        buffer[n] = buffer[n - 1] == 0xff ? 0 : random();
+    }
+    buffer[frame_size - 2] = 0xff;
+    buffer[frame_size - 1] = 0xd9;
+
+    return buffer;
+}
+
+template <typename F>
+static double measure_usec(const std::vector<uint8_t> &buffer, size_t expected, F &&find_end)
+{
+    size_t iterations = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::steady_clock::duration::zero();
+
+    do
+    {
+        if (find_end(buffer.data(), buffer.size()) != expected)
+        {
+            fmt::print(stderr, "Wrong frame end found\n");
+            exit(1);
+        }
+
+        iterations++;
+        elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed < MIN_DURATION);
+
+    return std::chrono::duration<double, std::micro>(elapsed).count() / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    spdlog::set_level(spdlog::level::warn);
+
+    auto frame_size = (argc > 1 ? strtoull(argv[1], nullptr, 10) : DEFAULT_FRAME_KIB) * 1024;
+
+    fmt::print("{:>10} {:>12} {:>14} {:>14} {:>9}\n", "padding", "buffer KiB", "reference us", "vector us", "speedup");
+
+    for (auto padding_ratio : PADDING_RATIOS)
+    {
+        auto buffer = make_buffer(frame_size, padding_ratio);
+
+        auto reference = measure_usec(buffer, frame_size, reference_find_jpeg_end);
+        auto vector = measure_usec(buffer, frame_size, find_jpeg_end);
+
+        fmt::print("{:>9.0f}% {:>12} {:>14.3f} {:>14.3f} {:>8.1f}x\n", padding_ratio * 100, buffer.size() / 1024,
+                   reference, vector, reference / vector);
+    }
+}
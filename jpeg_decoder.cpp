@@ -0,0 +1,320 @@
+
+#include "jpeg_decoder.hpp"
+
+#include <algorithm>
+#include <iterator>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include "chroma.hpp"
+#include "clock.hpp"
+#include "globals.hpp"
+#include "jpeg.hpp"
+#include "metrics.hpp"
+
+static const size_t CHROMA_ALIGN = 32;
+
+static Histogram s_parse_time("libcam_jpeg_parse_seconds", "Time to parse a JPEG frame");
+static Histogram s_decode_time("libcam_jpeg_decode_seconds", "Time to decode a JPEG frame");
+static Histogram s_scale_time("libcam_scale_seconds", "Time to convert a decoded frame to the encoder format");
+
+JpegDecoder::JpegDecoder(Metadata metadata) : m_metadata(metadata)
+{
+    init();
+}
+
+JpegDecoder::~JpegDecoder()
+{
+    av_parser_close(m_codec_parser);
+    avcodec_free_context(&m_codec_context);
+    sws_freeContext(m_scale_context);
+    av_buffer_pool_uninit(&m_chroma_pool);
+    av_frame_free(&m_jpeg_frame);
+    av_packet_free(&m_packet);
+}
+
+void JpegDecoder::init()
+{
+    m_codec = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
+    if (!m_codec)
+    {
+        spdlog::critical("Decoder '{}' not found", "JPEG");
+        throw;
+    }
+    spdlog::info("Decoder was found succesfully: {}", m_codec->long_name);
+
+    m_codec_parser = av_parser_init(m_codec->id);
+    if (!m_codec_parser)
+    {
+        spdlog::critical("Failed to allocate decode parser");
+        throw;
+    }
+    m_codec_parser->flags |= PARSER_FLAG_COMPLETE_FRAMES;
+    m_codec_context = avcodec_alloc_context3(m_codec);
+    // Frames are decoded in parallel by separate decoders instead
+    m_codec_context->thread_count = 1;
+
+    auto ret = avcodec_open2(m_codec_context, m_codec, nullptr);
+    if (ret < 0)
+    {
+        spdlog::critical("Failed to open decoder: {}", "err2str");
+        throw;
+    }
+
+    spdlog::info("Decoder opened succesfully");
+}
+
+// JPEG decoders output full-range formats. The encoder is set up for full range, so only the
+// layout has to match
+static AVPixelFormat layout_format(AVPixelFormat format)
+{
+    switch (format)
+    {
+    case AV_PIX_FMT_YUVJ420P:
+        return AV_PIX_FMT_YUV420P;
+    case AV_PIX_FMT_YUVJ422P:
+        return AV_PIX_FMT_YUV422P;
+    case AV_PIX_FMT_YUVJ444P:
+        return AV_PIX_FMT_YUV444P;
+    default:
+        return format;
+    }
+}
+
+void JpegDecoder::init_scaler()
+{
+    if (m_codec_context->pix_fmt < 0)
+    {
+        spdlog::critical("JPEG parser didn't return pix format");
+        exit(1);
+    }
+
+    auto format = layout_format(m_codec_context->pix_fmt);
+    spdlog::debug("Decoder pix fmt: {}", av_get_pix_fmt_name(m_codec_context->pix_fmt));
+
+    if (format == ENCODER_SRC_FORMAT)
+    {
+        m_conversion_path = ConversionPath::Passthrough;
+        spdlog::info("Decoded frames are passed to the encoder as is");
+        return;
+    }
+
+    if (format == AV_PIX_FMT_YUV422P && ENCODER_SRC_FORMAT == AV_PIX_FMT_YUV420P)
+    {
+        // Both chroma planes of a frame share one pooled buffer
+        auto chroma_stride = FFALIGN((m_metadata.width + 1) / 2, CHROMA_ALIGN);
+        auto chroma_height = (m_metadata.height + 1) / 2;
+
+        m_chroma_pool = av_buffer_pool_init(2 * chroma_stride * chroma_height, av_buffer_alloc);
+        if (!m_chroma_pool)
+        {
+            spdlog::critical("Failed to allocate chroma pool");
+            throw;
+        }
+
+        m_conversion_path = ConversionPath::ChromaDecimation;
+        spdlog::info("Decoded frames are converted to 4:2:0 by chroma decimation");
+        return;
+    }
+
+    m_scale_context = sws_getContext(m_metadata.width,
+                                     m_metadata.height,
+                                     m_codec_context->pix_fmt,
+                                     m_metadata.width,
+                                     m_metadata.height,
+                                     ENCODER_SRC_FORMAT,
+                                     SWS_BICUBIC,
+                                     nullptr,
+                                     nullptr,
+                                     nullptr);
+
+    if (!m_scale_context)
+    {
+        spdlog::critical("Failed to initialize pix format rescaler");
+        throw;
+    }
+
+    // Keep the full JPEG range, same as frames passed through
+    int *inv_table, *table;
+    int src_range, dst_range, brightness, contrast, saturation;
+    sws_getColorspaceDetails(m_scale_context, &inv_table, &src_range, &table, &dst_range, &brightness, &contrast, &saturation);
+    sws_setColorspaceDetails(m_scale_context, inv_table, 1, table, 1, brightness, contrast, saturation);
+
+    // Converted frames are handed to the encoder thread by reference, so every frame gets its own buffer
+    m_yuv_pool = std::make_unique<FramePool>(ENCODER_SRC_FORMAT, m_metadata.width, m_metadata.height);
+
+    m_conversion_path = ConversionPath::Scale;
+    spdlog::info("Rescaler initialized succesfully");
+}
+
+AVFrame *JpegDecoder::decode(const uint8_t *data, size_t size)
+{
+    if (!fill_frame_from_jpeg(data, size))
+    {
+        spdlog::error("Failed to decode JPEG frame");
+        return nullptr;
+    }
+
+    auto yuv_frame = covert_frame_format();
+    if (!yuv_frame)
+    {
+        spdlog::error("Failed to convert JPEG frame");
+    }
+
+    return yuv_frame;
+}
+
+bool JpegDecoder::fill_frame_from_jpeg(const uint8_t *data, size_t size)
+{
+    auto parse_start_nsec = monotonic_nsec();
+
+    auto ret = av_parser_parse2(m_codec_parser, m_codec_context, &m_packet->data, &m_packet->size,
+                                data, size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+    if (ret < 0)
+    {
+        spdlog::error("Error while parsing JPEG frame");
+        return false;
+    }
+
+    spdlog::trace("Packet size: {}. Source size: {}. Read size: {}", m_packet->size, size, ret);
+
+    auto decode_start_nsec = monotonic_nsec();
+    s_parse_time.record(decode_start_nsec - parse_start_nsec);
+
+    if (m_packet->size)
+    {
+        ret = avcodec_send_packet(m_codec_context, m_packet);
+        if (ret < 0)
+        {
+            spdlog::error("Failed to send packet");
+            return false;
+        }
+
+        if (!m_conversion_path)
+        {
+            init_scaler();
+        }
+
+        ret = avcodec_receive_frame(m_codec_context, m_jpeg_frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+        {
+            return false;
+        }
+        else if (ret < 0)
+        {
+            spdlog::error("Failed to decode packet");
+            return false;
+        }
+
+        s_decode_time.record(monotonic_nsec() - decode_start_nsec);
+    }
+    else
+    {
+        spdlog::error("Empty JPEG packet");
+        return false;
+    }
+
+    return true;
+}
+
+AVFrame *JpegDecoder::covert_frame_format()
+{
+    if (m_conversion_path == ConversionPath::Passthrough)
+    {
+        // The decoder allocates a new buffer for every frame, so it never overwrites frames the encoder holds
+        auto frame = av_frame_clone(m_jpeg_frame);
+        if (frame)
+        {
+            frame->format = ENCODER_SRC_FORMAT;
+            frame->color_range = AVCOL_RANGE_JPEG;
+        }
+
+        return frame;
+    }
+
+    auto start_nsec = monotonic_nsec();
+
+    auto frame = m_conversion_path == ConversionPath::ChromaDecimation ? decimate_chroma() : scale_frame();
+    if (frame)
+    {
+        s_scale_time.record(monotonic_nsec() - start_nsec);
+    }
+
+    return frame;
+}
+
+AVFrame *JpegDecoder::decimate_chroma()
+{
+    auto chroma = av_buffer_pool_get(m_chroma_pool);
+    if (!chroma)
+    {
+        spdlog::error("Failed to allocate chroma planes");
+        return nullptr;
+    }
+
+    // References the decoded luma plane
+    auto frame = av_frame_clone(m_jpeg_frame);
+    if (!frame)
+    {
+        av_buffer_unref(&chroma);
+        return nullptr;
+    }
+
+    auto free_buf = std::find(std::begin(frame->buf), std::end(frame->buf), nullptr);
+    if (free_buf == std::end(frame->buf))
+    {
+        spdlog::error("Decoded frame has no room for chroma planes");
+        av_buffer_unref(&chroma);
+        av_frame_free(&frame);
+        return nullptr;
+    }
+    *free_buf = chroma;
+
+    auto chroma_width = (m_metadata.width + 1) / 2;
+    auto chroma_stride = FFALIGN(chroma_width, CHROMA_ALIGN);
+    auto chroma_height = (m_metadata.height + 1) / 2;
+
+    for (int n = 1; n <= 2; n++)
+    {
+        auto dst = chroma->data + (n - 1) * chroma_stride * chroma_height;
+
+        decimate_chroma_rows(m_jpeg_frame->data[n], m_jpeg_frame->linesize[n], dst, chroma_stride,
+                             chroma_width, m_metadata.height);
+
+        frame->data[n] = dst;
+        frame->linesize[n] = chroma_stride;
+    }
+
+    frame->format = ENCODER_SRC_FORMAT;
+    frame->color_range = AVCOL_RANGE_JPEG;
+
+    return frame;
+}
+
+AVFrame *JpegDecoder::scale_frame()
+{
+    auto frame = m_yuv_pool->get();
+    if (!frame)
+    {
+        spdlog::error("Failed to allocate YUV frame");
+        return nullptr;
+    }
+
+    auto res_lines = sws_scale(m_scale_context,
+                               m_jpeg_frame->data, m_jpeg_frame->linesize,
+                               0, m_metadata.height, frame->data, frame->linesize);
+
+    if (res_lines <= 0)
+    {
+        spdlog::error("Failed to change frame pixel format");
+        av_frame_free(&frame);
+        return nullptr;
+    }
+
+    frame->color_range = AVCOL_RANGE_JPEG;
+    return frame;
+}
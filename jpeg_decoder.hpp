@@ -0,0 +1,67 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+
+extern "C"
+{
+#include <libavutil/pixfmt.h>
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+}
+
+#include "metadata.hpp"
+#include "frame_pool.hpp"
+
+// How decoded JPEG frames are turned into encoder input
+enum class ConversionPath
+{
+    // The decoder already outputs the encoder format. Frames are passed by reference
+    Passthrough,
+    // 4:2:2 to 4:2:0. Luma is passed by reference, chroma is decimated vertically
+    ChromaDecimation,
+    // Anything else goes through swscale
+    Scale,
+};
+
+// A single MJPEG decoding context. Decodes camera JPEG frames into frames of the encoder format.
+// Not thread safe
+class JpegDecoder final
+{
+public:
+    JpegDecoder(Metadata metadata);
+    JpegDecoder(const JpegDecoder &other) = delete;
+    JpegDecoder &operator=(const JpegDecoder &other) = delete;
+    ~JpegDecoder();
+
+    // Decodes a frame trimmed with find_jpeg_end and checked with validate_jpeg_frame.
+    // Returns a new frame the caller owns, or nullptr if the frame can't be decoded
+    AVFrame *decode(const uint8_t *data, size_t frame_size);
+
+private:
+    void init();
+    void init_scaler();
+
+    bool fill_frame_from_jpeg(uint8_t const *data, size_t size);
+    // Returns a new frame the caller owns, or nullptr on failure
+    AVFrame *covert_frame_format();
+    AVFrame *decimate_chroma();
+    AVFrame *scale_frame();
+
+    Metadata m_metadata;
+
+    // Codec
+    const AVCodec *m_codec = nullptr;
+    AVCodecParserContext *m_codec_parser = nullptr;
+    AVCodecContext *m_codec_context = nullptr;
+
+    // Format converter. Set up on the first decoded frame, once the JPEG sampling is known
+    std::optional<ConversionPath> m_conversion_path = std::nullopt;
+    SwsContext *m_scale_context = nullptr;
+    std::unique_ptr<FramePool> m_yuv_pool = nullptr;
+    AVBufferPool *m_chroma_pool = nullptr;
+
+    // Data
+    AVPacket *m_packet = av_packet_alloc();
+    AVFrame *m_jpeg_frame = av_frame_alloc();
+};
\ No newline at end of file
@@ -0,0 +1,52 @@
+#include "latency_probe.hpp"
+
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+
+#include "clock.hpp"
+#include "globals.hpp"
+
+static const uint64_t REPORT_INTERVAL_USEC = 5000000;
+
+LatencyProbe::LatencyProbe(std::string name)
+    : m_name(std::move(name))
+{
+    m_samples.reserve(REPORT_INTERVAL_USEC / 1000000 * FPS * 2);
+}
+
+void LatencyProbe::record(uint64_t capture_time_usec)
+{
+    auto now = monotonic_usec();
+    if (m_next_report_usec == 0)
+    {
+        m_next_report_usec = now + REPORT_INTERVAL_USEC;
+    }
+
+    m_samples.push_back(now > capture_time_usec ? now - capture_time_usec : 0);
+
+    if (now >= m_next_report_usec)
+    {
+        report();
+        m_samples.clear();
+        m_next_report_usec = now + REPORT_INTERVAL_USEC;
+    }
+}
+
+void LatencyProbe::report()
+{
+    if (m_samples.empty())
+    {
+        return;
+    }
+
+    std::sort(m_samples.begin(), m_samples.end());
+
+    auto percentile = [this](size_t percent)
+    {
+        return m_samples[(m_samples.size() - 1) * percent / 100] / 1000.0;
+    };
+
+    spdlog::info("{} capture to wire latency over {} frames: p50 {:.1f} ms, p90 {:.1f} ms, p99 {:.1f} ms, max {:.1f} ms",
+                 m_name, m_samples.size(), percentile(50), percentile(90), percentile(99), m_samples.back() / 1000.0);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Collects capture to wire latencies of a stream and periodically logs their percentiles.
+// Not thread safe, meant to be used from the thread that sends the stream
+class LatencyProbe
+{
+public:
+    LatencyProbe(std::string name);
+
+    // Records a frame leaving the pipeline. The capture time is the sensor timestamp of the frame
+    void record(uint64_t capture_time_usec);
+
+private:
+    void report();
+
+    std::string m_name;
+    std::vector<uint32_t> m_samples = {};
+    uint64_t m_next_report_usec = 0;
+};
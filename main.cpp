@@ -1,10 +1,69 @@
 #include "camera.hpp"
+#include "cpu_affinity.hpp"
+#include "globals.hpp"
+#include "metrics.hpp"
+#include "rtsp_server.hpp"
+#include "virtual_camera.hpp"
+
+#include <algorithm>
 
 #include <spdlog/spdlog.h>
 
+// Runs a capture, decode and encode pipeline per selected camera until the process is interrupted
+static void run_cameras()
+{
+    // libcamera allows a single camera manager per process, so all pipelines share it
+    libcamera::CameraManager manager;
+    manager.start();
+
+    std::vector<std::shared_ptr<libcamera::Camera>> cameras;
+    for (auto &camera : manager.cameras())
+    {
+        if (CAMERA_IDS.empty() || std::ranges::find(CAMERA_IDS, camera->id()) != CAMERA_IDS.end())
+        {
+            cameras.push_back(camera);
+        }
+    }
+
+    if (cameras.empty())
+    {
+        spdlog::critical("Failed to find the camera");
+        throw;
+    }
+
+    // Servers are shared by all pipelines, so they're started before any pinning
+    RtspServer::instance();
+
+    std::vector<std::unique_ptr<Camera>> pipelines;
+    for (size_t n = 0; n < cameras.size(); n++)
+    {
+        auto stream_path = n == 0 ? std::string(STREAM_PATH) : fmt::format("{}{}", STREAM_PATH, n);
+
+        ScopedCpuAffinity affinity(n < PIPELINE_CPU_CORES.size() ? PIPELINE_CPU_CORES[n] : std::vector<int>{});
+        pipelines.push_back(std::make_unique<Camera>(cameras[n], stream_path));
+    }
+
+    // Every camera waits for the interrupt on destruction. Pipelines are gone before the manager
+    pipelines.clear();
+}
+
 int main()
 {
     spdlog::set_level(spdlog::level::debug);
+    MetricsRegistry::instance().serve(METRICS_PATH);
+
+    if (FRAME_SOURCE == FrameSource::Camera)
+    {
+        run_cameras();
+        return 0;
+    }
 
-    Camera{};
-}
\ No newline at end of file
+    std::string format = VIRTUAL_CAMERA_FORMAT;
+    VirtualCamera{{.metadata = {.format = Metadata::formatFromString(format),
+                                .width = VIRTUAL_CAMERA_WIDTH,
+                                .height = VIRTUAL_CAMERA_HEIGHT,
+                                .stride = VIRTUAL_CAMERA_WIDTH},
+                   .replay_path = FRAME_SOURCE == FrameSource::Replay ? REPLAY_PATH : "",
+                   .fps = FPS,
+                   .max_frames = 0}};
+}
@@ -21,6 +21,22 @@ struct Metadata
     Format format;
     size_t width;
     size_t height;
+    // Bytes per line of the luma plane as laid out by the camera
+    size_t stride;
+
+    // Pixel format of raw camera frames. MJPEG frames have to be decoded first
+    AVPixelFormat raw_pixel_format() const
+    {
+        switch (format)
+        {
+        case Format::YUV420:
+            return AV_PIX_FMT_YUV420P;
+        case Format::NV12:
+            return AV_PIX_FMT_NV12;
+        default:
+            return AV_PIX_FMT_NONE;
+        }
+    }
 
     static Format formatFromString(std::string &format)
     {
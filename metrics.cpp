@@ -0,0 +1,255 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <numeric>
+
+#include <spdlog/spdlog.h>
+
+#include "globals.hpp"
+#include "http_server.hpp"
+
+static std::string series(const std::string &name, const std::string &labels, const std::string &extra_label = "")
+{
+    if (labels.empty() && extra_label.empty())
+    {
+        return name;
+    }
+
+    auto separator = labels.empty() || extra_label.empty() ? "" : ",";
+    return fmt::format("{}{{{}{}{}}}", name, labels, separator, extra_label);
+}
+
+Metric::Metric(std::string name, std::string help, std::string labels)
+    : m_name(std::move(name)), m_help(std::move(help)), m_labels(std::move(labels))
+{
+    MetricsRegistry::instance().add(this);
+}
+
+Metric::~Metric()
+{
+    MetricsRegistry::instance().remove(this);
+}
+
+Counter::Counter(std::string name, std::string help, std::string labels)
+    : Metric(std::move(name), std::move(help), std::move(labels))
+{
+}
+
+uint64_t Counter::value() const
+{
+    uint64_t result = 0;
+    for (auto &slot : m_slots)
+    {
+        result += slot.value.load(std::memory_order_relaxed);
+    }
+
+    return result;
+}
+
+void Counter::render(std::string &output) const
+{
+    output += fmt::format("{} {}\n", series(m_name, m_labels), value());
+}
+
+Gauge::Gauge(std::string name, std::string help, std::string labels)
+    : Metric(std::move(name), std::move(help), std::move(labels))
+{
+}
+
+void Gauge::render(std::string &output) const
+{
+    output += fmt::format("{} {}\n", series(m_name, m_labels), value());
+}
+
+Histogram::Histogram(std::string name, std::string help, std::string labels)
+    : Metric(std::move(name), std::move(help), std::move(labels))
+{
+}
+
+Histogram::~Histogram()
+{
+    for (auto &shard : m_shards)
+    {
+        delete shard.load();
+    }
+}
+
+uint64_t Histogram::bucket_upper_bound(size_t index)
+{
+    if (index < SUB_BUCKETS)
+    {
+        return index + 1;
+    }
+
+    auto exponent = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    auto sub_bucket = index % SUB_BUCKETS;
+    return (SUB_BUCKETS + sub_bucket + 1) << (exponent - SUB_BUCKET_BITS);
+}
+
+Histogram::Shard *Histogram::allocate_shard()
+{
+    auto &slot = m_shards[metrics_thread_slot()];
+    auto shard = new Shard();
+
+    // Threads beyond METRICS_MAX_THREADS share slots and may race for the allocation
+    Shard *expected = nullptr;
+    if (!slot.compare_exchange_strong(expected, shard, std::memory_order_acq_rel))
+    {
+        delete shard;
+        return expected;
+    }
+
+    return shard;
+}
+
+std::array<uint64_t, Histogram::BUCKETS> Histogram::merge_buckets(uint64_t *sum_nsec) const
+{
+    std::array<uint64_t, BUCKETS> buckets = {};
+
+    for (auto &slot : m_shards)
+    {
+        auto shard = slot.load(std::memory_order_acquire);
+        if (!shard)
+        {
+            continue;
+        }
+
+        for (size_t n = 0; n < BUCKETS; n++)
+        {
+            buckets[n] += shard->buckets[n].load(std::memory_order_relaxed);
+        }
+        if (sum_nsec)
+        {
+            *sum_nsec += shard->sum_nsec.load(std::memory_order_relaxed);
+        }
+    }
+
+    return buckets;
+}
+
+uint64_t Histogram::count() const
+{
+    auto buckets = merge_buckets();
+    return std::accumulate(buckets.begin(), buckets.end(), uint64_t(0));
+}
+
+uint64_t Histogram::percentile_usec(double percentile) const
+{
+    auto buckets = merge_buckets();
+    auto count = std::accumulate(buckets.begin(), buckets.end(), uint64_t(0));
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    auto rank = std::max<uint64_t>(1, count * percentile / 100);
+    uint64_t seen = 0;
+
+    for (size_t n = 0; n < BUCKETS; n++)
+    {
+        seen += buckets[n];
+        if (seen >= rank)
+        {
+            return bucket_upper_bound(n);
+        }
+    }
+
+    return bucket_upper_bound(BUCKETS - 1);
+}
+
+void Histogram::render(std::string &output) const
+{
+    uint64_t sum_nsec = 0;
+    auto buckets = merge_buckets(&sum_nsec);
+
+    // Only power of two bounds are exported. The last bucket also holds values out of range,
+    // so it's reported as +Inf only
+    uint64_t count = 0;
+    for (size_t n = 0; n < BUCKETS; n++)
+    {
+        count += buckets[n];
+
+        if (n % SUB_BUCKETS == SUB_BUCKETS - 1 && n != BUCKETS - 1)
+        {
+            auto le = fmt::format("le=\"{}\"", bucket_upper_bound(n) / 1e6);
+            output += fmt::format("{} {}\n", series(m_name + "_bucket", m_labels, le), count);
+        }
+    }
+
+    output += fmt::format("{} {}\n", series(m_name + "_bucket", m_labels, "le=\"+Inf\""), count);
+    output += fmt::format("{} {}\n", series(m_name + "_sum", m_labels), sum_nsec / 1e9);
+    output += fmt::format("{} {}\n", series(m_name + "_count", m_labels), count);
+}
+
+MetricsRegistry &MetricsRegistry::instance()
+{
+    static MetricsRegistry registry;
+    return registry;
+}
+
+void MetricsRegistry::add(Metric *metric)
+{
+    std::lock_guard lock(m_lock);
+    m_metrics.push_back(metric);
+}
+
+void MetricsRegistry::remove(Metric *metric)
+{
+    std::lock_guard lock(m_lock);
+    std::erase(m_metrics, metric);
+}
+
+Metric *MetricsRegistry::find(const std::string &name, const std::string &labels) const
+{
+    std::lock_guard lock(m_lock);
+
+    auto it = std::find_if(m_metrics.begin(), m_metrics.end(), [&](auto metric)
+                           { return metric->name() == name && metric->labels() == labels; });
+    return it != m_metrics.end() ? *it : nullptr;
+}
+
+std::vector<Metric *> MetricsRegistry::find_all(const std::string &name) const
+{
+    std::lock_guard lock(m_lock);
+
+    std::vector<Metric *> metrics;
+    std::copy_if(m_metrics.begin(), m_metrics.end(), std::back_inserter(metrics), [&](auto metric)
+                 { return metric->name() == name; });
+    return metrics;
+}
+
+void MetricsRegistry::serve(const std::string &path)
+{
+    HttpServer::instance().route(path, [](const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection)
+                                 { connection->respond(200, "text/plain; version=0.0.4", MetricsRegistry::instance().render()); });
+
+    spdlog::info("Metrics are served on http://0.0.0.0:{}{}", HTTP_PORT, path);
+}
+
+std::string MetricsRegistry::render() const
+{
+    std::lock_guard lock(m_lock);
+
+    // Series of one metric family have to be grouped under a single header
+    auto metrics = m_metrics;
+    std::stable_sort(metrics.begin(), metrics.end(), [](auto lhs, auto rhs)
+                     { return lhs->name() < rhs->name(); });
+
+    std::string output;
+    const std::string *family = nullptr;
+
+    for (auto metric : metrics)
+    {
+        if (!family || *family != metric->name())
+        {
+            family = &metric->name();
+            output += fmt::format("# HELP {} {}\n# TYPE {} {}\n", metric->name(), metric->help(),
+                                  metric->name(), metric->type());
+        }
+
+        metric->render(output);
+    }
+
+    return output;
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Threads that record metrics get their own slot. Beyond that, threads share slots, which is still
+// correct, only slower
+static const size_t METRICS_MAX_THREADS = 32;
+
+// Slot of the calling thread in per-thread metric storage
+inline size_t metrics_thread_slot()
+{
+    static std::atomic<size_t> s_next_slot = 0;
+    thread_local const size_t slot = s_next_slot.fetch_add(1, std::memory_order_relaxed) % METRICS_MAX_THREADS;
+
+    return slot;
+}
+
+class Metric
+{
+public:
+    // Labels are in Prometheus syntax without braces, e.g. stage="encode"
+    Metric(std::string name, std::string help, std::string labels);
+    Metric(const Metric &other) = delete;
+    Metric &operator=(const Metric &other) = delete;
+    virtual ~Metric();
+
+    const std::string &name() const { return m_name; }
+    const std::string &help() const { return m_help; }
+    const std::string &labels() const { return m_labels; }
+
+    virtual const char *type() const = 0;
+    // Appends sample lines in Prometheus text format
+    virtual void render(std::string &output) const = 0;
+
+protected:
+    std::string m_name;
+    std::string m_help;
+    std::string m_labels;
+};
+
+// Monotonic counter. Every thread increments its own cache line, so recording never contends
+class Counter final : public Metric
+{
+public:
+    Counter(std::string name, std::string help, std::string labels = "");
+
+    void add(uint64_t value = 1)
+    {
+        m_slots[metrics_thread_slot()].value.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const;
+
+    const char *type() const override { return "counter"; }
+    void render(std::string &output) const override;
+
+private:
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> value = 0;
+    };
+
+    std::array<Slot, METRICS_MAX_THREADS> m_slots = {};
+};
+
+// Current value of a level, e.g. bytes held in a buffer. Set by one owner at a time
+class Gauge final : public Metric
+{
+public:
+    Gauge(std::string name, std::string help, std::string labels = "");
+
+    void set(int64_t value) { m_value.store(value, std::memory_order_relaxed); }
+    int64_t value() const { return m_value.load(std::memory_order_relaxed); }
+
+    const char *type() const override { return "gauge"; }
+    void render(std::string &output) const override;
+
+private:
+    std::atomic<int64_t> m_value = 0;
+};
+
+// Log-linear latency histogram with microsecond resolution. Every power of two is split into
+// 8 sub-buckets, so values are kept with 12.5% precision from 1 us up to half a minute.
+// Buckets are per thread and allocated on the first sample of a thread
+class Histogram final : public Metric
+{
+public:
+    Histogram(std::string name, std::string help, std::string labels = "");
+    ~Histogram();
+
+    void record(uint64_t duration_nsec)
+    {
+        auto shard = m_shards[metrics_thread_slot()].load(std::memory_order_acquire);
+        if (!shard)
+        {
+            shard = allocate_shard();
+        }
+
+        shard->buckets[bucket_index(duration_nsec / 1000)].fetch_add(1, std::memory_order_relaxed);
+        shard->sum_nsec.fetch_add(duration_nsec, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const;
+    // Upper bound of the bucket holding the percentile, in microseconds. 0 if there are no samples
+    uint64_t percentile_usec(double percentile) const;
+
+    const char *type() const override { return "histogram"; }
+    void render(std::string &output) const override;
+
+private:
+    static const int SUB_BUCKET_BITS = 3;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int MAX_EXPONENT = 24;
+    static const size_t BUCKETS = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+
+    struct Shard
+    {
+        std::array<std::atomic<uint64_t>, BUCKETS> buckets = {};
+        std::atomic<uint64_t> sum_nsec = 0;
+    };
+
+    static size_t bucket_index(uint64_t value_usec)
+    {
+        if (value_usec < SUB_BUCKETS)
+        {
+            return value_usec;
+        }
+
+        int exponent = 63 - __builtin_clzll(value_usec);
+        if (exponent > MAX_EXPONENT)
+        {
+            return BUCKETS - 1;
+        }
+
+        auto sub_bucket = (value_usec >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+        return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub_bucket;
+    }
+
+    // Exclusive upper bound of the bucket in microseconds
+    static uint64_t bucket_upper_bound(size_t index);
+
+    std::array<uint64_t, BUCKETS> merge_buckets(uint64_t *sum_nsec = nullptr) const;
+
+    Shard *allocate_shard();
+
+    std::array<std::atomic<Shard *>, METRICS_MAX_THREADS> m_shards = {};
+};
+
+// Process-wide set of metrics. Metrics register themselves on construction and are usually
+// static objects of the module that records them
+class MetricsRegistry
+{
+public:
+    static MetricsRegistry &instance();
+
+    void add(Metric *metric);
+    void remove(Metric *metric);
+    Metric *find(const std::string &name, const std::string &labels = "") const;
+    // Every series of the metric, whatever its labels
+    std::vector<Metric *> find_all(const std::string &name) const;
+
+    // Serves all metrics in Prometheus text format on the local HTTP server
+    void serve(const std::string &path);
+    std::string render() const;
+
+private:
+    MetricsRegistry() = default;
+
+    mutable std::mutex m_lock = {};
+    std::vector<Metric *> m_metrics = {};
+};
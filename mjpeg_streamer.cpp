@@ -0,0 +1,92 @@
+#include "mjpeg_streamer.hpp"
+
+#include <cstring>
+
+#include <spdlog/spdlog.h>
+
+#include "globals.hpp"
+#include "jpeg.hpp"
+#include "metrics.hpp"
+
+static const char *BOUNDARY = "frame";
+
+static Counter s_frames_rejected("libcam_jpeg_rejected_total", "Truncated or corrupt JPEG frames", "stage=\"passthrough\"");
+
+MjpegStreamer::MjpegStreamer(Metadata metadata, std::string path)
+    : m_metadata(metadata), m_path(std::move(path))
+{
+    HttpServer::instance().route(m_path, [viewers = m_viewers](const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection)
+                                 {
+                                     spdlog::info("New MJPEG viewer");
+                                     connection->start_stream(fmt::format("multipart/x-mixed-replace; boundary={}", BOUNDARY));
+                                     viewers->connections.push_back(connection); });
+
+    spdlog::info("MJPEG passthrough is served on http://0.0.0.0:{}{}", HTTP_PORT, m_path);
+}
+
+MjpegStreamer::~MjpegStreamer()
+{
+    HttpServer::instance().unroute(m_path);
+}
+
+void MjpegStreamer::push_frame(const uint8_t *data, size_t size, uint64_t pts_usec)
+{
+    if (data == nullptr)
+    {
+        spdlog::info("Stream EOF");
+        return;
+    }
+
+    auto jpeg_frame_size = find_jpeg_end(data, size);
+    if (jpeg_frame_size == 0 || !validate_jpeg_frame(data, jpeg_frame_size, m_metadata.width, m_metadata.height))
+    {
+        spdlog::warn("Rejected invalid JPEG frame");
+        s_frames_rejected.add();
+        return;
+    }
+
+    // The camera buffer goes back to the pool right after this call, so the frame is copied once
+    auto frame = av_buffer_alloc(jpeg_frame_size);
+    if (!frame)
+    {
+        spdlog::error("Failed to allocate JPEG frame");
+        return;
+    }
+    memcpy(frame->data, data, jpeg_frame_size);
+
+    HttpServer::instance().loop().post([viewers = m_viewers, frame, pts_usec]() mutable
+                                       {
+                                           publish(*viewers, frame, pts_usec);
+                                           av_buffer_unref(&frame); });
+}
+
+void MjpegStreamer::push_frame(const AVFrame *frame)
+{
+    spdlog::critical("Received full-featured frame into MJPEG streamer. This should never happen");
+    exit(1);
+}
+
+void MjpegStreamer::publish(Viewers &viewers, AVBufferRef *frame, uint64_t pts_usec)
+{
+    auto part_header = fmt::format("\r\n--{}\r\nContent-Type: image/jpeg\r\nContent-Length: {}\r\nX-Timestamp: {}\r\n\r\n",
+                                   BOUNDARY, frame->size, pts_usec);
+
+    std::erase_if(viewers.connections, [](auto &connection)
+                  { return connection.expired() || connection.lock()->is_closed(); });
+
+    for (auto &weak_connection : viewers.connections)
+    {
+        auto connection = weak_connection.lock();
+
+        // Frames are independent, so a slow viewer simply skips frames until it catches up
+        if (connection->send_queue().bytes() >= MJPEG_MAX_QUEUED_FRAMES * frame->size)
+        {
+            spdlog::trace("MJPEG viewer is behind. Skipping frame {}", pts_usec);
+            continue;
+        }
+
+        connection->queue(part_header);
+        connection->queue(frame, frame->data, frame->size);
+        connection->flush();
+    }
+}
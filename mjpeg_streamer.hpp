@@ -0,0 +1,34 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "metadata.hpp"
+#include "iframe_sink.hpp"
+#include "http_server.hpp"
+
+// Serves camera JPEG frames unchanged as an HTTP multipart stream. Every frame is copied once
+// into a refcounted buffer shared by all viewers
+class MjpegStreamer final : public IFrameSink
+{
+public:
+    MjpegStreamer(Metadata metadata, std::string path);
+    ~MjpegStreamer();
+
+    void push_frame(const uint8_t *data, size_t size, uint64_t pts_usec) override;
+    void push_frame(const AVFrame *frame) override;
+
+private:
+    // Owned by the HTTP loop thread
+    struct Viewers
+    {
+        std::vector<std::weak_ptr<HttpConnection>> connections;
+    };
+
+    static void publish(Viewers &viewers, AVBufferRef *frame, uint64_t pts_usec);
+
+    Metadata m_metadata;
+    std::string m_path;
+    std::shared_ptr<Viewers> m_viewers = std::make_shared<Viewers>();
+};
@@ -1,43 +1,157 @@
 #include "mmaped_dmabuf.hpp"
 
+#include <algorithm>
+
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
 
 #include "spdlog/spdlog.h"
 
 MmapedDmaBuf::~MmapedDmaBuf()
 {
-    for (auto &[key, value] : m_mappings)
-    {
-        munmap(value.data.data, value.dmabufLength);
-    }
+    clear();
 }
 
-const PlaneData &MmapedDmaBuf::readBuffer(const libcamera::FrameBuffer &buffer)
+void MmapedDmaBuf::map(const libcamera::FrameBuffer &buffer)
 {
-    auto planes = buffer.planes();
+    auto &planes = buffer.planes();
 
-    if (planes.size() > 1)
+    if (planes.size() > MAX_PLANES)
     {
-        spdlog::critical("Encountered multiplane buffer. Num planes: {}", planes.size());
+        spdlog::critical("Encountered buffer with too many planes. Num planes: {}", planes.size());
         throw;
     }
 
-    auto &plane = *planes.begin();
-    auto dmabufLength = plane.offset + plane.length;
+    if (auto it = m_mappings.find(&buffer); it != m_mappings.end())
+    {
+        // The FrameBuffer address may be reused for a buffer backed by other dmabufs
+        if (is_same_layout(it->second, buffer))
+        {
+            return;
+        }
+
+        spdlog::info("Buffer layout changed. Remapping");
+        unmap(it->second);
+        m_mappings.erase(it);
+    }
+
+    MappedFrameBuffer mapped{
+        .buffer = {.planes = {}, .num_planes = planes.size(), .dmabuf_fds = {}, .num_dmabufs = 0},
+        .mappings = {},
+        .planes = planes};
 
-    if (!m_mappings.contains(plane.fd.get()) || m_mappings[plane.fd.get()].dmabufLength != dmabufLength)
+    for (size_t n = 0; n < planes.size(); n++)
     {
-        spdlog::info("New DMA mapping for {} fd", plane.fd.get());
-        auto addr = mmap(nullptr, dmabufLength, PROT_READ, MAP_SHARED, plane.fd.get(), 0);
+        auto &plane = planes[n];
+        auto fd = plane.fd.get();
+
+        // Planes usually share one dmabuf at different offsets. Map it once, large enough for all of them
+        auto dmabuf = std::find(mapped.buffer.dmabuf_fds.begin(),
+                                mapped.buffer.dmabuf_fds.begin() + mapped.buffer.num_dmabufs, fd) -
+                      mapped.buffer.dmabuf_fds.begin();
+
+        if ((size_t)dmabuf == mapped.buffer.num_dmabufs)
+        {
+            size_t dmabufLength = 0;
+            for (auto &other : planes)
+            {
+                if (other.fd.get() == fd)
+                {
+                    dmabufLength = std::max<size_t>(dmabufLength, other.offset + other.length);
+                }
+            }
+
+            spdlog::info("New DMA mapping for {} fd", fd);
+            auto addr = mmap(nullptr, dmabufLength, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+            if (addr == MAP_FAILED)
+            {
+                spdlog::critical("Failed to map DMA buffer {}", fd);
+                unmap(mapped);
+                throw;
+            }
+
+            mapped.buffer.dmabuf_fds[dmabuf] = fd;
+            mapped.mappings[dmabuf] = MappedBufferInfo{
+                .data = (uint8_t *)addr,
+                .dmabufLength = dmabufLength};
+            mapped.buffer.num_dmabufs++;
+        }
 
-        PlaneData plane_data{
-            .data = (uint8_t *)addr + plane.offset,
+        mapped.buffer.planes[n] = PlaneData{
+            .data = mapped.mappings[dmabuf].data + plane.offset,
             .size = plane.length};
+    }
+
+    m_mappings.emplace(&buffer, std::move(mapped));
+}
+
+void MmapedDmaBuf::clear()
+{
+    for (auto &[key, value] : m_mappings)
+    {
+        unmap(value);
+    }
+
+    m_mappings.clear();
+}
+
+BufferData MmapedDmaBuf::readBuffer(const libcamera::FrameBuffer &buffer)
+{
+    if (auto it = m_mappings.find(&buffer); it != m_mappings.end() && is_same_layout(it->second, buffer))
+    {
+        m_hits.fetch_add(1, std::memory_order_relaxed);
+        return it->second.buffer;
+    }
+
+    spdlog::warn("Buffer wasn't mapped upfront");
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+
+    map(buffer);
+    return m_mappings[&buffer].buffer;
+}
+
+void MmapedDmaBuf::begin_cpu_access(const BufferData &buffer)
+{
+    sync(buffer, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+}
+
+void MmapedDmaBuf::end_cpu_access(const BufferData &buffer)
+{
+    sync(buffer, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+}
+
+bool MmapedDmaBuf::is_same_layout(const MappedFrameBuffer &mapped, const libcamera::FrameBuffer &buffer)
+{
+    auto &planes = buffer.planes();
+
+    return std::equal(planes.begin(), planes.end(), mapped.planes.begin(), mapped.planes.end(),
+                      [](auto &lhs, auto &rhs)
+                      {
+                          return lhs.fd.get() == rhs.fd.get() && lhs.offset == rhs.offset &&
+                                 lhs.length == rhs.length;
+                      });
+}
+
+void MmapedDmaBuf::sync(const BufferData &buffer, uint64_t flags)
+{
+    for (size_t n = 0; n < buffer.num_dmabufs; n++)
+    {
+        dma_buf_sync sync{.flags = flags};
 
-        m_mappings.emplace(plane.fd.get(), MappedBufferInfo{
-                                               .data = std::move(plane_data),
-                                               .dmabufLength = dmabufLength});
+        if (ioctl(buffer.dmabuf_fds[n], DMA_BUF_IOCTL_SYNC, &sync) != 0)
+        {
+            spdlog::trace("Failed to sync DMA buffer {}", buffer.dmabuf_fds[n]);
+        }
+    }
+}
+
+void MmapedDmaBuf::unmap(MappedFrameBuffer &mapped)
+{
+    for (size_t n = 0; n < mapped.buffer.num_dmabufs; n++)
+    {
+        munmap(mapped.mappings[n].data, mapped.mappings[n].dmabufLength);
     }
 
-    return m_mappings[plane.fd.get()].data;
-}
\ No newline at end of file
+    mapped.buffer.num_dmabufs = 0;
+}
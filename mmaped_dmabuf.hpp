@@ -3,21 +3,43 @@
 #include <unordered_map>
 #include <cstdio>
 #include <span>
+#include <array>
+#include <atomic>
 
 #include <libcamera/framebuffer.h>
 
+static const size_t MAX_PLANES = 3;
+
 struct PlaneData
 {
     uint8_t *data;
     size_t size;
 };
 
+struct BufferData
+{
+    std::array<PlaneData, MAX_PLANES> planes;
+    size_t num_planes;
+
+    // Distinct dmabufs backing the planes. Used for CPU access synchronization
+    std::array<int, MAX_PLANES> dmabuf_fds;
+    size_t num_dmabufs;
+};
+
 struct MappedBufferInfo
 {
-    PlaneData data;
+    uint8_t *data;
     size_t dmabufLength;
 };
 
+// Mappings of a single FrameBuffer, along with the plane layout it was mapped for
+struct MappedFrameBuffer
+{
+    BufferData buffer;
+    std::array<MappedBufferInfo, MAX_PLANES> mappings;
+    std::vector<libcamera::FrameBuffer::Plane> planes;
+};
+
 class MmapedDmaBuf
 {
 public:
@@ -26,8 +48,27 @@ public:
     MmapedDmaBuf &operator==(const MmapedDmaBuf &other) = delete;
     ~MmapedDmaBuf();
 
-    const PlaneData &readBuffer(const libcamera::FrameBuffer &buffer);
+    // Maps all planes of the buffer upfront, so the first frames don't stall on page faults
+    void map(const libcamera::FrameBuffer &buffer);
+    // Drops all mappings. Must be called before buffers are freed
+    void clear();
+
+    BufferData readBuffer(const libcamera::FrameBuffer &buffer);
+
+    // Brackets CPU reads of a mapped buffer to keep cached mappings coherent with the device
+    static void begin_cpu_access(const BufferData &buffer);
+    static void end_cpu_access(const BufferData &buffer);
+
+    uint64_t hits() const { return m_hits; }
+    uint64_t misses() const { return m_misses; }
 
 private:
-    std::unordered_map<int, MappedBufferInfo> m_mappings = {};
-};
\ No newline at end of file
+    static bool is_same_layout(const MappedFrameBuffer &mapped, const libcamera::FrameBuffer &buffer);
+    static void sync(const BufferData &buffer, uint64_t flags);
+    void unmap(MappedFrameBuffer &mapped);
+
+    std::unordered_map<const libcamera::FrameBuffer *, MappedFrameBuffer> m_mappings = {};
+
+    std::atomic<uint64_t> m_hits = 0;
+    std::atomic<uint64_t> m_misses = 0;
+};
@@ -0,0 +1,172 @@
+#include "motion_detector.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include <spdlog/spdlog.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "clock.hpp"
+#include "globals.hpp"
+#include "http_server.hpp"
+
+static const size_t BLOCK_SIZE = 16;
+// Every fourth row is compared, which is enough to see anything larger than a few pixels move
+static const size_t ROW_STEP = 4;
+static const size_t ROWS_PER_BLOCK = BLOCK_SIZE / ROW_STEP;
+
+static Histogram s_analysis_time("libcam_motion_seconds", "Time to compare a frame with the motion background");
+
+static std::string stream_label(const std::string &stream_path)
+{
+    return fmt::format("stream=\"{}\"", stream_path.substr(stream_path.find_first_not_of('/')));
+}
+
+// Adds the sum of absolute differences of every 16 pixel block of a row to sums, then moves the
+// background a quarter of the way to the row. Rounds like pavgb and vrhadd
+static void compare_row(const uint8_t *row, uint8_t *background, size_t blocks, uint32_t *sums)
+{
+    size_t block = 0;
+
+#if defined(__SSE2__)
+    for (; block < blocks; block++)
+    {
+        auto current = _mm_loadu_si128((const __m128i *)(row + block * BLOCK_SIZE));
+        auto previous = _mm_loadu_si128((const __m128i *)(background + block * BLOCK_SIZE));
+
+        // Two partial sums, in the low words of each half
+        auto sad = _mm_sad_epu8(current, previous);
+        sums[block] += _mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4);
+
+        _mm_storeu_si128((__m128i *)(background + block * BLOCK_SIZE),
+                         _mm_avg_epu8(previous, _mm_avg_epu8(previous, current)));
+    }
+#elif defined(__ARM_NEON)
+    for (; block < blocks; block++)
+    {
+        auto current = vld1q_u8(row + block * BLOCK_SIZE);
+        auto previous = vld1q_u8(background + block * BLOCK_SIZE);
+
+        auto sad = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vabdq_u8(current, previous))));
+        sums[block] += vgetq_lane_u64(sad, 0) + vgetq_lane_u64(sad, 1);
+
+        vst1q_u8(background + block * BLOCK_SIZE, vrhaddq_u8(previous, vrhaddq_u8(previous, current)));
+    }
+#endif
+
+    for (auto x = block * BLOCK_SIZE; x < blocks * BLOCK_SIZE; x++)
+    {
+        sums[x / BLOCK_SIZE] += abs(row[x] - background[x]);
+        background[x] = (background[x] + ((background[x] + row[x] + 1) >> 1) + 1) >> 1;
+    }
+}
+
+MotionDetector::MotionDetector(const std::string &stream_path)
+    : m_path(MOTION_PATH + stream_path),
+      m_events("libcam_motion_events_total", "Periods of motion detected", stream_label(stream_path)),
+      m_active("libcam_motion_active", "Whether the scene is in motion", stream_label(stream_path))
+{
+    HttpServer::instance().route(m_path, [state = m_state](const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection)
+                                 {
+                                     auto last_motion_usec = state->last_motion_usec.load(std::memory_order_relaxed);
+                                     auto body = fmt::format("{{\"active\":{},\"events\":{},\"changed_ratio\":{:.4f},\"idle_ms\":{}}}\n",
+                                                             state->active.load(std::memory_order_relaxed),
+                                                             state->events.load(std::memory_order_relaxed),
+                                                             state->changed_ratio.load(std::memory_order_relaxed),
+                                                             last_motion_usec ? (monotonic_usec() - last_motion_usec) / 1000 : 0);
+                                     connection->respond(200, "application/json", body); });
+
+    spdlog::info("Detecting motion on {}. State is served on {}", stream_path, m_path);
+}
+
+MotionDetector::~MotionDetector()
+{
+    HttpServer::instance().unroute(m_path);
+}
+
+bool MotionDetector::analyze(const uint8_t *luma, size_t stride, size_t width, size_t height)
+{
+    auto start_nsec = monotonic_nsec();
+
+    auto blocks_x = width / BLOCK_SIZE;
+    auto blocks_y = height / BLOCK_SIZE;
+    if (blocks_x == 0 || blocks_y == 0)
+    {
+        return false;
+    }
+
+    // The first frame is the background
+    if (blocks_x != m_blocks_x || blocks_y != m_blocks_y)
+    {
+        reset(luma, stride, blocks_x, blocks_y);
+        return m_state->active.load(std::memory_order_relaxed);
+    }
+
+    std::fill(m_block_sad.begin(), m_block_sad.end(), 0);
+
+    auto background_stride = blocks_x * BLOCK_SIZE;
+    for (size_t block_y = 0; block_y < blocks_y; block_y++)
+    {
+        for (size_t n = 0; n < ROWS_PER_BLOCK; n++)
+        {
+            auto row = luma + (block_y * BLOCK_SIZE + n * ROW_STEP) * stride;
+            auto background = m_background.data() + (block_y * ROWS_PER_BLOCK + n) * background_stride;
+            compare_row(row, background, blocks_x, m_block_sad.data() + block_y * blocks_x);
+        }
+    }
+
+    auto threshold = MOTION_PIXEL_THRESHOLD * BLOCK_SIZE * ROWS_PER_BLOCK;
+    auto changed = std::count_if(m_block_sad.begin(), m_block_sad.end(), [threshold](uint32_t sad)
+                                 { return sad > threshold; });
+    auto changed_ratio = (double)changed / m_block_sad.size();
+    bool motion = changed > 0 && changed_ratio >= MOTION_AREA_RATIO;
+
+    auto now = monotonic_usec();
+    auto &state = *m_state;
+    bool active = state.active.load(std::memory_order_relaxed);
+
+    if (motion)
+    {
+        state.last_motion_usec.store(now, std::memory_order_relaxed);
+        if (!active)
+        {
+            spdlog::info("Motion on {}: {:.1f}% of the frame changed", m_path, changed_ratio * 100);
+            state.events.fetch_add(1, std::memory_order_relaxed);
+            m_events.add();
+            active = true;
+        }
+    }
+    else if (active && now - state.last_motion_usec.load(std::memory_order_relaxed) >= MOTION_IDLE_USEC)
+    {
+        spdlog::info("No motion on {} for {} ms", m_path, MOTION_IDLE_USEC / 1000);
+        active = false;
+    }
+
+    state.active.store(active, std::memory_order_relaxed);
+    state.changed_ratio.store(changed_ratio, std::memory_order_relaxed);
+    m_active.set(active);
+
+    s_analysis_time.record(monotonic_nsec() - start_nsec);
+    return active;
+}
+
+void MotionDetector::reset(const uint8_t *luma, size_t stride, size_t blocks_x, size_t blocks_y)
+{
+    m_blocks_x = blocks_x;
+    m_blocks_y = blocks_y;
+
+    auto background_stride = blocks_x * BLOCK_SIZE;
+    m_background.resize(blocks_y * ROWS_PER_BLOCK * background_stride);
+    m_block_sad.resize(blocks_x * blocks_y);
+
+    for (size_t row = 0; row < blocks_y * ROWS_PER_BLOCK; row++)
+    {
+        memcpy(m_background.data() + row * background_stride, luma + row * ROW_STEP * stride, background_stride);
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "metrics.hpp"
+
+// Compares sampled rows of the luma plane with a running background in 16x16 blocks. A frame
+// has motion if enough blocks changed. The scene stays in motion until MOTION_IDLE_USEC pass without
+// a frame that has motion. Not thread safe, called from the encode thread
+class MotionDetector
+{
+public:
+    // The motion state is served on MOTION_PATH followed by the stream path
+    MotionDetector(const std::string &stream_path);
+    MotionDetector(const MotionDetector &other) = delete;
+    MotionDetector &operator=(const MotionDetector &other) = delete;
+    ~MotionDetector();
+
+    // Updates the background with the frame. Returns whether the scene is in motion.
+    // Called from a single thread
+    bool analyze(const uint8_t *luma, size_t stride, size_t width, size_t height);
+
+private:
+    // Shared with the HTTP route, which may outlive the detector for a moment
+    struct State
+    {
+        std::atomic_bool active = false;
+        std::atomic<uint64_t> events = 0;
+        std::atomic<uint64_t> last_motion_usec = 0;
+        std::atomic<double> changed_ratio = 0;
+    };
+
+    void reset(const uint8_t *luma, size_t stride, size_t blocks_x, size_t blocks_y);
+
+    std::string m_path;
+    std::shared_ptr<State> m_state = std::make_shared<State>();
+
+    size_t m_blocks_x = 0;
+    size_t m_blocks_y = 0;
+    // Sampled rows of the background, blocks_x * 16 bytes wide
+    std::vector<uint8_t> m_background = {};
+    std::vector<uint32_t> m_block_sad = {};
+
+    Counter m_events;
+    Gauge m_active;
+};
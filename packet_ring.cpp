@@ -0,0 +1,139 @@
+#include "packet_ring.hpp"
+
+#include <cstring>
+
+#include <spdlog/spdlog.h>
+
+PacketRing::PacketRing(size_t capacity_bytes, size_t max_packets, int64_t window)
+    : m_data(capacity_bytes), m_entries(max_packets), m_window(window)
+{
+    if (!m_packet || max_packets == 0)
+    {
+        spdlog::critical("Failed to allocate packet ring");
+        throw;
+    }
+}
+
+PacketRing::~PacketRing()
+{
+    av_packet_free(&m_packet);
+}
+
+void PacketRing::push(const AVPacket *packet)
+{
+    bool keyframe = packet->flags & AV_PKT_FLAG_KEY;
+    if (m_count == 0 && !keyframe)
+    {
+        return;
+    }
+
+    size_t size = packet->size;
+    if (size > m_data.size())
+    {
+        spdlog::warn("Packet of {} bytes doesn't fit in the pre-event buffer", size);
+        clear();
+        return;
+    }
+
+    // A new GOP makes the oldest one redundant once the next one alone covers the window
+    while (keyframe && m_count > 0)
+    {
+        size_t next_gop = 1;
+        while (next_gop < m_count && !(entry(next_gop).flags & AV_PKT_FLAG_KEY))
+        {
+            next_gop++;
+        }
+
+        if (next_gop == m_count || packet->pts - entry(next_gop).pts < m_window)
+        {
+            break;
+        }
+
+        drop_oldest_gop();
+    }
+
+    size_t offset;
+    while ((offset = find_space(size)) == SIZE_MAX || m_count == m_entries.size())
+    {
+        drop_oldest_gop();
+
+        // The GOP this packet belongs to is gone
+        if (m_count == 0 && !keyframe)
+        {
+            return;
+        }
+    }
+
+    memcpy(m_data.data() + offset, packet->data, size);
+    entry(m_count++) = Entry{.offset = offset,
+                             .size = size,
+                             .pts = packet->pts,
+                             .dts = packet->dts,
+                             .duration = packet->duration,
+                             .flags = packet->flags};
+    m_used_bytes += size;
+    m_write_offset = offset + size;
+}
+
+void PacketRing::drain(const std::function<void(AVPacket *packet)> &callback)
+{
+    for (size_t n = 0; n < m_count; n++)
+    {
+        auto &packet_entry = entry(n);
+
+        m_packet->data = m_data.data() + packet_entry.offset;
+        m_packet->size = packet_entry.size;
+        m_packet->pts = packet_entry.pts;
+        m_packet->dts = packet_entry.dts;
+        m_packet->duration = packet_entry.duration;
+        m_packet->flags = packet_entry.flags;
+        m_packet->stream_index = 0;
+
+        callback(m_packet);
+    }
+
+    m_packet->data = nullptr;
+    m_packet->size = 0;
+    clear();
+}
+
+size_t PacketRing::find_space(size_t size)
+{
+    if (m_count == 0)
+    {
+        return 0;
+    }
+
+    // Packets are contiguous. Unless the newest packet has wrapped, the free space is split
+    // between the end of the buffer and the start
+    auto oldest_offset = entry(0).offset;
+    if (m_write_offset > oldest_offset)
+    {
+        if (m_data.size() - m_write_offset >= size)
+        {
+            return m_write_offset;
+        }
+
+        return size <= oldest_offset ? 0 : SIZE_MAX;
+    }
+
+    return oldest_offset - m_write_offset >= size ? m_write_offset : SIZE_MAX;
+}
+
+void PacketRing::drop_oldest_gop()
+{
+    do
+    {
+        m_used_bytes -= entry(0).size;
+        m_first = (m_first + 1) % m_entries.size();
+        m_count--;
+    } while (m_count > 0 && !(entry(0).flags & AV_PKT_FLAG_KEY));
+}
+
+void PacketRing::clear()
+{
+    m_first = 0;
+    m_count = 0;
+    m_used_bytes = 0;
+    m_write_offset = 0;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+// Copies of the most recent encoded packets, kept in whole GOPs so the oldest one is always a
+// keyframe. Packet data and bookkeeping are allocated once, so pushing never allocates.
+// Not thread safe
+class PacketRing
+{
+public:
+    // Keeps at least window of packets, in packet time base units, as far as capacity_bytes and
+    // max_packets allow
+    PacketRing(size_t capacity_bytes, size_t max_packets, int64_t window);
+    PacketRing(const PacketRing &other) = delete;
+    PacketRing &operator=(const PacketRing &other) = delete;
+    ~PacketRing();
+
+    // Drops the oldest GOPs to make room. Packets before the first keyframe are ignored
+    void push(const AVPacket *packet);
+
+    // Hands every packet over, oldest first, and empties the ring. Packets point into the ring
+    // and are only valid during the callback
+    void drain(const std::function<void(AVPacket *packet)> &callback);
+
+    size_t bytes() const { return m_used_bytes; }
+    size_t capacity() const { return m_data.size(); }
+
+private:
+    struct Entry
+    {
+        size_t offset;
+        size_t size;
+        int64_t pts;
+        int64_t dts;
+        int64_t duration;
+        int flags;
+    };
+
+    Entry &entry(size_t index) { return m_entries[(m_first + index) % m_entries.size()]; }
+    // Offset where size bytes fit after the newest packet, or SIZE_MAX
+    size_t find_space(size_t size);
+    void drop_oldest_gop();
+    void clear();
+
+    std::vector<uint8_t> m_data;
+    std::vector<Entry> m_entries;
+    int64_t m_window;
+
+    size_t m_first = 0;
+    size_t m_count = 0;
+    size_t m_used_bytes = 0;
+    // Where the next packet goes, unless it has to wrap to the start
+    size_t m_write_offset = 0;
+
+    AVPacket *m_packet = av_packet_alloc();
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include <pthread.h>
+
+#include <spdlog/spdlog.h>
+
+#include "spsc_queue.hpp"
+
+// A worker thread fed through a bounded SPSC queue. Exactly one thread may push into a stage.
+// The handler runs on the stage thread for every item in FIFO order.
+template <typename T>
+class PipelineStage
+{
+public:
+    using Handler = std::function<void(T &)>;
+
+    PipelineStage(std::string name, size_t capacity, Handler handler)
+        : m_name(std::move(name)), m_queue(capacity), m_handler(std::move(handler))
+    {
+        m_thread = std::thread(&PipelineStage::run, this);
+        pthread_setname_np(m_thread.native_handle(), m_name.substr(0, 15).c_str());
+    }
+    PipelineStage(const PipelineStage &other) = delete;
+    PipelineStage &operator=(const PipelineStage &other) = delete;
+
+    ~PipelineStage()
+    {
+        stop();
+    }
+
+    // Non-blocking. Returns false if the stage is saturated and the item was not queued
+    bool push(const T &item)
+    {
+        if (!m_queue.push(item))
+        {
+            return false;
+        }
+
+        m_pushed.fetch_add(1, std::memory_order_release);
+        m_pushed.notify_one();
+        return true;
+    }
+
+    // Blocks the producer until the stage has room for the item
+    void push_wait(const T &item)
+    {
+        while (true)
+        {
+            auto popped = m_popped.load(std::memory_order_acquire);
+            if (push(item))
+            {
+                return;
+            }
+
+            m_popped.wait(popped, std::memory_order_acquire);
+        }
+    }
+
+    // Processes everything already queued and joins the stage thread
+    void stop()
+    {
+        if (!m_thread.joinable())
+        {
+            return;
+        }
+
+        m_stop = true;
+        m_pushed.fetch_add(1, std::memory_order_release);
+        m_pushed.notify_one();
+
+        m_thread.join();
+        spdlog::debug("Pipeline stage '{}' stopped", m_name);
+    }
+
+    size_t size() const
+    {
+        return m_queue.size();
+    }
+
+private:
+    void run()
+    {
+        T item;
+
+        while (true)
+        {
+            auto pushed = m_pushed.load(std::memory_order_acquire);
+
+            if (m_queue.pop(item))
+            {
+                m_popped.fetch_add(1, std::memory_order_release);
+                m_popped.notify_one();
+
+                m_handler(item);
+                continue;
+            }
+
+            if (m_stop)
+            {
+                return;
+            }
+
+            m_pushed.wait(pushed, std::memory_order_acquire);
+        }
+    }
+
+    std::string m_name;
+    SpscQueue<T> m_queue;
+    Handler m_handler;
+
+    std::atomic_bool m_stop = false;
+    std::atomic<uint32_t> m_pushed = 0;
+    std::atomic<uint32_t> m_popped = 0;
+    std::thread m_thread = {};
+};
@@ -0,0 +1,227 @@
+#include "preview.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <spdlog/spdlog.h>
+
+#include "clock.hpp"
+#include "globals.hpp"
+#include "http_server.hpp"
+#include "jpeg.hpp"
+#include "metrics.hpp"
+
+// The stage holds the frame being decoded and the next one. Frames beyond that are stale anyway
+static const size_t PREVIEW_QUEUE_DEPTH = 1;
+
+static Histogram s_preview_time("libcam_preview_seconds", "Time to decode and encode a preview image");
+static Counter s_frames_skipped("libcam_preview_skipped_total", "Preview frames skipped while the previous one was decoded");
+
+Preview::Images::~Images()
+{
+    av_buffer_unref(&snapshot.buffer);
+    av_buffer_unref(&preview.buffer);
+}
+
+void Preview::Images::set(Image &image, AVBufferRef *buffer, const uint8_t *data, size_t size)
+{
+    std::lock_guard guard(lock);
+
+    av_buffer_unref(&image.buffer);
+    image = Image{.buffer = buffer, .data = data, .size = size};
+}
+
+Preview::Preview(Metadata metadata, const std::string &stream_path, std::unique_ptr<IFrameSink> sink)
+    : m_sink(std::move(sink)),
+      m_metadata(metadata),
+      m_snapshot_path(stream_path + SNAPSHOT_SUFFIX),
+      m_preview_path(stream_path + PREVIEW_SUFFIX),
+      m_preview_stage("preview", PREVIEW_QUEUE_DEPTH, [this](Image &frame)
+                      { update(frame); av_buffer_unref(&frame.buffer); })
+{
+    auto codec = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
+    m_decoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+    if (!m_decoder || !m_packet || !m_frame)
+    {
+        spdlog::critical("Failed to allocate preview decoder");
+        throw;
+    }
+
+    // Skips the finer DCT coefficients, so a 1/8 size image is decoded from DC values only
+    m_decoder->lowres = std::clamp<int>(PREVIEW_LOWRES, 0, codec->max_lowres);
+    m_decoder->thread_count = 1;
+
+    if (avcodec_open2(m_decoder, codec, nullptr) < 0)
+    {
+        spdlog::critical("Failed to open preview decoder");
+        throw;
+    }
+
+    HttpServer::instance().route(m_snapshot_path, [images = m_images](const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection)
+                                 { serve(images, &Images::snapshot, connection); });
+    HttpServer::instance().route(m_preview_path, [images = m_images](const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection)
+                                 { serve(images, &Images::preview, connection); });
+
+    spdlog::info("Snapshots are served on http://0.0.0.0:{}{} and 1/{} size previews on {}", HTTP_PORT,
+                 m_snapshot_path, 1 << m_decoder->lowres, m_preview_path);
+}
+
+Preview::~Preview()
+{
+    HttpServer::instance().unroute(m_snapshot_path);
+    HttpServer::instance().unroute(m_preview_path);
+
+    m_preview_stage.stop();
+    avcodec_free_context(&m_decoder);
+    avcodec_free_context(&m_encoder);
+    av_frame_free(&m_frame);
+    av_packet_free(&m_packet);
+}
+
+void Preview::push_frame(const uint8_t *data, size_t size, uint64_t pts_usec)
+{
+    m_sink->push_frame(data, size, pts_usec);
+
+    if (data == nullptr || pts_usec < m_next_frame_usec)
+    {
+        return;
+    }
+    m_next_frame_usec = pts_usec + 1000000 / PREVIEW_FPS;
+
+    auto jpeg_frame_size = find_jpeg_end(data, size);
+    if (jpeg_frame_size == 0 || !validate_jpeg_frame(data, jpeg_frame_size, m_metadata.width, m_metadata.height))
+    {
+        return;
+    }
+
+    // Decoders read past the end of the data, which has to be zeroed
+    auto buffer = av_buffer_alloc(jpeg_frame_size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!buffer)
+    {
+        spdlog::error("Failed to allocate preview frame");
+        return;
+    }
+    memcpy(buffer->data, data, jpeg_frame_size);
+    memset(buffer->data + jpeg_frame_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    if (!m_preview_stage.push(Image{.buffer = buffer, .data = buffer->data, .size = jpeg_frame_size}))
+    {
+        s_frames_skipped.add();
+        av_buffer_unref(&buffer);
+    }
+}
+
+void Preview::serve(const std::shared_ptr<Images> &images, Image Images::*image,
+                    const std::shared_ptr<HttpConnection> &connection)
+{
+    Image cached;
+    {
+        std::lock_guard guard(images->lock);
+        cached = (*images).*image;
+        cached.buffer = av_buffer_ref(cached.buffer);
+    }
+
+    if (!cached.buffer)
+    {
+        connection->respond(503, "text/plain", "No image yet\n");
+        return;
+    }
+
+    connection->respond(200, "image/jpeg", cached.buffer, cached.data, cached.size);
+    av_buffer_unref(&cached.buffer);
+}
+
+void Preview::update(Image &frame)
+{
+    auto snapshot = av_buffer_ref(frame.buffer);
+    if (snapshot)
+    {
+        m_images->set(m_images->snapshot, snapshot, frame.data, frame.size);
+    }
+
+    auto start_nsec = monotonic_nsec();
+    if (decode_preview(frame))
+    {
+        s_preview_time.record(monotonic_nsec() - start_nsec);
+    }
+}
+
+bool Preview::decode_preview(const Image &frame)
+{
+    m_packet->data = const_cast<uint8_t *>(frame.data);
+    m_packet->size = frame.size;
+
+    auto ret = avcodec_send_packet(m_decoder, m_packet);
+    m_packet->data = nullptr;
+    m_packet->size = 0;
+
+    if (ret < 0 || avcodec_receive_frame(m_decoder, m_frame) < 0)
+    {
+        spdlog::warn("Failed to decode preview frame");
+        return false;
+    }
+
+    if (!m_encoder && !open_encoder())
+    {
+        av_frame_unref(m_frame);
+        return false;
+    }
+
+    m_frame->pts = m_encoded_frames++;
+    m_frame->pict_type = AV_PICTURE_TYPE_NONE;
+    // Fixed quantizer encoders take it from the frame
+    m_frame->quality = m_encoder->global_quality;
+
+    ret = avcodec_send_frame(m_encoder, m_frame);
+    av_frame_unref(m_frame);
+
+    if (ret < 0 || avcodec_receive_packet(m_encoder, m_packet) < 0)
+    {
+        spdlog::warn("Failed to encode preview image");
+        return false;
+    }
+
+    // The image keeps the packet buffer
+    auto buffer = av_buffer_ref(m_packet->buf);
+    if (buffer)
+    {
+        m_images->set(m_images->preview, buffer, m_packet->data, m_packet->size);
+    }
+    av_packet_unref(m_packet);
+
+    return buffer != nullptr;
+}
+
+bool Preview::open_encoder()
+{
+    if (m_encoder_failed)
+    {
+        return false;
+    }
+
+    // Set up on the first frame, once the decoded size and sampling are known
+    auto codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    m_encoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+    if (m_encoder)
+    {
+        m_encoder->width = m_frame->width;
+        m_encoder->height = m_frame->height;
+        m_encoder->pix_fmt = (AVPixelFormat)m_frame->format;
+        m_encoder->color_range = AVCOL_RANGE_JPEG;
+        m_encoder->time_base = AVRational{1, PREVIEW_FPS};
+        m_encoder->flags |= AV_CODEC_FLAG_QSCALE;
+        m_encoder->global_quality = FF_QP2LAMBDA * PREVIEW_QUALITY;
+        m_encoder->thread_count = 1;
+    }
+
+    if (!m_encoder || avcodec_open2(m_encoder, codec, nullptr) < 0)
+    {
+        spdlog::error("Failed to open preview encoder. Only snapshots are served");
+        avcodec_free_context(&m_encoder);
+        m_encoder_failed = true;
+        return false;
+    }
+
+    spdlog::info("Preview images are {}x{}", m_encoder->width, m_encoder->height);
+    return true;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+}
+
+#include "iframe_sink.hpp"
+#include "metadata.hpp"
+#include "pipeline_stage.hpp"
+
+class HttpConnection;
+
+// Passes camera JPEG frames on to another sink and keeps PREVIEW_FPS of them as a snapshot and a
+// reduced size preview. The preview is decoded in the DCT domain at a fraction of the size, so it
+// costs a fraction of a full decode. Both are served from cache, so polls never reach the pipeline
+class Preview final : public IFrameSink
+{
+public:
+    Preview(Metadata metadata, const std::string &stream_path, std::unique_ptr<IFrameSink> sink);
+    ~Preview();
+
+    void push_frame(const uint8_t *data, size_t size, uint64_t pts_usec) override;
+    void push_frame(const AVFrame *frame) override { m_sink->push_frame(frame); }
+    size_t backlog() const override { return m_sink->backlog(); }
+    bool skips_frame(uint64_t pts_usec) const override { return m_sink->skips_frame(pts_usec); }
+
+private:
+    // A JPEG image in a refcounted buffer
+    struct Image
+    {
+        AVBufferRef *buffer = nullptr;
+        const uint8_t *data = nullptr;
+        size_t size = 0;
+    };
+
+    // Shared with the HTTP routes, which may outlive the preview for a moment
+    struct Images
+    {
+        ~Images();
+
+        void set(Image &image, AVBufferRef *buffer, const uint8_t *data, size_t size);
+
+        std::mutex lock = {};
+        Image snapshot = {};
+        Image preview = {};
+    };
+
+    static void serve(const std::shared_ptr<Images> &images, Image Images::*image,
+                      const std::shared_ptr<HttpConnection> &connection);
+
+    void update(Image &frame);
+    bool decode_preview(const Image &frame);
+    bool open_encoder();
+
+    std::unique_ptr<IFrameSink> m_sink;
+    Metadata m_metadata;
+    std::string m_snapshot_path;
+    std::string m_preview_path;
+    std::shared_ptr<Images> m_images = std::make_shared<Images>();
+
+    // Producer side
+    uint64_t m_next_frame_usec = 0;
+
+    // Owned by the preview stage
+    AVCodecContext *m_decoder = nullptr;
+    AVCodecContext *m_encoder = nullptr;
+    bool m_encoder_failed = false;
+    int64_t m_encoded_frames = 0;
+    AVPacket *m_packet = av_packet_alloc();
+    AVFrame *m_frame = av_frame_alloc();
+
+    PipelineStage<Image> m_preview_stage;
+};
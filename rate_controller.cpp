@@ -0,0 +1,97 @@
+#include "rate_controller.hpp"
+
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+
+#include "clock.hpp"
+#include "globals.hpp"
+
+// Time for a bit rate change to show up on the wire before the next one
+static const uint64_t ADJUSTMENT_INTERVAL_USEC = 500000;
+static const double DECREASE_FACTOR = 0.75;
+static const double INCREASE_STEP = 0.05;
+
+RateController::RateController(int64_t target_bit_rate)
+    : m_target_bit_rate(target_bit_rate),
+      m_min_bit_rate(target_bit_rate * MIN_BIT_RATE_RATIO),
+      m_idle_bit_rate(target_bit_rate * MOTION_IDLE_BIT_RATE_RATIO),
+      m_bit_rate(target_bit_rate)
+{
+}
+
+void RateController::report(size_t queued_bytes, uint64_t blocked_usec)
+{
+    if (!ADAPTIVE_BIT_RATE)
+    {
+        return;
+    }
+
+    auto now = monotonic_usec();
+    bool congested = queued_bytes > CONGESTION_QUEUED_BYTES || blocked_usec > CONGESTION_BLOCKED_USEC;
+
+    if (!congested)
+    {
+        if (m_congested_since_usec)
+        {
+            spdlog::info("Output congestion cleared");
+            m_congested_since_usec = 0;
+            m_shedding = false;
+        }
+    }
+    else if (!m_congested_since_usec)
+    {
+        spdlog::info("Output is congested: {} bytes queued, blocked for {} ms", queued_bytes, blocked_usec / 1000);
+        m_congested_since_usec = now;
+    }
+    else if (!m_shedding && now - m_congested_since_usec > CONGESTION_SUSTAINED_USEC)
+    {
+        spdlog::warn("Output is congested for {} ms. Halving the frame rate", (now - m_congested_since_usec) / 1000);
+        m_shedding = true;
+    }
+
+    if (now < m_next_adjustment_usec)
+    {
+        return;
+    }
+
+    auto bit_rate = m_bit_rate.load(std::memory_order_relaxed);
+    auto new_bit_rate = congested ? std::max<int64_t>(m_min_bit_rate, bit_rate * DECREASE_FACTOR)
+                                  : std::min<int64_t>(m_target_bit_rate, bit_rate + m_target_bit_rate * INCREASE_STEP);
+
+    if (new_bit_rate != bit_rate)
+    {
+        spdlog::debug("Adjusting bit rate to {} kbit/s", new_bit_rate / 1000);
+        m_bit_rate.store(new_bit_rate, std::memory_order_relaxed);
+    }
+
+    m_next_adjustment_usec = now + ADJUSTMENT_INTERVAL_USEC;
+}
+
+void RateController::set_idle(bool idle)
+{
+    if (m_idle.exchange(idle, std::memory_order_relaxed) != idle)
+    {
+        spdlog::debug("{} to {} fps", idle ? "Scene is idle. Dropping" : "Scene is in motion. Restoring",
+                      idle ? MOTION_IDLE_FPS : FPS);
+    }
+}
+
+int64_t RateController::bit_rate() const
+{
+    auto bit_rate = m_bit_rate.load(std::memory_order_relaxed);
+    return m_idle.load(std::memory_order_relaxed) ? std::min(bit_rate, m_idle_bit_rate) : bit_rate;
+}
+
+bool RateController::skips_frame(uint64_t pts_usec) const
+{
+    // Sensor timestamps jitter, so frames are numbered by the nearest frame interval
+    auto index = (pts_usec * FPS + 500000) / 1000000;
+
+    if (m_idle.load(std::memory_order_relaxed) && index % std::max(1, FPS / MOTION_IDLE_FPS))
+    {
+        return true;
+    }
+
+    return m_shedding.load(std::memory_order_relaxed) && index % 2;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Adapts an encoder to the congestion of its output. The bit rate backs off multiplicatively while
+// any viewer is congested and recovers additively once all are clear. Congestion that outlasts
+// the back-off also halves the frame rate, so latency stays bounded at any link speed.
+// Idle scenes are capped to MOTION_IDLE_FPS and MOTION_IDLE_BIT_RATE_RATIO on top of that
+class RateController
+{
+public:
+    RateController(int64_t target_bit_rate);
+
+    // Worst congestion among the viewers of the stream. Called from a single thread
+    void report(size_t queued_bytes, uint64_t blocked_usec);
+
+    // Whether the scene lacks motion. Safe to call from any thread
+    void set_idle(bool idle);
+
+    // Safe to call from any thread
+    int64_t bit_rate() const;
+    // Whether the frame is shed. Frames are picked by timestamp, so every stage agrees on them
+    bool skips_frame(uint64_t pts_usec) const;
+
+private:
+    int64_t m_target_bit_rate;
+    int64_t m_min_bit_rate;
+    int64_t m_idle_bit_rate;
+
+    uint64_t m_congested_since_usec = 0;
+    uint64_t m_next_adjustment_usec = 0;
+
+    std::atomic<int64_t> m_bit_rate;
+    std::atomic_bool m_shedding = false;
+    std::atomic_bool m_idle = false;
+};
@@ -0,0 +1,304 @@
+#include "recorder.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+
+extern "C"
+{
+#include <libavutil/mem.h>
+}
+
+#include <spdlog/spdlog.h>
+
+#include "globals.hpp"
+#include "http_server.hpp"
+
+// Muxer output is copied into disk writer chunks, so its own buffer can be small
+static const int IO_BUFFER_SIZE = 64 * 1024;
+
+static Counter s_packets_dropped("libcam_record_dropped_packets_total", "Encoded packets the recorder couldn't keep up with");
+static Counter s_segments("libcam_record_segments_total", "Recording segments started");
+static Counter s_events("libcam_record_events_total", "Event recordings started");
+
+static const AVRational USEC_TIME_BASE = {1, 1000000};
+
+Recorder::Recorder(std::string name, const AVCodecParameters *codec_params, AVRational time_base)
+    : m_name(std::move(name)),
+      m_time_base(time_base),
+      m_pre_event_bytes("libcam_record_pre_event_bytes", "Packet bytes held for event recordings",
+                        fmt::format("stream=\"{}\"", m_name)),
+      m_pre_event_capacity("libcam_record_pre_event_capacity_bytes", "Memory reserved for event recordings",
+                           fmt::format("stream=\"{}\"", m_name)),
+      m_writer("record-disk"),
+      m_record_stage("record", PACKET_QUEUE_DEPTH, [this](AVPacket *&packet)
+                     { record_packet(packet); av_packet_free(&packet); })
+{
+    if (!m_codec_params || avcodec_parameters_copy(m_codec_params, codec_params) < 0)
+    {
+        spdlog::critical("Failed to copy recording codec parameters");
+        throw;
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(RECORD_DIRECTORY, error);
+    if (error)
+    {
+        spdlog::critical("Failed to create recording directory {}: {}", RECORD_DIRECTORY, error.message());
+        throw;
+    }
+
+    if (RECORD_MODE != RecordMode::OnEvent)
+    {
+        return;
+    }
+
+    // Room for the window plus the GOP that started before it, with slack for uneven frame timing
+    auto max_packets = 2 * (RECORD_PRE_EVENT_USEC * FPS / 1000000 + GOP_SIZE);
+    m_pre_event = std::make_unique<PacketRing>(RECORD_PRE_EVENT_BYTES, max_packets,
+                                               av_rescale_q(RECORD_PRE_EVENT_USEC, USEC_TIME_BASE, m_time_base));
+    m_pre_event_capacity.set(m_pre_event->capacity());
+
+    m_trigger_path = fmt::format("{}/{}", RECORD_TRIGGER_PATH, m_name);
+    HttpServer::instance().route(m_trigger_path, [triggered = m_triggered](const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection)
+                                 {
+                                     // Prefetchers and crawlers follow GET links, so only POST starts a recording
+                                     if (request.method != "POST")
+                                     {
+                                         connection->respond(405, "text/plain", "Use POST to trigger a recording\n");
+                                         return;
+                                     }
+
+                                     triggered->store(true, std::memory_order_relaxed);
+                                     connection->respond(202, "text/plain", "Recording\n"); });
+
+    spdlog::info("Recording {} on events from {} with {} KiB of pre-event buffer", m_name, m_trigger_path,
+                 RECORD_PRE_EVENT_BYTES / 1024);
+}
+
+Recorder::~Recorder()
+{
+    if (!m_trigger_path.empty())
+    {
+        HttpServer::instance().unroute(m_trigger_path);
+    }
+
+    m_record_stage.stop();
+    close_segment();
+    avcodec_parameters_free(&m_codec_params);
+}
+
+void Recorder::push_packet(const AVPacket *packet)
+{
+    bool keyframe = packet->flags & AV_PKT_FLAG_KEY;
+    if (m_waiting_keyframe && !keyframe)
+    {
+        return;
+    }
+    m_waiting_keyframe = false;
+
+    auto packet_ref = av_packet_clone(packet);
+    if (!packet_ref || !m_record_stage.push(packet_ref))
+    {
+        spdlog::warn("Recorder is saturated. Dropping packets until the next keyframe");
+        s_packets_dropped.add();
+        av_packet_free(&packet_ref);
+        m_waiting_keyframe = true;
+    }
+}
+
+void Recorder::record_packet(AVPacket *packet)
+{
+    if (!m_pre_event || in_event(packet))
+    {
+        write_packet(packet);
+        return;
+    }
+
+    m_pre_event->push(packet);
+    m_pre_event_bytes.set(m_pre_event->bytes());
+}
+
+bool Recorder::in_event(const AVPacket *packet)
+{
+    if (m_triggered->exchange(false, std::memory_order_relaxed))
+    {
+        bool started = m_event_end_pts == AV_NOPTS_VALUE;
+        m_event_end_pts = packet->pts + av_rescale_q(RECORD_POST_EVENT_USEC, USEC_TIME_BASE, m_time_base);
+
+        if (started)
+        {
+            spdlog::info("Recording event on {}", m_name);
+            s_events.add();
+
+            // The event gets its own segment, starting with the oldest buffered keyframe
+            m_segment_start_pts = AV_NOPTS_VALUE;
+            m_pre_event->drain([this](AVPacket *buffered)
+                               { write_packet(buffered); });
+            m_pre_event_bytes.set(0);
+        }
+    }
+
+    if (m_event_end_pts == AV_NOPTS_VALUE)
+    {
+        return false;
+    }
+
+    if (packet->pts >= m_event_end_pts)
+    {
+        spdlog::info("Event recording on {} finished", m_name);
+        close_segment();
+        m_event_end_pts = AV_NOPTS_VALUE;
+        return false;
+    }
+
+    return true;
+}
+
+void Recorder::write_packet(AVPacket *packet)
+{
+    bool keyframe = packet->flags & AV_PKT_FLAG_KEY;
+
+    if (keyframe && (m_segment_start_pts == AV_NOPTS_VALUE ||
+                     av_rescale_q(packet->pts - m_segment_start_pts, m_time_base, USEC_TIME_BASE) >= (int64_t)RECORD_SEGMENT_USEC))
+    {
+        close_segment();
+        if (!open_segment(packet->pts))
+        {
+            return;
+        }
+    }
+
+    if (!m_format_context)
+    {
+        return;
+    }
+
+    // Every segment starts at zero
+    auto stream = m_format_context->streams[0];
+    packet->pts -= m_segment_start_pts;
+    packet->dts -= m_segment_start_pts;
+    av_packet_rescale_ts(packet, m_time_base, stream->time_base);
+    packet->stream_index = 0;
+
+    if (av_write_frame(m_format_context, packet) < 0)
+    {
+        spdlog::warn("Error muxing recorded packet");
+        s_packets_dropped.add();
+    }
+}
+
+bool Recorder::open_segment(int64_t start_pts)
+{
+    // Milliseconds keep an event that starts right after the previous one from reusing its name
+    timespec now = {};
+    clock_gettime(CLOCK_REALTIME, &now);
+    tm local_time = {};
+    localtime_r(&now.tv_sec, &local_time);
+
+    char timestamp[32];
+    strftime(timestamp, sizeof(timestamp), "%Y%m%d-%H%M%S", &local_time);
+    auto path = fmt::format("{}/{}-{}-{:03}.mp4", RECORD_DIRECTORY, m_name, timestamp, now.tv_nsec / 1000000);
+
+    avformat_alloc_output_context2(&m_format_context, nullptr, "mp4", path.c_str());
+    if (!m_format_context)
+    {
+        spdlog::error("Failed to create recording muxer");
+        return false;
+    }
+
+    auto stream = avformat_new_stream(m_format_context, nullptr);
+    auto io_buffer = static_cast<uint8_t *>(av_malloc(IO_BUFFER_SIZE));
+    if (!stream || !io_buffer || avcodec_parameters_copy(stream->codecpar, m_codec_params) < 0)
+    {
+        spdlog::error("Failed to set up recording stream");
+        av_free(io_buffer);
+        avformat_free_context(m_format_context);
+        m_format_context = nullptr;
+        return false;
+    }
+    stream->time_base = m_time_base;
+
+    // Output goes to the disk writer instead of a file the muxer could seek in
+    m_format_context->pb = avio_alloc_context(io_buffer, IO_BUFFER_SIZE, 1, this, nullptr, &Recorder::write_output, nullptr);
+    m_format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    m_writer.open(path);
+
+    // Fragments are self-contained, so a segment cut short by a crash still plays. The moov waits
+    // for the first keyframe, which carries the parameter sets
+    AVDictionary *options = nullptr;
+    av_dict_set(&options, "movflags", "empty_moov+delay_moov+default_base_moof+frag_keyframe", 0);
+    av_dict_set_int(&options, "frag_duration", RECORD_FRAGMENT_USEC, 0);
+
+    auto ret = avformat_write_header(m_format_context, &options);
+    av_dict_free(&options);
+
+    if (ret < 0)
+    {
+        spdlog::error("Failed to start recording segment");
+        close_segment();
+        return false;
+    }
+
+    m_segment_start_pts = start_pts;
+    s_segments.add();
+    return true;
+}
+
+void Recorder::close_segment()
+{
+    if (!m_format_context)
+    {
+        return;
+    }
+
+    av_write_trailer(m_format_context);
+    avio_flush(m_format_context->pb);
+    flush_chunk();
+    m_writer.close();
+
+    av_freep(&m_format_context->pb->buffer);
+    avio_context_free(&m_format_context->pb);
+    avformat_free_context(m_format_context);
+    m_format_context = nullptr;
+}
+
+void Recorder::flush_chunk()
+{
+    if (m_chunk_size == 0)
+    {
+        return;
+    }
+
+    m_writer.write(m_chunk, m_chunk_size);
+    m_chunk = nullptr;
+    m_chunk_size = 0;
+}
+
+int Recorder::write_output(void *opaque, const uint8_t *data, int size)
+{
+    auto recorder = static_cast<Recorder *>(opaque);
+
+    for (int offset = 0; offset < size;)
+    {
+        if (!recorder->m_chunk)
+        {
+            recorder->m_chunk = DiskWriter::allocate_chunk();
+        }
+
+        auto count = std::min<size_t>(size - offset, DiskWriter::CHUNK_SIZE - recorder->m_chunk_size);
+        memcpy(recorder->m_chunk + recorder->m_chunk_size, data + offset, count);
+        recorder->m_chunk_size += count;
+        offset += count;
+
+        // Only full chunks are written before the segment ends
+        if (recorder->m_chunk_size == DiskWriter::CHUNK_SIZE)
+        {
+            recorder->flush_chunk();
+        }
+    }
+
+    return size;
+}
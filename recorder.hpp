@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "disk_writer.hpp"
+#include "metrics.hpp"
+#include "packet_ring.hpp"
+#include "pipeline_stage.hpp"
+
+// Records encoded packets into fragmented MP4 segments of RECORD_SEGMENT_USEC, split on keyframes.
+// Packets are shared with the live stream by reference. Muxing and disk writes run on their own
+// threads, so a slow card costs recorded packets, never encoder time.
+// In RecordMode::OnEvent, packets go to a pre-event ring instead until a trigger
+class Recorder
+{
+public:
+    // Segments are named after the stream, e.g. recordings/stream-20240101-120000-250.mp4
+    Recorder(std::string name, const AVCodecParameters *codec_params, AVRational time_base);
+    Recorder(const Recorder &other) = delete;
+    Recorder &operator=(const Recorder &other) = delete;
+    ~Recorder();
+
+    // Never blocks. Called from a single thread
+    void push_packet(const AVPacket *packet);
+
+    // Starts or extends an event recording. Safe to call from any thread
+    void trigger() { m_triggered->store(true, std::memory_order_relaxed); }
+
+private:
+    void record_packet(AVPacket *packet);
+    bool in_event(const AVPacket *packet);
+    void write_packet(AVPacket *packet);
+    bool open_segment(int64_t start_pts);
+    void close_segment();
+    void flush_chunk();
+    static int write_output(void *opaque, const uint8_t *data, int size);
+
+    std::string m_name;
+    AVCodecParameters *m_codec_params = avcodec_parameters_alloc();
+    AVRational m_time_base;
+
+    // Producer side. Packets after a dropped one are useless until the next keyframe
+    bool m_waiting_keyframe = true;
+
+    // Owned by the record stage
+    AVFormatContext *m_format_context = nullptr;
+    int64_t m_segment_start_pts = AV_NOPTS_VALUE;
+    uint8_t *m_chunk = nullptr;
+    size_t m_chunk_size = 0;
+
+    // Shared with the trigger route, which may outlive the recorder for a moment
+    std::shared_ptr<std::atomic_bool> m_triggered = std::make_shared<std::atomic_bool>(false);
+    std::string m_trigger_path;
+    std::unique_ptr<PacketRing> m_pre_event = nullptr;
+    int64_t m_event_end_pts = AV_NOPTS_VALUE;
+    Gauge m_pre_event_bytes;
+    Gauge m_pre_event_capacity;
+
+    DiskWriter m_writer;
+    PipelineStage<AVPacket *> m_record_stage;
+};
@@ -0,0 +1,178 @@
+#include "rtp_h264.hpp"
+
+#include <cstring>
+#include <random>
+
+extern "C"
+{
+#include <libavutil/base64.h>
+}
+
+#include <spdlog/spdlog.h>
+
+#include "h264.hpp"
+
+static const size_t FU_HEADER_SIZE = 2;
+
+static std::string base64(const std::vector<uint8_t> &data)
+{
+    std::string result(AV_BASE64_SIZE(data.size()), '\0');
+    av_base64_encode(result.data(), result.size(), data.data(), data.size());
+    result.resize(strlen(result.c_str()));
+
+    return result;
+}
+
+std::string rtp_h264_fmtp(const std::vector<uint8_t> &sps, const std::vector<uint8_t> &pps)
+{
+    // Until the first keyframe, clients take parameter sets from the stream
+    if (sps.size() >= 4 && !pps.empty())
+    {
+        return fmt::format("a=fmtp:{} packetization-mode=1;profile-level-id={:02x}{:02x}{:02x};sprop-parameter-sets={},{}\r\n",
+                           RTP_PAYLOAD_TYPE, sps[1], sps[2], sps[3], base64(sps), base64(pps));
+    }
+
+    return fmt::format("a=fmtp:{} packetization-mode=1\r\n", RTP_PAYLOAD_TYPE);
+}
+
+RtpH264Packetizer::RtpH264Packetizer(size_t mtu) : m_max_payload(mtu - RTP_HEADER_SIZE)
+{
+    std::random_device random;
+    m_ssrc = random();
+    m_sequence = random();
+}
+
+std::shared_ptr<RtpAccessUnit> RtpH264Packetizer::packetize(const uint8_t *data, size_t size,
+                                                             uint32_t timestamp, bool keyframe)
+{
+    auto result = std::make_shared<RtpAccessUnit>();
+    result->timestamp = timestamp;
+    result->keyframe = keyframe;
+
+    // Size the buffer upfront, so the access unit is written in one allocation
+    size_t buffer_size = 0;
+    size_t num_packets = 0;
+    size_t max_fragment = m_max_payload - FU_HEADER_SIZE;
+
+    for_each_nal_unit(data, size, [&](const NalUnit &nal)
+                      {
+                          if (nal.type() == NalType::AccessUnitDelimiter)
+                          {
+                              return;
+                          }
+
+                          if (nal.size <= m_max_payload)
+                          {
+                              num_packets++;
+                              buffer_size += RTP_INTERLEAVED_HEADER_SIZE + RTP_HEADER_SIZE + nal.size;
+                              return;
+                          }
+
+                          // The NAL header is replaced by FU indicator and header in every fragment
+                          auto fragments = (nal.size - 1 + max_fragment - 1) / max_fragment;
+                          num_packets += fragments;
+                          buffer_size += fragments * (RTP_INTERLEAVED_HEADER_SIZE + RTP_HEADER_SIZE + FU_HEADER_SIZE) +
+                                         nal.size - 1; });
+
+    if (num_packets == 0)
+    {
+        spdlog::warn("Encoded packet has no NAL units");
+        return nullptr;
+    }
+
+    result->buffer = av_buffer_alloc(buffer_size);
+    if (!result->buffer)
+    {
+        spdlog::error("Failed to allocate RTP buffer");
+        return nullptr;
+    }
+    result->packets.reserve(num_packets);
+
+    auto begin = result->buffer->data;
+    auto dst = begin;
+
+    for_each_nal_unit(data, size, [&](const NalUnit &nal)
+                      {
+                          switch (nal.type())
+                          {
+                          case NalType::AccessUnitDelimiter:
+                              return;
+                          case NalType::Sps:
+                              result->sps.assign(nal.data, nal.data + nal.size);
+                              break;
+                          case NalType::Pps:
+                              result->pps.assign(nal.data, nal.data + nal.size);
+                              break;
+                          default:
+                              break;
+                          }
+
+                          if (nal.size <= m_max_payload)
+                          {
+                              auto marker = result->packets.size() + 1 == num_packets;
+
+                              result->packets.push_back(RtpPacket{.offset = uint32_t(dst - begin + RTP_INTERLEAVED_HEADER_SIZE),
+                                                                  .size = uint32_t(RTP_HEADER_SIZE + nal.size)});
+                              dst = write_packet_header(dst, nal.size, marker, timestamp);
+                              memcpy(dst, nal.data, nal.size);
+                              dst += nal.size;
+                              return;
+                          }
+
+                          auto nal_header = nal.data[0];
+                          auto payload = nal.data + 1;
+                          auto remaining = nal.size - 1;
+                          bool first = true;
+
+                          while (remaining > 0)
+                          {
+                              auto fragment = std::min(remaining, max_fragment);
+                              bool last = fragment == remaining;
+                              auto marker = last && result->packets.size() + 1 == num_packets;
+
+                              result->packets.push_back(RtpPacket{.offset = uint32_t(dst - begin + RTP_INTERLEAVED_HEADER_SIZE),
+                                                                  .size = uint32_t(RTP_HEADER_SIZE + FU_HEADER_SIZE + fragment)});
+                              dst = write_packet_header(dst, FU_HEADER_SIZE + fragment, marker, timestamp);
+
+                              // FU indicator keeps NRI, FU header carries the original type
+                              *dst++ = (nal_header & 0xe0) | (uint8_t)NalType::FuA;
+                              *dst++ = (first ? 0x80 : 0) | (last ? 0x40 : 0) | (nal_header & 0x1f);
+                              memcpy(dst, payload, fragment);
+
+                              dst += fragment;
+                              payload += fragment;
+                              remaining -= fragment;
+                              first = false;
+                          } });
+
+    return result;
+}
+
+uint8_t *RtpH264Packetizer::write_packet_header(uint8_t *dst, size_t payload_size, bool marker, uint32_t timestamp)
+{
+    auto packet_size = RTP_HEADER_SIZE + payload_size;
+
+    // Interleaved header for channel 0
+    dst[0] = '$';
+    dst[1] = 0;
+    dst[2] = packet_size >> 8;
+    dst[3] = packet_size & 0xff;
+    dst += RTP_INTERLEAVED_HEADER_SIZE;
+
+    auto sequence = m_sequence++;
+
+    dst[0] = 0x80; // Version 2
+    dst[1] = (marker ? 0x80 : 0) | RTP_PAYLOAD_TYPE;
+    dst[2] = sequence >> 8;
+    dst[3] = sequence & 0xff;
+    dst[4] = timestamp >> 24;
+    dst[5] = timestamp >> 16;
+    dst[6] = timestamp >> 8;
+    dst[7] = timestamp & 0xff;
+    dst[8] = m_ssrc >> 24;
+    dst[9] = m_ssrc >> 16;
+    dst[10] = m_ssrc >> 8;
+    dst[11] = m_ssrc & 0xff;
+
+    return dst + RTP_HEADER_SIZE;
+}
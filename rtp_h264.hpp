@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include <libavutil/buffer.h>
+}
+
+static const size_t RTP_HEADER_SIZE = 12;
+// '$', channel and 16-bit length preceding each RTP packet on an RTSP connection
+static const size_t RTP_INTERLEAVED_HEADER_SIZE = 4;
+static const uint8_t RTP_PAYLOAD_TYPE = 96;
+static const uint32_t RTP_CLOCK_RATE = 90000;
+
+// Position of an RTP packet inside the access unit buffer, excluding the interleaved header
+struct RtpPacket
+{
+    uint32_t offset;
+    uint32_t size;
+};
+
+// All RTP packets of one access unit, packetized once and shared by every client. Each packet is
+// preceded by an interleaved header for channel 0, so TCP clients send the whole buffer as is and
+// datagram transports send the packets one by one
+struct RtpAccessUnit
+{
+    RtpAccessUnit() = default;
+    RtpAccessUnit(const RtpAccessUnit &other) = delete;
+    RtpAccessUnit &operator=(const RtpAccessUnit &other) = delete;
+    ~RtpAccessUnit()
+    {
+        av_buffer_unref(&buffer);
+    }
+
+    AVBufferRef *buffer = nullptr;
+    std::vector<RtpPacket> packets = {};
+    uint32_t timestamp = 0;
+    bool keyframe = false;
+    // Sensor timestamp of the frame, on the monotonic clock
+    uint64_t capture_time_usec = 0;
+
+    // Parameter sets carried by this access unit, if any
+    std::vector<uint8_t> sps = {};
+    std::vector<uint8_t> pps = {};
+};
+
+// SDP format parameters line of the stream. Parameter sets are included if known
+std::string rtp_h264_fmtp(const std::vector<uint8_t> &sps, const std::vector<uint8_t> &pps);
+
+// RFC 6184 packetizer. NAL units that don't fit into the MTU are split into FU-A fragments
+class RtpH264Packetizer
+{
+public:
+    RtpH264Packetizer(size_t mtu);
+
+    std::shared_ptr<RtpAccessUnit> packetize(const uint8_t *data, size_t size, uint32_t timestamp, bool keyframe);
+
+    uint32_t ssrc() const { return m_ssrc; }
+
+private:
+    uint8_t *write_packet_header(uint8_t *dst, size_t payload_size, bool marker, uint32_t timestamp);
+
+    size_t m_max_payload;
+    uint32_t m_ssrc;
+    uint16_t m_sequence;
+};
@@ -0,0 +1,146 @@
+#include "rtp_multicast.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "globals.hpp"
+#include "http_server.hpp"
+#include "metrics.hpp"
+#include "socket_utils.hpp"
+
+// Enough for a large keyframe without growing
+static const size_t INITIAL_MESSAGES = 256;
+
+static Counter s_packets_sent("libcam_multicast_packets_total", "RTP packets sent to multicast groups");
+static Counter s_packets_dropped("libcam_multicast_dropped_packets_total", "RTP packets the multicast socket didn't take");
+static Counter s_send_calls("libcam_multicast_send_calls_total", "sendmmsg calls for multicast access units");
+
+// RTP takes the even port and RTCP the odd one after it
+static uint16_t next_port()
+{
+    static std::atomic<uint16_t> s_next_port = MULTICAST_BASE_PORT;
+    return s_next_port.fetch_add(2, std::memory_order_relaxed);
+}
+
+RtpMulticast::RtpMulticast(const std::string &stream_path, uint32_t ssrc)
+    : m_path(stream_path),
+      m_sdp_path(stream_path + MULTICAST_SDP_SUFFIX),
+      m_ssrc(ssrc),
+      m_port(next_port()),
+      m_fd(create_multicast_socket(MULTICAST_INTERFACE, MULTICAST_TTL, MULTICAST_LOOPBACK))
+{
+    m_group.sin_family = AF_INET;
+    m_group.sin_port = htons(m_port);
+    if (inet_pton(AF_INET, MULTICAST_GROUP, &m_group.sin_addr) != 1 || !IN_MULTICAST(ntohl(m_group.sin_addr.s_addr)))
+    {
+        spdlog::critical("Invalid multicast group {}", MULTICAST_GROUP);
+        close(m_fd);
+        throw;
+    }
+
+    m_messages.resize(INITIAL_MESSAGES);
+    m_iovecs.resize(INITIAL_MESSAGES);
+
+    update_sdp();
+    HttpServer::instance().route(m_sdp_path, [sdp = m_sdp](const HttpRequest &request, const std::shared_ptr<HttpConnection> &connection)
+                                 {
+                                     std::string text;
+                                     {
+                                         std::lock_guard guard(sdp->lock);
+                                         text = sdp->text;
+                                     }
+                                     connection->respond(200, "application/sdp", text); });
+
+    spdlog::info("Multicasting {} to {}:{}. SDP is served on http://0.0.0.0:{}{}", m_path, MULTICAST_GROUP, m_port,
+                 HTTP_PORT, m_sdp_path);
+}
+
+RtpMulticast::~RtpMulticast()
+{
+    HttpServer::instance().unroute(m_sdp_path);
+    close(m_fd);
+}
+
+void RtpMulticast::send(const RtpAccessUnit &access_unit)
+{
+    if (!access_unit.sps.empty() && !access_unit.pps.empty() &&
+        (access_unit.sps != m_sps || access_unit.pps != m_pps))
+    {
+        m_sps = access_unit.sps;
+        m_pps = access_unit.pps;
+        update_sdp();
+    }
+
+    auto count = access_unit.packets.size();
+    if (m_messages.size() < count)
+    {
+        m_messages.resize(count);
+        m_iovecs.resize(count);
+    }
+
+    for (size_t n = 0; n < count; n++)
+    {
+        auto &packet = access_unit.packets[n];
+        m_iovecs[n] = iovec{.iov_base = access_unit.buffer->data + packet.offset, .iov_len = packet.size};
+
+        auto &header = m_messages[n].msg_hdr;
+        header = msghdr{};
+        header.msg_name = &m_group;
+        header.msg_namelen = sizeof(m_group);
+        header.msg_iov = &m_iovecs[n];
+        header.msg_iovlen = 1;
+    }
+
+    // The kernel takes at most UIO_MAXIOV messages per call
+    size_t sent = 0;
+    while (sent < count)
+    {
+        auto ret = sendmmsg(m_fd, m_messages.data() + sent, count - sent, 0);
+        s_send_calls.add();
+
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                spdlog::warn("Failed to send multicast packets: {}", strerror(errno));
+            }
+            break;
+        }
+
+        sent += ret;
+    }
+
+    s_packets_sent.add(sent);
+    if (sent < count)
+    {
+        s_packets_dropped.add(count - sent);
+    }
+}
+
+void RtpMulticast::update_sdp()
+{
+    auto text = fmt::format("v=0\r\n"
+                            "o=- {} 1 IN IP4 {}\r\n"
+                            "s=libcam-rtsp {}\r\n"
+                            "c=IN IP4 {}/{}\r\n"
+                            "t=0 0\r\n"
+                            "m=video {} RTP/AVP {}\r\n"
+                            "a=rtpmap:{} H264/{}\r\n",
+                            m_ssrc, *MULTICAST_INTERFACE ? MULTICAST_INTERFACE : "0.0.0.0", m_path,
+                            MULTICAST_GROUP, MULTICAST_TTL, m_port, RTP_PAYLOAD_TYPE, RTP_PAYLOAD_TYPE, RTP_CLOCK_RATE);
+    text += rtp_h264_fmtp(m_sps, m_pps);
+
+    std::lock_guard guard(m_sdp->lock);
+    m_sdp->text = std::move(text);
+}
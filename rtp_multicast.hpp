@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "rtp_h264.hpp"
+
+// Sends every access unit to a multicast group. All its RTP packets go out in one sendmmsg call,
+// straight from the packetized buffer shared with the RTSP server, so receivers cost nothing
+class RtpMulticast
+{
+public:
+    // Takes the next port from MULTICAST_BASE_PORT and serves the SDP on the stream path with
+    // MULTICAST_SDP_SUFFIX
+    RtpMulticast(const std::string &stream_path, uint32_t ssrc);
+    RtpMulticast(const RtpMulticast &other) = delete;
+    RtpMulticast &operator=(const RtpMulticast &other) = delete;
+    ~RtpMulticast();
+
+    // Called from a single thread. Packets the socket can't take are dropped
+    void send(const RtpAccessUnit &access_unit);
+
+private:
+    // Shared with the SDP route, which may outlive the sender for a moment
+    struct Sdp
+    {
+        std::mutex lock;
+        std::string text;
+    };
+
+    void update_sdp();
+
+    std::string m_path;
+    std::string m_sdp_path;
+    uint32_t m_ssrc;
+    uint16_t m_port;
+    int m_fd;
+    sockaddr_in m_group = {};
+
+    std::vector<uint8_t> m_sps = {};
+    std::vector<uint8_t> m_pps = {};
+    std::shared_ptr<Sdp> m_sdp = std::make_shared<Sdp>();
+
+    // Message headers for the packets of an access unit. Grown to the largest one and reused
+    std::vector<mmsghdr> m_messages = {};
+    std::vector<iovec> m_iovecs = {};
+};
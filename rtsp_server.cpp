@@ -0,0 +1,614 @@
+#include "rtsp_server.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <random>
+
+#include <linux/sockios.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "clock.hpp"
+#include "globals.hpp"
+#include "socket_utils.hpp"
+
+static const size_t MAX_REQUEST_SIZE = 8192;
+static const char *TRACK = "track0";
+
+static std::string_view status_text(int status)
+{
+    switch (status)
+    {
+    case 200:
+        return "OK";
+    case 400:
+        return "Bad Request";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 454:
+        return "Session Not Found";
+    case 455:
+        return "Method Not Valid in This State";
+    case 461:
+        return "Unsupported Transport";
+    default:
+        return "Unknown";
+    }
+}
+
+// Path of an RTSP URL without the track suffix, e.g. rtsp://host:8554/stream/track0 -> /stream
+static std::string media_path(std::string_view url)
+{
+    if (auto scheme = url.find("://"); scheme != std::string_view::npos)
+    {
+        auto path_start = url.find('/', scheme + 3);
+        url = path_start == std::string_view::npos ? "/" : url.substr(path_start);
+    }
+
+    if (url.ends_with(TRACK))
+    {
+        url.remove_suffix(strlen(TRACK));
+    }
+
+    while (url.size() > 1 && url.ends_with('/'))
+    {
+        url.remove_suffix(1);
+    }
+
+    return std::string(url);
+}
+
+RtspMedia::RtspMedia(std::string path, uint32_t ssrc, std::function<void()> request_keyframe,
+                     CongestionCallback report_congestion)
+    : m_path(std::move(path)), m_ssrc(ssrc), m_request_keyframe(std::move(request_keyframe)),
+      m_report_congestion(std::move(report_congestion)),
+      m_latency_probe("RTSP " + m_path)
+{
+}
+
+std::string RtspMedia::sdp() const
+{
+    auto sdp = fmt::format("v=0\r\n"
+                           "o=- {} 1 IN IP4 0.0.0.0\r\n"
+                           "s=libcam-rtsp\r\n"
+                           "c=IN IP4 0.0.0.0\r\n"
+                           "t=0 0\r\n"
+                           "a=control:*\r\n"
+                           "m=video 0 RTP/AVP {}\r\n"
+                           "a=rtpmap:{} H264/{}\r\n"
+                           "a=control:{}\r\n",
+                           m_ssrc, RTP_PAYLOAD_TYPE, RTP_PAYLOAD_TYPE, RTP_CLOCK_RATE, TRACK);
+
+    return sdp + rtp_h264_fmtp(m_sps, m_pps);
+}
+
+void RtspMedia::add_viewer(const std::shared_ptr<RtspConnection> &connection)
+{
+    m_viewers.push_back(connection);
+    spdlog::info("RTSP viewer joined {}. Viewers: {}", m_path, m_viewers.size());
+
+    if (m_gop.empty())
+    {
+        if (m_request_keyframe)
+        {
+            spdlog::debug("No cached GOP. Requesting keyframe");
+            m_keyframe_requested_usec = monotonic_usec();
+            m_request_keyframe();
+        }
+        return;
+    }
+
+    for (auto &access_unit : m_gop)
+    {
+        connection->deliver(access_unit);
+    }
+}
+
+void RtspMedia::publish(const std::shared_ptr<RtpAccessUnit> &access_unit)
+{
+    if (!access_unit->sps.empty())
+    {
+        m_sps = access_unit->sps;
+    }
+    if (!access_unit->pps.empty())
+    {
+        m_pps = access_unit->pps;
+    }
+
+    auto size = access_unit->buffer->size;
+
+    if (access_unit->keyframe)
+    {
+        m_gop.clear();
+        m_gop_bytes = 0;
+    }
+
+    if (access_unit->keyframe || !m_gop.empty())
+    {
+        if (m_gop_bytes + size <= RTSP_GOP_CACHE_MAX_BYTES)
+        {
+            m_gop.push_back(access_unit);
+            m_gop_bytes += size;
+        }
+        else
+        {
+            spdlog::debug("GOP exceeds the cache size. Dropping cached GOP");
+            m_gop.clear();
+            m_gop_bytes = 0;
+        }
+    }
+
+    std::erase_if(m_viewers, [](auto &viewer)
+                  { return viewer.expired() || viewer.lock()->is_closed(); });
+
+    OutputCongestion worst = {.queued_bytes = 0, .blocked_usec = 0};
+    bool sent = false;
+    bool waiting_keyframe = false;
+    for (auto &viewer : m_viewers)
+    {
+        auto connection = viewer.lock();
+        sent |= connection->deliver(access_unit);
+        waiting_keyframe |= connection->waiting_keyframe();
+
+        auto congestion = connection->congestion();
+        worst.queued_bytes = std::max(worst.queued_bytes, congestion.queued_bytes);
+        worst.blocked_usec = std::max(worst.blocked_usec, congestion.blocked_usec);
+    }
+
+    if (m_report_congestion)
+    {
+        m_report_congestion(worst);
+    }
+
+    // With intra refresh, the encoder only sends IDR frames on request, so a viewer that skipped
+    // to the next keyframe would wait forever
+    auto now = monotonic_usec();
+    if (waiting_keyframe && m_request_keyframe && now - m_keyframe_requested_usec >= (uint64_t)GOP_SIZE * 1000000 / FPS)
+    {
+        spdlog::debug("RTSP viewer of {} is waiting for a keyframe. Requesting one", m_path);
+        m_keyframe_requested_usec = now;
+        m_request_keyframe();
+    }
+
+    // Only access units a viewer wrote to its socket in full count, queued ones haven't left yet
+    if (sent)
+    {
+        m_latency_probe.record(access_unit->capture_time_usec);
+    }
+}
+
+void RtspMedia::detach()
+{
+    m_request_keyframe = nullptr;
+    m_report_congestion = nullptr;
+    m_gop.clear();
+    m_gop_bytes = 0;
+}
+
+RtspConnection::RtspConnection(RtspServer &server, int fd) : m_server(server), m_fd(fd)
+{
+}
+
+RtspConnection::~RtspConnection()
+{
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+    }
+}
+
+bool RtspConnection::deliver(const std::shared_ptr<RtpAccessUnit> &access_unit)
+{
+    if (is_closed())
+    {
+        return false;
+    }
+
+    if (m_send_queue.bytes() > RTSP_MAX_QUEUED_BYTES)
+    {
+        if (SLOW_CLIENT_POLICY == SlowClientPolicy::Disconnect)
+        {
+            spdlog::warn("RTSP client is too slow. Disconnecting");
+            close();
+            return false;
+        }
+
+        spdlog::warn("RTSP client is too slow. Skipping to the next keyframe");
+        m_send_queue.drop_pending();
+        m_waiting_keyframe = true;
+    }
+
+    // Inter frames are useless without the frames they reference
+    if (m_waiting_keyframe && !access_unit->keyframe)
+    {
+        return false;
+    }
+    m_waiting_keyframe = false;
+
+    m_send_queue.push(access_unit->buffer, access_unit->buffer->data, access_unit->buffer->size);
+    flush();
+
+    return !is_closed() && m_send_queue.empty();
+}
+
+OutputCongestion RtspConnection::congestion() const
+{
+    if (is_closed())
+    {
+        return OutputCongestion{.queued_bytes = 0, .blocked_usec = 0};
+    }
+
+    // Data the kernel hasn't sent yet, or that the client hasn't acknowledged
+    int unsent_bytes = 0;
+    if (ioctl(m_fd, SIOCOUTQ, &unsent_bytes) != 0)
+    {
+        unsent_bytes = 0;
+    }
+
+    return OutputCongestion{.queued_bytes = m_send_queue.bytes() + unsent_bytes,
+                            .blocked_usec = m_blocked_since_usec ? monotonic_usec() - m_blocked_since_usec : 0};
+}
+
+void RtspConnection::close()
+{
+    if (is_closed())
+    {
+        return;
+    }
+
+    m_send_queue.clear();
+    m_server.remove_connection(m_fd);
+    ::close(m_fd);
+    m_fd = -1;
+}
+
+void RtspConnection::on_events(uint32_t events)
+{
+    if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+    {
+        close();
+        return;
+    }
+
+    if (events & EPOLLIN)
+    {
+        on_readable();
+    }
+
+    if (!is_closed() && (events & EPOLLOUT))
+    {
+        flush();
+    }
+}
+
+void RtspConnection::on_readable()
+{
+    char data[2048];
+
+    while (!is_closed())
+    {
+        auto size = recv(m_fd, data, sizeof(data), MSG_DONTWAIT);
+        if (size == 0)
+        {
+            close();
+            return;
+        }
+
+        if (size < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                close();
+            }
+            break;
+        }
+
+        m_request_data.append(data, size);
+    }
+
+    size_t consumed;
+    while (!is_closed() && (consumed = handle_message(m_request_data)) > 0)
+    {
+        m_request_data.erase(0, consumed);
+    }
+
+    if (m_request_data.size() > MAX_REQUEST_SIZE)
+    {
+        spdlog::warn("RTSP request is too large");
+        close();
+    }
+}
+
+size_t RtspConnection::handle_message(std::string_view data)
+{
+    // Interleaved RTCP receiver reports are skipped
+    if (data.starts_with('$'))
+    {
+        if (data.size() < RTP_INTERLEAVED_HEADER_SIZE)
+        {
+            return 0;
+        }
+
+        size_t size = RTP_INTERLEAVED_HEADER_SIZE + (((uint8_t)data[2] << 8) | (uint8_t)data[3]);
+        return data.size() >= size ? size : 0;
+    }
+
+    auto header_end = data.find("\r\n\r\n");
+    if (header_end == std::string_view::npos)
+    {
+        return 0;
+    }
+
+    Headers headers;
+    auto lines = data.substr(0, header_end);
+    auto request_line = lines.substr(0, lines.find("\r\n"));
+
+    for (auto line_start = request_line.size() + 2; line_start < lines.size();)
+    {
+        auto line_end = std::min(lines.find("\r\n", line_start), lines.size());
+        auto line = lines.substr(line_start, line_end - line_start);
+        auto separator = line.find(':');
+
+        if (separator != std::string_view::npos)
+        {
+            std::string name(line.substr(0, separator));
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+            auto value = line.substr(separator + 1);
+            while (value.starts_with(' '))
+            {
+                value.remove_prefix(1);
+            }
+
+            headers[name] = value;
+        }
+
+        line_start = line_end + 2;
+    }
+
+    // Request bodies, e.g. of GET_PARAMETER, are ignored
+    size_t body_size = headers.contains("content-length") ? strtoul(headers["content-length"].c_str(), nullptr, 10) : 0;
+    size_t message_size = header_end + 4 + body_size;
+    if (data.size() < message_size)
+    {
+        return 0;
+    }
+
+    auto method_end = request_line.find(' ');
+    auto url_end = request_line.find(' ', method_end + 1);
+    if (method_end == std::string_view::npos || url_end == std::string_view::npos)
+    {
+        respond(400, headers);
+        return message_size;
+    }
+
+    handle_request(std::string(request_line.substr(0, method_end)),
+                   std::string(request_line.substr(method_end + 1, url_end - method_end - 1)), headers);
+
+    return message_size;
+}
+
+void RtspConnection::handle_request(const std::string &method, const std::string &url, const Headers &headers)
+{
+    spdlog::debug("RTSP request: {} {}", method, url);
+
+    if (method == "OPTIONS")
+    {
+        respond(200, headers, "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, GET_PARAMETER\r\n");
+        return;
+    }
+
+    if (method == "GET_PARAMETER")
+    {
+        respond(200, headers);
+        return;
+    }
+
+    if (method == "TEARDOWN")
+    {
+        respond(200, headers);
+        m_close_after_flush = true;
+        flush();
+        return;
+    }
+
+    auto media = m_server.find_media(media_path(url));
+    if (!media)
+    {
+        respond(404, headers);
+        return;
+    }
+
+    if (method == "DESCRIBE")
+    {
+        auto base = url.ends_with('/') ? url : url + "/";
+        respond(200, headers, fmt::format("Content-Base: {}\r\nContent-Type: application/sdp\r\n", base), media->sdp());
+    }
+    else if (method == "SETUP")
+    {
+        auto transport = headers.find("transport");
+        if (transport == headers.end() || transport->second.find("RTP/AVP/TCP") == std::string::npos)
+        {
+            respond(461, headers);
+            return;
+        }
+
+        if (m_session.empty())
+        {
+            std::random_device random;
+            m_session = fmt::format("{:08x}", random());
+        }
+
+        m_media = media;
+        respond(200, headers, "Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n");
+    }
+    else if (method == "PLAY")
+    {
+        if (m_media != media)
+        {
+            respond(455, headers);
+            return;
+        }
+
+        respond(200, headers, "Range: npt=0.000-\r\n");
+        if (!m_playing)
+        {
+            m_playing = true;
+            m_media->add_viewer(shared_from_this());
+        }
+    }
+    else
+    {
+        respond(405, headers);
+    }
+}
+
+void RtspConnection::respond(int status, const Headers &headers, std::string_view extra_headers, std::string_view body)
+{
+    auto cseq = headers.find("cseq");
+
+    auto response = fmt::format("RTSP/1.0 {} {}\r\n"
+                                "CSeq: {}\r\n"
+                                "Server: libcam-rtsp\r\n",
+                                status, status_text(status), cseq != headers.end() ? cseq->second : "0");
+
+    if (!m_session.empty())
+    {
+        response += fmt::format("Session: {};timeout=60\r\n", m_session);
+    }
+
+    response += extra_headers;
+    response += fmt::format("Content-Length: {}\r\n\r\n", body.size());
+    response += body;
+
+    m_send_queue.push(response);
+    flush();
+}
+
+void RtspConnection::flush()
+{
+    if (is_closed())
+    {
+        return;
+    }
+
+    if (!m_send_queue.flush(m_fd))
+    {
+        close();
+        return;
+    }
+
+    if (m_send_queue.empty())
+    {
+        m_blocked_since_usec = 0;
+    }
+    else if (!m_blocked_since_usec)
+    {
+        m_blocked_since_usec = monotonic_usec();
+    }
+
+    if (m_send_queue.empty() && m_close_after_flush)
+    {
+        close();
+        return;
+    }
+
+    // Only wait for writability while there is something left to write
+    bool waiting_writable = !m_send_queue.empty();
+    if (waiting_writable != m_waiting_writable)
+    {
+        m_waiting_writable = waiting_writable;
+        m_server.loop().modify(m_fd, EPOLLIN | EPOLLRDHUP | (waiting_writable ? EPOLLOUT : 0));
+    }
+}
+
+RtspServer::RtspServer(uint16_t port) : m_port(port), m_loop("rtsp")
+{
+    m_listen_fd = create_listen_socket(port);
+
+    m_loop.post([this]()
+                { m_loop.add(m_listen_fd, EPOLLIN, [this](uint32_t)
+                             { on_accept(); }); });
+
+    spdlog::info("RTSP server listening on port {}", port);
+}
+
+RtspServer::~RtspServer()
+{
+    m_loop.stop();
+    m_connections.clear();
+    ::close(m_listen_fd);
+}
+
+RtspServer &RtspServer::instance()
+{
+    static RtspServer server(RTSP_PORT);
+    return server;
+}
+
+std::shared_ptr<RtspMedia> RtspServer::add_media(const std::string &path, uint32_t ssrc, std::function<void()> request_keyframe,
+                                                 CongestionCallback report_congestion)
+{
+    auto media = std::make_shared<RtspMedia>(path, ssrc, std::move(request_keyframe), std::move(report_congestion));
+
+    m_loop.post([this, media]()
+                { m_media[media->path()] = media; });
+
+    spdlog::info("Stream is served on rtsp://0.0.0.0:{}{}", m_port, path);
+    return media;
+}
+
+void RtspServer::remove_media(const std::string &path)
+{
+    // Synchronous, so the media never calls back into a destroyed publisher
+    m_loop.post_and_wait([this, &path]()
+                         {
+                             if (auto it = m_media.find(path); it != m_media.end())
+                             {
+                                 it->second->detach();
+                                 m_media.erase(it);
+                             } });
+}
+
+void RtspServer::publish(const std::shared_ptr<RtspMedia> &media, std::shared_ptr<RtpAccessUnit> access_unit)
+{
+    m_loop.post([media, access_unit = std::move(access_unit)]()
+                { media->publish(access_unit); });
+}
+
+void RtspServer::on_accept()
+{
+    int fd;
+    while ((fd = accept_connection(m_listen_fd)) >= 0)
+    {
+        auto connection = std::make_shared<RtspConnection>(*this, fd);
+        m_connections[fd] = connection;
+
+        std::weak_ptr<RtspConnection> weak_connection = connection;
+        m_loop.add(fd, EPOLLIN | EPOLLRDHUP, [weak_connection](uint32_t events)
+                   {
+                       if (auto connection = weak_connection.lock())
+                       {
+                           connection->on_events(events);
+                       } });
+    }
+}
+
+std::shared_ptr<RtspMedia> RtspServer::find_media(const std::string &path) const
+{
+    auto it = m_media.find(path);
+    return it != m_media.end() ? it->second : nullptr;
+}
+
+void RtspServer::remove_connection(int fd)
+{
+    m_loop.remove(fd);
+    m_connections.erase(fd);
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "event_loop.hpp"
+#include "latency_probe.hpp"
+#include "send_queue.hpp"
+#include "rtp_h264.hpp"
+
+class RtspServer;
+class RtspConnection;
+
+// How far a viewer lags behind the stream
+struct OutputCongestion
+{
+    // Queued for the socket and still in its send buffer
+    size_t queued_bytes;
+    // Time the socket has been refusing data
+    uint64_t blocked_usec;
+};
+
+using CongestionCallback = std::function<void(const OutputCongestion &)>;
+
+// A stream mount. Lives on the server loop thread. Keeps the current GOP, so joining clients
+// start decoding immediately
+class RtspMedia
+{
+public:
+    // The congestion callback gets the worst viewer after every published access unit
+    RtspMedia(std::string path, uint32_t ssrc, std::function<void()> request_keyframe, CongestionCallback report_congestion);
+
+    const std::string &path() const { return m_path; }
+    std::string sdp() const;
+
+    void add_viewer(const std::shared_ptr<RtspConnection> &connection);
+    void publish(const std::shared_ptr<RtpAccessUnit> &access_unit);
+    // Called once the publisher is gone. Connected clients may still hold the media
+    void detach();
+
+private:
+    std::string m_path;
+    uint32_t m_ssrc;
+    std::function<void()> m_request_keyframe;
+    CongestionCallback m_report_congestion;
+    // Viewers that skipped to the next keyframe request one at most once per GOP
+    uint64_t m_keyframe_requested_usec = 0;
+
+    // Access units since the last keyframe. Empty if the GOP outgrew the cache
+    std::vector<std::shared_ptr<RtpAccessUnit>> m_gop = {};
+    size_t m_gop_bytes = 0;
+
+    std::vector<uint8_t> m_sps = {};
+    std::vector<uint8_t> m_pps = {};
+
+    std::vector<std::weak_ptr<RtspConnection>> m_viewers = {};
+
+    LatencyProbe m_latency_probe;
+};
+
+// An RTSP client. RTP is sent interleaved over the control connection
+class RtspConnection : public std::enable_shared_from_this<RtspConnection>
+{
+public:
+    RtspConnection(RtspServer &server, int fd);
+    RtspConnection(const RtspConnection &other) = delete;
+    RtspConnection &operator=(const RtspConnection &other) = delete;
+    ~RtspConnection();
+
+    // Queues the access unit according to the slow client policy. True if it was written to the
+    // socket in full right away
+    bool deliver(const std::shared_ptr<RtpAccessUnit> &access_unit);
+
+    void close();
+    bool is_closed() const { return m_fd < 0; }
+    // Set while inter frames are skipped until the next keyframe
+    bool waiting_keyframe() const { return m_waiting_keyframe; }
+
+    OutputCongestion congestion() const;
+
+private:
+    friend class RtspServer;
+
+    using Headers = std::map<std::string, std::string>;
+
+    void on_events(uint32_t events);
+    void on_readable();
+    // Returns the number of bytes consumed, or 0 if the message is incomplete
+    size_t handle_message(std::string_view data);
+    void handle_request(const std::string &method, const std::string &url, const Headers &headers);
+    void respond(int status, const Headers &headers, std::string_view extra_headers = "", std::string_view body = "");
+    void flush();
+
+    RtspServer &m_server;
+    int m_fd;
+
+    std::string m_request_data = {};
+    std::string m_session = {};
+    std::shared_ptr<RtspMedia> m_media = nullptr;
+    // Set once the connection is a viewer of the media. Repeated PLAY requests don't add it again
+    bool m_playing = false;
+    bool m_waiting_keyframe = true;
+    bool m_waiting_writable = false;
+    bool m_close_after_flush = false;
+    // Set while the send queue holds data the socket didn't take
+    uint64_t m_blocked_since_usec = 0;
+
+    SendQueue m_send_queue = {};
+};
+
+// Built-in RTSP server. Every encoded access unit is packetized once and the same buffer is
+// queued to all clients, so a slow client never blocks the encoder or other clients
+class RtspServer
+{
+public:
+    RtspServer(uint16_t port);
+    RtspServer(const RtspServer &other) = delete;
+    RtspServer &operator=(const RtspServer &other) = delete;
+    ~RtspServer();
+
+    // Process-wide server listening on RTSP_PORT
+    static RtspServer &instance();
+
+    // Safe to call from any thread
+    std::shared_ptr<RtspMedia> add_media(const std::string &path, uint32_t ssrc, std::function<void()> request_keyframe,
+                                         CongestionCallback report_congestion);
+    void remove_media(const std::string &path);
+    void publish(const std::shared_ptr<RtspMedia> &media, std::shared_ptr<RtpAccessUnit> access_unit);
+
+    EventLoop &loop() { return m_loop; }
+
+private:
+    friend class RtspConnection;
+
+    void on_accept();
+    std::shared_ptr<RtspMedia> find_media(const std::string &path) const;
+    void remove_connection(int fd);
+
+    uint16_t m_port;
+    int m_listen_fd = -1;
+    std::unordered_map<std::string, std::shared_ptr<RtspMedia>> m_media = {};
+    std::unordered_map<int, std::shared_ptr<RtspConnection>> m_connections = {};
+
+    EventLoop m_loop;
+};
@@ -0,0 +1,134 @@
+#include "send_queue.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <spdlog/spdlog.h>
+
+static const size_t MAX_IOVECS = 64;
+
+SendQueue::~SendQueue()
+{
+    clear();
+}
+
+void SendQueue::push(const AVBufferRef *buffer, const uint8_t *data, size_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+    auto buffer_ref = av_buffer_ref(buffer);
+    if (!buffer_ref)
+    {
+        spdlog::error("Failed to reference send buffer");
+        return;
+    }
+
+    m_chunks.push_back(Chunk{.buffer = buffer_ref, .data = data, .size = size});
+    m_bytes += size;
+}
+
+void SendQueue::push(std::string_view data)
+{
+    if (data.empty())
+    {
+        return;
+    }
+
+    auto buffer = av_buffer_alloc(data.size());
+    if (!buffer)
+    {
+        spdlog::error("Failed to allocate send buffer");
+        return;
+    }
+
+    memcpy(buffer->data, data.data(), data.size());
+    m_chunks.push_back(Chunk{.buffer = buffer, .data = buffer->data, .size = data.size()});
+    m_bytes += data.size();
+}
+
+bool SendQueue::flush(int fd)
+{
+    while (!m_chunks.empty())
+    {
+        iovec iov[MAX_IOVECS];
+        size_t count = std::min(m_chunks.size(), MAX_IOVECS);
+
+        for (size_t n = 0; n < count; n++)
+        {
+            auto &chunk = m_chunks[n];
+            auto offset = n == 0 ? m_offset : 0;
+
+            iov[n] = iovec{.iov_base = (void *)(chunk.data + offset), .iov_len = chunk.size - offset};
+        }
+
+        msghdr message{};
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+
+        auto written = sendmsg(fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        m_bytes -= written;
+
+        // Drop fully written chunks
+        size_t remaining = written;
+        while (remaining > 0)
+        {
+            auto &chunk = m_chunks.front();
+            auto left = chunk.size - m_offset;
+
+            if (remaining < left)
+            {
+                m_offset += remaining;
+                break;
+            }
+
+            remaining -= left;
+            m_offset = 0;
+            av_buffer_unref(&chunk.buffer);
+            m_chunks.pop_front();
+        }
+    }
+
+    return true;
+}
+
+void SendQueue::clear()
+{
+    for (auto &chunk : m_chunks)
+    {
+        av_buffer_unref(&chunk.buffer);
+    }
+
+    m_chunks.clear();
+    m_offset = 0;
+    m_bytes = 0;
+}
+
+void SendQueue::drop_pending()
+{
+    auto keep = m_offset > 0 ? 1 : 0;
+
+    while (m_chunks.size() > (size_t)keep)
+    {
+        auto &chunk = m_chunks.back();
+        m_bytes -= chunk.size;
+        av_buffer_unref(&chunk.buffer);
+        m_chunks.pop_back();
+    }
+}
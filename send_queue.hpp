@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string_view>
+
+extern "C"
+{
+#include <libavutil/buffer.h>
+}
+
+// Outgoing data of a non-blocking socket. Chunks reference refcounted buffers, so a payload sent to
+// many clients is stored once
+class SendQueue
+{
+public:
+    SendQueue() = default;
+    SendQueue(const SendQueue &other) = delete;
+    SendQueue &operator=(const SendQueue &other) = delete;
+    ~SendQueue();
+
+    // Queues a range of the buffer, taking a new reference to it
+    void push(const AVBufferRef *buffer, const uint8_t *data, size_t size);
+    // Queues a copy of the data
+    void push(std::string_view data);
+
+    // Writes as much as the socket accepts. Returns false on a socket error
+    bool flush(int fd);
+    void clear();
+    // Drops everything except a partially written chunk, so the stream stays framed
+    void drop_pending();
+
+    bool empty() const { return m_chunks.empty(); }
+    size_t bytes() const { return m_bytes; }
+    size_t chunks() const { return m_chunks.size(); }
+
+private:
+    struct Chunk
+    {
+        AVBufferRef *buffer;
+        const uint8_t *data;
+        size_t size;
+    };
+
+    std::deque<Chunk> m_chunks = {};
+    // Bytes of the front chunk already written
+    size_t m_offset = 0;
+    size_t m_bytes = 0;
+};
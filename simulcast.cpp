@@ -0,0 +1,166 @@
+#include "simulcast.hpp"
+
+#include <algorithm>
+#include <bit>
+
+extern "C"
+{
+#include <libavutil/imgutils.h>
+}
+
+#include <spdlog/spdlog.h>
+
+#include "clock.hpp"
+#include "globals.hpp"
+#include "metrics.hpp"
+
+static Histogram s_pyramid_time("libcam_pyramid_seconds", "Time to build the downscaling pyramid of a frame");
+static Counter s_frames_dropped("libcam_frames_dropped_total", "Frames dropped before decoding or encoding", "stage=\"pyramid\"");
+
+Simulcast::Simulcast(Metadata metadata, const std::string &stream_path)
+    : m_metadata(metadata),
+      m_format(metadata.raw_pixel_format() != AV_PIX_FMT_NONE ? metadata.raw_pixel_format() : ENCODER_SRC_FORMAT),
+      m_pyramid_stage("pyramid", FRAME_QUEUE_DEPTH, [this](AVFrame *&frame)
+                      { encode_layers(frame); av_frame_free(&frame); })
+{
+    int levels = 1;
+    for (auto &layer : SIMULCAST_LAYERS)
+    {
+        if (layer.scale_divisor < 1 || !std::has_single_bit((unsigned)layer.scale_divisor))
+        {
+            spdlog::critical("Simulcast scale divisor {} is not a power of two", layer.scale_divisor);
+            throw;
+        }
+
+        auto level = std::countr_zero((unsigned)layer.scale_divisor);
+        levels = std::max(levels, level + 1);
+
+        auto layer_metadata = m_metadata;
+        layer_metadata.width = FramePyramid::level_size(m_metadata.width, level);
+        layer_metadata.height = FramePyramid::level_size(m_metadata.height, level);
+        layer_metadata.stride = layer_metadata.width;
+
+        spdlog::info("Simulcast layer {}x{} at {} kbit/s", layer_metadata.width, layer_metadata.height, layer.bit_rate / 1000);
+        m_layers.push_back(Layer{.level = level,
+                                 .encoder = std::make_unique<Encoder>(layer_metadata, stream_path + layer.path_suffix,
+                                                                      layer.bit_rate, layer.record)});
+    }
+
+    m_pyramid = std::make_unique<FramePyramid>(m_format, m_metadata.width, m_metadata.height, levels);
+    m_frame_pool = std::make_unique<FramePool>(m_format, m_metadata.width, m_metadata.height);
+}
+
+Simulcast::~Simulcast()
+{
+    m_pyramid_stage.stop();
+}
+
+void Simulcast::push_frame(const uint8_t *data, size_t size, uint64_t pts_usec)
+{
+    if (data == nullptr)
+    {
+        push_frame(nullptr);
+        return;
+    }
+
+    // Same as the encoder, the data doesn't outlive the call, so the frame is copied
+    uint8_t *src_data[4] = {};
+    int src_linesize[4] = {};
+    auto frame_size = av_image_fill_arrays(src_data, src_linesize, data, m_format, m_metadata.width, m_metadata.height, 1);
+    if (frame_size < 0 || size < (size_t)frame_size)
+    {
+        spdlog::error("Invalid raw frame size: {}", size);
+        return;
+    }
+
+    auto frame = m_frame_pool->get();
+    if (!frame)
+    {
+        spdlog::error("Failed to allocate raw frame");
+        return;
+    }
+
+    av_image_copy(frame->data, frame->linesize, (const uint8_t **)src_data, src_linesize, m_format,
+                  m_metadata.width, m_metadata.height);
+    frame->pts = pts_usec;
+    frame->pkt_dts = pts_usec;
+
+    push_frame(frame);
+    av_frame_free(&frame);
+}
+
+void Simulcast::push_frame(const AVFrame *frame)
+{
+    if (!frame)
+    {
+        m_pyramid_stage.push_wait(nullptr);
+        return;
+    }
+
+    if (skips_frame(frame->pts))
+    {
+        return;
+    }
+
+    auto frame_ref = av_frame_clone(frame);
+    if (!frame_ref)
+    {
+        spdlog::error("Failed to reference frame for simulcast");
+        return;
+    }
+
+    if (!m_pyramid_stage.push(frame_ref))
+    {
+        spdlog::warn("Simulcast is saturated. Dropping frame {}", frame->pts);
+        s_frames_dropped.add();
+        av_frame_free(&frame_ref);
+    }
+}
+
+size_t Simulcast::backlog() const
+{
+    // Layers encode in parallel, so the slowest one holds the pipeline back
+    size_t encoder_backlog = 0;
+    for (auto &layer : m_layers)
+    {
+        encoder_backlog = std::max(encoder_backlog, layer.encoder->backlog());
+    }
+
+    return m_pyramid_stage.size() + encoder_backlog;
+}
+
+bool Simulcast::skips_frame(uint64_t pts_usec) const
+{
+    // Layers shed frames on their own. The pyramid is only skipped if no layer needs the frame
+    return std::ranges::all_of(m_layers, [pts_usec](auto &layer)
+                               { return layer.encoder->skips_frame(pts_usec); });
+}
+
+void Simulcast::encode_layers(AVFrame *frame)
+{
+    if (!frame)
+    {
+        for (auto &layer : m_layers)
+        {
+            layer.encoder->push_frame(nullptr);
+        }
+        return;
+    }
+
+    auto start_nsec = monotonic_nsec();
+    if (!m_pyramid->build(frame))
+    {
+        spdlog::error("Failed to build the frame pyramid");
+        s_frames_dropped.add();
+        m_pyramid->release();
+        return;
+    }
+    s_pyramid_time.record(monotonic_nsec() - start_nsec);
+
+    // Encoders take their own references, so the pyramid lets go of the camera buffer right away
+    for (auto &layer : m_layers)
+    {
+        layer.encoder->push_frame(m_pyramid->level(layer.level));
+    }
+    m_pyramid->release();
+}
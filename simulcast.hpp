@@ -0,0 +1,47 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "metadata.hpp"
+#include "iframe_sink.hpp"
+#include "encoder.hpp"
+#include "frame_pool.hpp"
+#include "frame_pyramid.hpp"
+#include "pipeline_stage.hpp"
+
+// Encodes every frame once per SIMULCAST_LAYERS entry. The downscaling pyramid is built once per
+// frame on a dedicated thread and its levels are passed to the encoders by reference
+class Simulcast final : public IFrameSink
+{
+public:
+    Simulcast(Metadata metadata, const std::string &stream_path);
+    ~Simulcast();
+
+    void push_frame(const uint8_t *data, size_t size, uint64_t pts_usec) override;
+    void push_frame(const AVFrame *frame) override;
+    size_t backlog() const override;
+    bool skips_frame(uint64_t pts_usec) const override;
+
+private:
+    struct Layer
+    {
+        int level;
+        std::unique_ptr<Encoder> encoder;
+    };
+
+    void encode_layers(AVFrame *frame);
+
+    Metadata m_metadata;
+    AVPixelFormat m_format;
+
+    std::vector<Layer> m_layers = {};
+    std::unique_ptr<FramePyramid> m_pyramid = nullptr;
+
+    // Backs copies of raw frames pushed by pointer
+    std::unique_ptr<FramePool> m_frame_pool = nullptr;
+
+    // Nullptr marks end of stream
+    PipelineStage<AVFrame *> m_pyramid_stage;
+};
@@ -0,0 +1,98 @@
+#include "socket_utils.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+// Room for a few keyframes. Multicast has no backpressure, so a burst beyond it is dropped
+static const int MULTICAST_SEND_BUFFER_BYTES = 1024 * 1024;
+
+int create_listen_socket(uint16_t port)
+{
+    auto fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        spdlog::critical("Failed to create socket");
+        throw;
+    }
+
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    if (bind(fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0)
+    {
+        spdlog::critical("Failed to listen on port {}: {}", port, strerror(errno));
+        close(fd);
+        throw;
+    }
+
+    return fd;
+}
+
+int accept_connection(int listen_fd)
+{
+    while (true)
+    {
+        auto fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                spdlog::warn("Failed to accept connection: {}", strerror(errno));
+            }
+            return -1;
+        }
+
+        int no_delay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+        return fd;
+    }
+}
+
+int create_multicast_socket(const std::string &interface_address, int ttl, bool loopback)
+{
+    auto fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        spdlog::critical("Failed to create multicast socket");
+        throw;
+    }
+
+    unsigned char multicast_ttl = ttl;
+    unsigned char multicast_loop = loopback;
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &multicast_ttl, sizeof(multicast_ttl));
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &multicast_loop, sizeof(multicast_loop));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &MULTICAST_SEND_BUFFER_BYTES, sizeof(MULTICAST_SEND_BUFFER_BYTES));
+
+    if (!interface_address.empty())
+    {
+        in_addr address{};
+        if (inet_pton(AF_INET, interface_address.c_str(), &address) != 1 ||
+            setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &address, sizeof(address)) != 0)
+        {
+            spdlog::critical("Failed to send multicast through {}: {}", interface_address, strerror(errno));
+            close(fd);
+            throw;
+        }
+    }
+
+    return fd;
+}
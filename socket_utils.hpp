@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Non-blocking TCP socket listening on all interfaces. Throws on failure
+int create_listen_socket(uint16_t port);
+
+// Accepts a pending connection as a non-blocking socket with Nagle disabled. Returns -1 if there is none
+int accept_connection(int listen_fd);
+
+// Non-blocking UDP socket for sending to multicast groups through the interface with the given
+// address, or the default one if it's empty. Throws on failure
+int create_multicast_socket(const std::string &interface_address, int ttl, bool loopback);
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Bounded lock-free single-producer/single-consumer ring buffer.
+// Capacity is rounded up to the next power of two.
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(size_t capacity)
+        : m_mask(round_up(capacity) - 1), m_slots(m_mask + 1)
+    {
+    }
+    SpscQueue(const SpscQueue &other) = delete;
+    SpscQueue &operator=(const SpscQueue &other) = delete;
+
+    // Producer side. Returns false if the queue is full
+    bool push(const T &item)
+    {
+        auto tail = m_tail.load(std::memory_order_relaxed);
+
+        if (tail - m_cached_head > m_mask)
+        {
+            m_cached_head = m_head.load(std::memory_order_acquire);
+            if (tail - m_cached_head > m_mask)
+            {
+                return false;
+            }
+        }
+
+        m_slots[tail & m_mask] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false if the queue is empty
+    bool pop(T &item)
+    {
+        auto head = m_head.load(std::memory_order_relaxed);
+
+        if (head == m_cached_tail)
+        {
+            m_cached_tail = m_tail.load(std::memory_order_acquire);
+            if (head == m_cached_tail)
+            {
+                return false;
+            }
+        }
+
+        item = m_slots[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const
+    {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+
+private:
+    static size_t round_up(size_t value)
+    {
+        size_t result = 1;
+        while (result < value)
+        {
+            result <<= 1;
+        }
+
+        return result;
+    }
+
+    static constexpr size_t CACHE_LINE = 64;
+
+    const size_t m_mask;
+    std::vector<T> m_slots;
+
+    // Consumer-owned
+    alignas(CACHE_LINE) std::atomic<size_t> m_head = 0;
+    size_t m_cached_tail = 0;
+
+    // Producer-owned
+    alignas(CACHE_LINE) std::atomic<size_t> m_tail = 0;
+    size_t m_cached_head = 0;
+};
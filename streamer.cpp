@@ -3,114 +3,79 @@
 #include <spdlog/spdlog.h>
 
 #include "globals.hpp"
-
-Streamer::Streamer(const AVCodecParameters *codec_params)
+#include "metrics.hpp"
+
+static Counter s_bytes_muxed("libcam_muxed_bytes_total", "Encoded bytes handed to the RTSP server");
+static Counter s_packets_muxed("libcam_muxed_packets_total", "Encoded packets handed to the RTSP server");
+static Counter s_write_errors("libcam_mux_errors_total", "Encoded packets that failed to be muxed");
+
+Streamer::Streamer(std::string path, const AVCodecParameters *codec_params, AVRational time_base,
+                   std::function<void()> request_keyframe, CongestionCallback report_congestion)
+    : m_path(std::move(path)),
+      m_time_base(time_base),
+      m_packetizer(RTP_MTU),
+      m_media(RtspServer::instance().add_media(m_path, m_packetizer.ssrc(), std::move(request_keyframe),
+                                               std::move(report_congestion))),
+      m_mux_stage("mux", PACKET_QUEUE_DEPTH, [this](AVPacket *&packet)
+                  { write_packet(packet); av_packet_free(&packet); })
 {
-    // print_supported_protocols();
-    avformat_network_init();
-    init(codec_params);
+    if (MULTICAST)
+    {
+        m_multicast = std::make_unique<RtpMulticast>(m_path, m_packetizer.ssrc());
+    }
+
+    spdlog::info("Streaming {}x{} H.264 on {}", codec_params->width, codec_params->height, m_path);
 }
 
 Streamer::~Streamer()
 {
-    av_write_trailer(m_format_context);
-    avio_close(m_format_context->pb);
-    avformat_free_context(m_format_context);
+    m_mux_stage.stop();
+    RtspServer::instance().remove_media(m_path);
 }
 
-void Streamer::push_packet(AVPacket *packet)
+void Streamer::push_packet(const AVPacket *packet)
 {
-    auto pb = m_format_context->pb;
-
-    if (!m_format_context->pb)
+    // Encoded packets are refcounted, so this only takes a reference
+    auto packet_ref = av_packet_clone(packet);
+    if (!packet_ref)
     {
+        spdlog::error("Failed to reference packet for muxing");
+        s_write_errors.add();
         return;
     }
 
-    if (m_time_base == 0)
-    {
-        m_time_base = packet->pts;
-    }
-
-    packet->pts -= m_time_base;
-    packet->dts -= m_time_base;
-
-    spdlog::trace("Frame sending: {} {}", packet->pts, packet->dts);
-    auto ret = av_interleaved_write_frame(m_format_context, packet);
-    if (ret < 0)
-    {
-        spdlog::warn("Error muxing packet");
-    }
+    // Dropping encoded data would break decoding until the next keyframe, so apply backpressure instead.
+    // The encoder sheds raw frames when it falls behind
+    m_mux_stage.push_wait(packet_ref);
 }
 
-void Streamer::init(const AVCodecParameters *codec_params)
+void Streamer::write_packet(AVPacket *packet)
 {
-    avformat_alloc_output_context2(&m_format_context, NULL, "flv", STREAM_URL); // RTMP
-    if (!m_format_context)
+    if (m_start_pts == AV_NOPTS_VALUE)
     {
-        spdlog::critical("Could not create output context");
-        throw;
+        m_start_pts = packet->pts;
     }
 
-    // Create output AVStream according to input AVStream
-    AVStream *out_stream = avformat_new_stream(m_format_context, nullptr);
-    avcodec_parameters_copy(out_stream->codecpar, codec_params);
-    if (!out_stream)
-    {
-        spdlog::critical("Failed allocating output stream");
-        throw;
-    }
-
-    av_dump_format(m_format_context, 0, STREAM_URL, 1);
-
-    auto worker = std::thread(std::bind(&Streamer::connection_listener, this));
-    worker.detach();
-}
-
-void Streamer::print_supported_protocols()
-{
-    void *opaque = NULL;
-    const char *name;
-
-    spdlog::info("Supported file protocols:\nInput:");
-    while ((name = avio_enum_protocols(&opaque, 0)))
-    {
-        spdlog::info("  {}", name);
-    }
+    auto timestamp = av_rescale_q(packet->pts - m_start_pts, m_time_base, AVRational{1, RTP_CLOCK_RATE});
 
-    printf("Output:\n");
-    while ((name = avio_enum_protocols(&opaque, 1)))
+    spdlog::trace("Frame sending: {} {}", packet->pts, packet->dts);
+    auto access_unit = m_packetizer.packetize(packet->data, packet->size, timestamp, packet->flags & AV_PKT_FLAG_KEY);
+    if (!access_unit)
     {
-        spdlog::info("  {}", name);
+        spdlog::warn("Error packetizing packet");
+        s_write_errors.add();
+        return;
     }
-}
-
-void Streamer::connection_listener()
-{
-    AVDictionary *options = nullptr;
-    av_dict_set(&options, "rtmp_listen", "1", 0);
-    av_dict_set(&options, "rtmp_live", "live", 0);
-
-    // while (true)
-    // {
-    auto ret = avio_open2(&m_format_context->pb, STREAM_URL, AVIO_FLAG_WRITE, nullptr, &options);
-    if (ret < 0)
-    {
-        char error[AV_ERROR_MAX_STRING_SIZE] = {};
-        av_strerror(ret, error, AV_ERROR_MAX_STRING_SIZE);
+    access_unit->capture_time_usec = av_rescale_q(packet->pts, m_time_base, AVRational{1, 1000000});
 
-        spdlog::critical("Could not open output URL: {}: {}", STREAM_URL, error);
-        throw;
-    }
+    s_bytes_muxed.add(packet->size);
+    s_packets_muxed.add();
 
-    ret = avformat_write_header(m_format_context, nullptr);
-    if (ret < 0)
+    // Sent from this thread, before the server loop gets the access unit
+    if (m_multicast)
     {
-        spdlog::critical("Error occurred when opening output URL");
-        throw;
+        m_multicast->send(*access_unit);
     }
 
-    spdlog::info("Incoming connection");
-
-    // std::this_thread::sleep_for(std::chrono::seconds(30));
-}
\ No newline at end of file
+    RtspServer::instance().publish(m_media, std::move(access_unit));
+}
@@ -2,22 +2,36 @@
 
 extern "C"
 {
-#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
 }
 
+#include "pipeline_stage.hpp"
+#include "rtp_h264.hpp"
+#include "rtp_multicast.hpp"
+#include "rtsp_server.hpp"
+
+// Publishes encoded packets on the RTSP server and, with MULTICAST, to a multicast group.
+// Packetization runs on a dedicated thread
 class Streamer
 {
 public:
-    Streamer(const AVCodecParameters *codec_params);
+    // The keyframe request callback is invoked when a client joins and there is no cached GOP.
+    // Congestion of the slowest client is reported after every packet, on the server thread
+    Streamer(std::string path, const AVCodecParameters *codec_params, AVRational time_base,
+             std::function<void()> request_keyframe, CongestionCallback report_congestion);
     ~Streamer();
-    void push_packet(AVPacket *packet);
+    void push_packet(const AVPacket *packet);
 
 private:
-    void init(const AVCodecParameters *codec_params);
-    void print_supported_protocols();
-    void connection_listener();
+    void write_packet(AVPacket *packet);
+
+    std::string m_path;
+    AVRational m_time_base;
+    int64_t m_start_pts = AV_NOPTS_VALUE;
+
+    RtpH264Packetizer m_packetizer;
+    std::shared_ptr<RtspMedia> m_media;
+    std::unique_ptr<RtpMulticast> m_multicast = nullptr;
 
-    AVFormatContext *m_format_context = nullptr;
-    AVIOContext *m_io_context = NULL;
-    uint64_t m_time_base = 0;
+    PipelineStage<AVPacket *> m_mux_stage;
 };
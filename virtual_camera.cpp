@@ -0,0 +1,255 @@
+#include "virtual_camera.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <fstream>
+#include <iterator>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/imgutils.h>
+}
+
+#include <spdlog/spdlog.h>
+
+#include "clock.hpp"
+#include "globals.hpp"
+#include "jpeg.hpp"
+
+// One second of a moving pattern. Encoders see motion, but frames repeat
+static const size_t PATTERN_FRAMES = FPS;
+static const auto BACKLOG_POLL_INTERVAL = std::chrono::microseconds(100);
+
+static std::atomic_bool s_run = true;
+static void signal_handler(int signal)
+{
+    s_run = false;
+}
+
+VirtualCamera::VirtualCamera(VirtualCameraConfig config) : m_config(std::move(config))
+{
+    if (m_config.replay_path.empty())
+    {
+        generate_pattern();
+    }
+    else
+    {
+        load_replay();
+    }
+
+    if (m_frames.empty())
+    {
+        spdlog::critical("Virtual camera has no frames");
+        throw;
+    }
+
+    spdlog::info("Virtual camera: {} {}x{} frames at {}", m_frames.size(), m_config.metadata.width,
+                 m_config.metadata.height, m_config.fps ? fmt::format("{} fps", m_config.fps) : "full speed");
+
+    m_sink = create_frame_sink(m_config.metadata, STREAM_PATH);
+
+    m_worker = std::thread(&VirtualCamera::worker_thread, this);
+    std::signal(SIGINT, signal_handler);
+    std::signal(SIGTERM, signal_handler);
+}
+
+VirtualCamera::~VirtualCamera()
+{
+    m_worker.join();
+
+    m_sink->push_frame(nullptr, 0, 0);
+    m_sink.reset();
+}
+
+void VirtualCamera::load_replay()
+{
+    std::ifstream file(m_config.replay_path, std::ios::binary);
+    if (!file)
+    {
+        spdlog::critical("Failed to open replay file {}", m_config.replay_path);
+        throw;
+    }
+
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    if (m_config.metadata.format == Format::MJPEG)
+    {
+        load_replay_jpeg(data);
+        return;
+    }
+
+    auto frame_size = av_image_get_buffer_size(m_config.metadata.raw_pixel_format(), m_config.metadata.width,
+                                               m_config.metadata.height, 1);
+
+    for (size_t offset = 0; offset + frame_size <= data.size(); offset += frame_size)
+    {
+        m_frames.emplace_back(data.begin() + offset, data.begin() + offset + frame_size);
+    }
+
+    if (data.size() % frame_size)
+    {
+        spdlog::warn("Replay file ends with a partial frame");
+    }
+}
+
+void VirtualCamera::load_replay_jpeg(const std::vector<uint8_t> &data)
+{
+    static const uint8_t EOI[] = {0xff, 0xd9};
+
+    size_t offset = 0;
+    while (offset + 4 <= data.size())
+    {
+        // Entropy-coded data never contains markers, so the first EOI after the scan ends the frame
+        auto header = parse_jpeg_header(data.data() + offset, data.size() - offset);
+        if (!header)
+        {
+            spdlog::warn("Invalid JPEG frame at offset {} of the replay file", offset);
+            break;
+        }
+
+        auto scan = data.begin() + (header->scan_data - data.data());
+        auto end = std::search(scan, data.end(), std::begin(EOI), std::end(EOI));
+        if (end == data.end())
+        {
+            spdlog::warn("Replay file ends with a partial frame");
+            break;
+        }
+
+        m_frames.emplace_back(data.begin() + offset, end + sizeof(EOI));
+        offset = end + sizeof(EOI) - data.begin();
+    }
+}
+
+void VirtualCamera::generate_pattern()
+{
+    auto width = m_config.metadata.width;
+    auto height = m_config.metadata.height;
+    auto luma_size = width * height;
+    auto chroma_size = luma_size / 4;
+
+    // Diagonal bars sliding to the right, over a slowly changing tint
+    std::vector<std::vector<uint8_t>> yuv_frames(PATTERN_FRAMES, std::vector<uint8_t>(luma_size + 2 * chroma_size));
+
+    for (size_t n = 0; n < PATTERN_FRAMES; n++)
+    {
+        auto &frame = yuv_frames[n];
+        auto shift = n * width / PATTERN_FRAMES;
+
+        for (size_t y = 0; y < height; y++)
+        {
+            for (size_t x = 0; x < width; x++)
+            {
+                frame[y * width + x] = ((x + y + shift) / 32) % 2 ? 200 : 40 + (x + shift) % 64;
+            }
+        }
+
+        std::fill_n(frame.begin() + luma_size, chroma_size, 64 + n * 128 / PATTERN_FRAMES);
+        std::fill_n(frame.begin() + luma_size + chroma_size, chroma_size, 192 - n * 128 / PATTERN_FRAMES);
+    }
+
+    switch (m_config.metadata.format)
+    {
+    case Format::YUV420:
+        m_frames = std::move(yuv_frames);
+        break;
+    case Format::NV12:
+        for (auto &yuv_frame : yuv_frames)
+        {
+            auto &frame = m_frames.emplace_back(yuv_frame.begin(), yuv_frame.begin() + luma_size);
+            frame.resize(luma_size + 2 * chroma_size);
+
+            for (size_t n = 0; n < chroma_size; n++)
+            {
+                frame[luma_size + 2 * n] = yuv_frame[luma_size + n];
+                frame[luma_size + 2 * n + 1] = yuv_frame[luma_size + chroma_size + n];
+            }
+        }
+        break;
+    case Format::MJPEG:
+        if (!encode_jpeg(yuv_frames))
+        {
+            spdlog::critical("Failed to encode test pattern");
+            throw;
+        }
+        break;
+    }
+}
+
+bool VirtualCamera::encode_jpeg(const std::vector<std::vector<uint8_t>> &yuv_frames)
+{
+    auto codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    if (!codec)
+    {
+        spdlog::error("JPEG encoder not found");
+        return false;
+    }
+
+    auto context = avcodec_alloc_context3(codec);
+    auto frame = av_frame_alloc();
+    auto packet = av_packet_alloc();
+    bool result = context && frame && packet;
+
+    if (result)
+    {
+        context->width = m_config.metadata.width;
+        context->height = m_config.metadata.height;
+        context->pix_fmt = AV_PIX_FMT_YUVJ420P;
+        context->time_base = AVRational{1, FPS};
+        result = avcodec_open2(context, codec, nullptr) == 0;
+    }
+
+    for (size_t n = 0; result && n < yuv_frames.size(); n++)
+    {
+        frame->format = context->pix_fmt;
+        frame->width = context->width;
+        frame->height = context->height;
+        frame->pts = n;
+        av_image_fill_arrays(frame->data, frame->linesize, yuv_frames[n].data(), context->pix_fmt,
+                             context->width, context->height, 1);
+
+        result = avcodec_send_frame(context, frame) == 0 && avcodec_receive_packet(context, packet) == 0;
+        if (result)
+        {
+            m_frames.emplace_back(packet->data, packet->data + packet->size);
+            av_packet_unref(packet);
+        }
+    }
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&context);
+
+    return result;
+}
+
+void VirtualCamera::worker_thread()
+{
+    auto interval = std::chrono::microseconds(m_config.fps ? 1000000 / m_config.fps : 0);
+    auto next_frame = std::chrono::steady_clock::now();
+
+    while (s_run && (m_config.max_frames == 0 || m_delivered < m_config.max_frames))
+    {
+        // Without a frame rate, wait for the sink instead of overrunning it, so nothing is dropped
+        if (!m_config.fps && m_sink->backlog() + 1 >= FRAME_QUEUE_DEPTH)
+        {
+            std::this_thread::sleep_for(BACKLOG_POLL_INTERVAL);
+            continue;
+        }
+
+        auto &frame = m_frames[m_delivered % m_frames.size()];
+
+        // Frames are stamped on delivery, like sensor timestamps, so latency probes stay meaningful
+        m_sink->push_frame(frame.data(), frame.size(), monotonic_usec());
+        m_delivered++;
+
+        if (m_config.fps)
+        {
+            next_frame += interval;
+            std::this_thread::sleep_until(next_frame);
+        }
+    }
+
+    spdlog::info("Virtual camera delivered {} frames", m_delivered.load());
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "iframe_sink.hpp"
+#include "metadata.hpp"
+
+struct VirtualCameraConfig
+{
+    Metadata metadata;
+    // Recorded frames to loop. A test pattern is generated if empty
+    std::string replay_path;
+    // 0 delivers frames as fast as the sink takes them
+    int fps;
+    // 0 delivers frames until the process is interrupted
+    uint64_t max_frames;
+};
+
+// Camera stand-in for machines without a sensor. Frames are loaded or generated upfront and
+// delivered to the same sinks as camera frames, so the pipeline can be run and benchmarked anywhere
+class VirtualCamera final
+{
+public:
+    VirtualCamera(VirtualCameraConfig config);
+    VirtualCamera(const VirtualCamera &other) = delete;
+    VirtualCamera &operator=(const VirtualCamera &other) = delete;
+    // Waits until all frames are delivered, then flushes the sink
+    ~VirtualCamera();
+
+    uint64_t delivered() const { return m_delivered; }
+
+private:
+    void load_replay();
+    void load_replay_jpeg(const std::vector<uint8_t> &data);
+    void generate_pattern();
+    bool encode_jpeg(const std::vector<std::vector<uint8_t>> &yuv_frames);
+    void worker_thread();
+
+    VirtualCameraConfig m_config;
+    std::vector<std::vector<uint8_t>> m_frames = {};
+    std::unique_ptr<IFrameSink> m_sink = nullptr;
+
+    std::atomic<uint64_t> m_delivered = 0;
+    std::thread m_worker = {};
+};